@@ -28,50 +28,95 @@ class Binaural_decoder implements Runnable
 {
     final int rate = 44100;
 
+    /* Maximum size of the rendered output cache, in octets. */
+    final long cache_max = 512L << 20;
+
     final Messenger service;
     final String sequence;
+    final String cache_dir;
+    final byte[] restore_state;	/* Checkpoint to start from, or null */
+    String current_seq;		/* Sequence playing, after the reloads */
     AudioTrack track;
-    int play_pos = 0;
-    int play_pos_notify = 0;
-    char command = 0;
+    long play_pos = 0;		/* Frames written to the track */
+    long played = 0;		/* Frames it played */
+    int play_head = 0;		/* Last getPlaybackHeadPosition(), which wraps */
+    long clock_sync = 0;	/* play_pos when to send the clock again */
+    long checkpoint_due = 0;	/* play_pos when to send a checkpoint */
+    volatile char command = 0;	/* Read without locking by out() */
+    String reload_text;		/* Sequence for the 'L' command */
+    StringBuilder stream_text;	/* Sequence still coming in, or null */
+    boolean stream_more;
+    volatile boolean stream_new = false;	/* Read without locking by out() */
+    boolean paused = false;
+    int track_frames;
+    int underruns = 0;
+
+    /* Range of the blocks written to the track, in frames: the small
+       ones while the user is looking, the large ones otherwise; the
+       track holds two of the largest. */
+    final int block_min = 512;
+    final int block_max = 8192;
 
-    Binaural_decoder(Messenger srv, String seq)
+    /* With more set, seq is only the beginning of the sequence, the rest
+       comes with append(); with state set, it goes on from that
+       checkpoint sent by a previous decoder. */
+    Binaural_decoder(Messenger srv, String seq, boolean more, String cache,
+	byte[] state)
     {
 	service = srv;
 	sequence = seq;
+	current_seq = seq;
+	cache_dir = cache;
+	restore_state = state;
+	if(more) {
+	    stream_text = new StringBuilder(seq);
+	    stream_more = true;
+	}
     }
 
     public void run()
     {
 	final int channels = AudioFormat.CHANNEL_OUT_STEREO;
 	final int format = AudioFormat.ENCODING_PCM_16BIT;
-	final int buffer_size =
-	    AudioTrack.getMinBufferSize(rate, channels, format) * 10;
+	final int buffer_size = Math.max(
+	    AudioTrack.getMinBufferSize(rate, channels, format) * 2,
+	    block_max * 4 * 2);
 	track = new AudioTrack(AudioManager.STREAM_MUSIC,
 	    rate, channels, format, buffer_size, AudioTrack.MODE_STREAM);
-	short[] t = new short[100];
 	try {
 	    sbagen_init();
 	    sbagen_set_parameters(rate, 0, 0, null);
-	    sbagen_parse_seq(sequence);
+	    sbagen_set_blocks(block_min, block_max);
+	    track_frames = buffer_size / 4;
+	    sbagen_report_output(track_frames, 0);
+	    sbagen_set_cache(cache_dir, cache_max);
+	    if(stream_text == null) {
+		sbagen_parse_seq(sequence);
+		int[] info = sbagen_get_info();
+		send_info(info[INFO_DURATION], info[INFO_CHANNELS], preview());
+		if(restore_state != null)
+		    restore(restore_state);
+	    } else {
+		stream_start();
+	    }
 	    track.play();
 	    sbagen_run();
-	    send_status(-1, null);
+	    send_status(null);
 	} catch(InterruptedException e) {
-	    send_status(-1, null);
+	    send_status(null);
 	} catch(Exception e) {
-	    send_status(-1, e.getMessage());
+	    send_status(e.getMessage());
 	}
 	sbagen_free_seq();
 	sbagen_exit();
     }
 
-    void send_status(int t, String e)
+    /* Tells the service that the decoder is done, with e on error. */
+    void send_status(String e)
     {
 	Message msg = Message.obtain(null, 0);
 	if(e == null) {
 	    msg.what = 't';
-	    msg.arg1 = t;
 	} else {
 	    msg.what = 'e';
 	    Bundle b = new Bundle(2);
@@ -84,6 +129,190 @@ class Binaural_decoder implements Runnable
 	}
     }
 
+    /* Number of points of the preview sent to the service, and most
+       channels it keeps: the preview has to fit in a binder transaction
+       to each client. */
+    final int PREVIEW_POINTS = 512;
+    static final int PREVIEW_CHANNELS = 8;
+
+    /* The preview of the sequence, down to its first PREVIEW_CHANNELS
+       channels. */
+    float[] preview()
+    {
+	float[] p = sbagen_preview(PREVIEW_POINTS);
+	int s = p.length / PREVIEW_POINTS, sc = 1 + 3 * PREVIEW_CHANNELS;
+	if(s <= sc)
+	    return p;
+	float[] r = new float[PREVIEW_POINTS * sc];
+	for(int i = 0; i < PREVIEW_POINTS; i++)
+	    System.arraycopy(p, i * s, r, i * sc, sc);
+	return r;
+    }
+
+    /*
+     * Tells the service the exact duration (-1 if endless) and the preview
+     * of the sequence.
+     */
+    void send_info(int d, int channels, float[] preview)
+    {
+	Message msg = Message.obtain(null, 'd', d, 0);
+	Bundle b = new Bundle(2);
+	b.putInt("channels", Math.min(channels, PREVIEW_CHANNELS));
+	b.putFloatArray("preview", preview);
+	msg.setData(b);
+	try {
+	    service.send(msg);
+	} catch(RemoteException x) {
+	}
+    }
+
+    /* Seconds between two clock messages while playing, to correct the
+       drift of the clocks of the clients. */
+    static final int CLOCK_SYNC_SECS = 10;
+
+    /*
+     * Tells the service that the playback clock started, stopped or
+     * jumped; it reads it with sbagen_get_clock().
+     */
+    void send_clock()
+    {
+	try {
+	    service.send(Message.obtain(null, 'c'));
+	} catch(RemoteException x) {
+	}
+    }
+
+    /* Seconds of playback between two checkpoints sent to the service. */
+    static final int CHECKPOINT_SECS = 15;
+
+    /*
+     * Sends the service a checkpoint of the playback with the sequence it
+     * belongs to, for it to go on from there if the process gets killed.
+     * Only from out(); not for a sequence coming in.
+     */
+    void send_checkpoint()
+    {
+	if(stream_text != null)
+	    return;
+	byte[] state = sbagen_checkpoint();
+	if(state == null)
+	    return;
+	Message msg = Message.obtain(null, 'k');
+	Bundle b = new Bundle(2);
+	b.putString("seq", current_seq);
+	b.putByteArray("state", state);
+	msg.setData(b);
+	try {
+	    service.send(msg);
+	} catch(RemoteException x) {
+	}
+    }
+
+    /* A checkpoint that does not fit plays from the start. */
+    void restore(byte[] state)
+    {
+	try {
+	    sbagen_restore(state);
+	} catch(IllegalArgumentException e) {
+	    send_warning(e.getMessage());
+	}
+    }
+
+    /* Tells sbagen how far the track played, from its head position. */
+    void report_played(boolean playing)
+    {
+	int head = track.getPlaybackHeadPosition();
+	played += head - play_head;
+	play_head = head;
+	sbagen_report_played(played, playing);
+    }
+
+    /* Tells the service about an error that does not stop the playback. */
+    void send_warning(String e)
+    {
+	Message msg = Message.obtain(null, 'w');
+	Bundle b = new Bundle(1);
+	b.putString("message", e);
+	msg.setData(b);
+	try {
+	    service.send(msg);
+	} catch(RemoteException x) {
+	}
+    }
+
+    /*
+     * Replaces the sequence being played with seq, keeping the position;
+     * on error, the old one goes on.
+     */
+    void reload_sequence(String seq)
+    {
+	try {
+	    sbagen_reload(seq);
+	    current_seq = seq;
+	    int[] info = sbagen_get_info();
+	    send_info(info[INFO_DURATION], info[INFO_CHANNELS], preview());
+	} catch(IllegalArgumentException e) {
+	    send_warning(e.getMessage());
+	}
+    }
+
+    /*
+     * Waits for enough of the sequence coming in to start playing it.
+     */
+    synchronized void stream_start() throws InterruptedException
+    {
+	stream_new = false;
+	while(!sbagen_stream(stream_text.toString(), stream_more)) {
+	    while(!stream_new) {
+		if(command == 'S')
+		    throw new InterruptedException();
+		try {
+		    wait();
+		} catch(InterruptedException e) {
+		}
+	    }
+	    stream_new = false;
+	}
+	stream_info();
+    }
+
+    /* Passes what came of the sequence since to sbagen. */
+    synchronized void stream_feed()
+    {
+	stream_new = false;
+	try {
+	    sbagen_stream(stream_text.toString(), stream_more);
+	    stream_info();
+	} catch(IllegalArgumentException e) {
+	    send_warning(e.getMessage());
+	}
+    }
+
+    /* The duration and preview are only known at the end. */
+    void stream_info()
+    {
+	int[] info = sbagen_get_info();
+	if(stream_more)
+	    send_info(-1, info[INFO_CHANNELS], null);
+	else
+	    send_info(info[INFO_DURATION], info[INFO_CHANNELS], preview());
+    }
+
+    /* Called by sbagen_run when playback caught up with the sequence
+       coming in. */
+    public synchronized int stream_wait() throws InterruptedException
+    {
+	while(!stream_new) {
+	    if(command != 0) {
+		obey_command();
+		continue;
+	    }
+	    wait();
+	}
+	stream_feed();
+	return 0;
+    }
+
     synchronized void obey_command() throws InterruptedException
     {
 	while(true) {
@@ -93,9 +322,19 @@ class Binaural_decoder implements Runnable
 		case 'S':
 		    throw new InterruptedException();
 		case 'P':
+		    paused = true;
 		    wait_new_command();
 		    break;
 		case 'R':
+		    paused = false;
+		    break;
+		case 'L':
+		    String seq = reload_text;
+		    reload_text = null;
+		    if(seq != null)
+			reload_sequence(seq);
+		    if(paused)
+			wait_new_command();
 		    break;
 		case 0:
 		    return;
@@ -109,34 +348,77 @@ class Binaural_decoder implements Runnable
     synchronized void wait_new_command()
     {
 	track.pause();
+	report_played(false);
+	send_clock();
+	if(play_pos > 0)	/* Not yet when restored paused */
+	    send_checkpoint();
 	while(command == 0) {
 	    try {
 		wait();
 	    } catch(InterruptedException e) {
 	    }
 	}
-	track.play();
+	if(command != 'L') {
+	    track.play();
+	    report_played(true);
+	    send_clock();
+	}
     }
 
-    /* Called by sbagen_run. */
-    public synchronized void out(short[] data) throws InterruptedException
+    /* Called by sbagen_run, with the same array every time; only takes
+       the lock when there is a command to obey. */
+    public void out(short[] data, int length) throws InterruptedException
     {
-	obey_command();
-	track.write(data, 0, data.length);
-	play_pos += data.length / 2;
-	if(play_pos >= play_pos_notify) {
-	    send_status((int)(1000.0 * play_pos / rate), null);
-	    play_pos_notify = play_pos + rate - 1;
-	    play_pos_notify -= play_pos_notify % rate;
+	if(command != 0)
+	    obey_command();
+	if(stream_new)
+	    stream_feed();
+	report_played(true);
+	/* The track ran dry if everything written so far was played. */
+	if(play_pos > 0 && play_pos - played <= 0) {
+	    sbagen_report_output(track_frames, ++underruns);
+	    clock_sync = play_pos;
+	}
+	track.write(data, 0, length);
+	play_pos += length / 2;
+	if(play_pos > clock_sync) {
+	    send_clock();
+	    clock_sync = play_pos + rate * CLOCK_SYNC_SECS;
+	}
+	if(play_pos > checkpoint_due) {
+	    send_checkpoint();
+	    checkpoint_due = play_pos + rate * CHECKPOINT_SECS;
 	}
     }
 
+    /* Called by the service when the user starts or stops looking. */
+    public void set_interactive(boolean on)
+    {
+	sbagen_set_mode(on ? MODE_INTERACTIVE : MODE_BACKGROUND);
+    }
+
     public synchronized void set_command(char c)
     {
 	command = c;
 	notify();
     }
 
+    /* Called by the service when the sequence playing was edited. */
+    public synchronized void reload(String seq)
+    {
+	reload_text = seq;
+	set_command('L');
+    }
+
+    /* Called by the service with the next part of the sequence. */
+    public synchronized void append(String text, boolean more)
+    {
+	stream_text.append(text);
+	stream_more = more;
+	stream_new = true;
+	notify();
+    }
+
     static {
 	System.loadLibrary("sbagen");
     }
@@ -144,9 +426,45 @@ class Binaural_decoder implements Runnable
     native void sbagen_init() throws OutOfMemoryError;
     native void sbagen_set_parameters(int rate, int prate, int fade,
 	String roll) throws IllegalArgumentException;
+    native void sbagen_set_cache(String dir, long max_size)
+	throws OutOfMemoryError;
+    native void sbagen_set_blocks(int min, int max)
+	throws IllegalArgumentException;
+    static final int MODE_INTERACTIVE = 0;	/* SBAGEN_MODE_* */
+    static final int MODE_BACKGROUND = 1;
+    native void sbagen_set_mode(int mode);
+    native void sbagen_report_output(int latency, int underruns);
+    native void sbagen_report_played(long frames, boolean playing);
+
+    /* Indexes in the array returned by sbagen_get_clock(). */
+    static final int CLOCK_RENDERED = 0;	/* Frames */
+    static final int CLOCK_AUDIBLE = 1;
+    static final int CLOCK_LATENCY = 2;
+    static final int CLOCK_TIME = 3;		/* ms from the start */
+    static final int CLOCK_PERIOD_START = 4;
+    static final int CLOCK_PERIOD_END = 5;
+    static final int CLOCK_PLAYING = 6;	/* 1 if moving on */
+    /* Lock-free, can be called from any thread; null before playback. */
+    native long[] sbagen_get_clock();
+    /* Only from out(); null if it cannot be taken there. */
+    native byte[] sbagen_checkpoint();
+    native void sbagen_restore(byte[] state) throws IllegalArgumentException;
     native void sbagen_exit();
     native void sbagen_parse_seq(String seq) throws IllegalArgumentException;
+    native void sbagen_reload(String seq) throws IllegalArgumentException;
+    native boolean sbagen_stream(String seq, boolean more)
+	throws IllegalArgumentException;
     native void sbagen_free_seq();
+
+    /* Indexes in the array returned by sbagen_get_info(). */
+    static final int INFO_DURATION = 0;	/* ms, -1 if endless */
+    static final int INFO_PERIODS = 1;
+    static final int INFO_CHANNELS = 2;
+    static final int INFO_TYPES = 3;	/* Bit 1 << SBAGEN_VOICE_* */
+    static final int INFO_PEAK = 4;	/* Total amplitude, % */
+    native int[] sbagen_get_info() throws IllegalArgumentException;
+    native float[] sbagen_preview(int n) throws IllegalArgumentException,
+	OutOfMemoryError;
     native void sbagen_run() throws IllegalArgumentException,
        InterruptedException;
 
@@ -15,27 +15,45 @@
 
 package org.cigaes.binaural_player;
 
+import java.io.ByteArrayOutputStream;
+import java.io.DataInputStream;
+import java.io.DataOutputStream;
+import java.io.File;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.IOException;
 import java.util.ArrayList;
-import java.util.regex.Matcher;
-import java.util.regex.Pattern;
+import java.util.Arrays;
+import java.util.Iterator;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.TimeUnit;
 
 import android.app.Notification;
 import android.app.PendingIntent;
 import android.app.Service;
+import android.content.BroadcastReceiver;
+import android.content.Context;
 import android.content.Intent;
+import android.content.IntentFilter;
 import android.os.Bundle;
 import android.os.IBinder;
 import android.os.Handler;
 import android.os.Message;
 import android.os.Messenger;
 import android.os.RemoteException;
+import android.os.SystemClock;
 
 public class Binaural_player extends Service implements Handler.Callback
 {
-    int playing_time = -1;
+    int playing_time = -1;	/* ms, at playing_time_at */
+    long playing_time_at;	/* SystemClock.uptimeMillis() */
+    boolean playing_time_moving = false;
     boolean playing_paused = false;
     String playing_sequence;
     int playing_total_time;
+    float[] playing_preview;
+    int playing_channels;
 
     /*
      * Client interraction
@@ -63,35 +81,57 @@ public class Binaural_player extends Service implements Handler.Callback
 	switch(msg.what) {
 	    case 'I':
 		clients.add(msg.replyTo);
+		decoder_update_mode();
+		client_send_sequence(msg.replyTo);
+		client_send_preview(msg.replyTo);
 		client_send_status(msg.replyTo);
 		client_send_time(msg.replyTo);
 		client_send_pause(msg.replyTo);
 		return true;
 	    case 'J':
 		clients.remove(msg.replyTo);
+		decoder_update_mode();
 		exit_if_finished();
 		return true;
 	    case 'R':
 		b = msg.getData();
-		decoder_start(b.getString("seq"));
+		decoder_start(b.getString("seq"), b.getBoolean("cache"),
+		    b.getString("path"), b.getBoolean("more"), null);
+		return true;
+	    case 'A':
+		b = msg.getData();
+		decoder_append(b.getString("seq"), b.getBoolean("more"));
 		return true;
 	    case 'C':
 		handle_client_control((char)msg.arg1);
 		return true;
 	    case 't':
-		playing_paused = false;
-		if(msg.arg1 >= 0) {
-		    playing_time = msg.arg1;
-		    client_send_time(null);
-		} else {
-		    decoder_reap();
-		}
+		decoder_reap();
+		return true;
+	    case 'c':
+		clock_update();
+		return true;
+	    case 'k':
+		b = msg.getData();
+		resume_save(b.getString("seq"), b.getByteArray("state"));
+		return true;
+	    case 'd':
+		playing_total_time = msg.arg1;
+		b = msg.getData();
+		preview_update(b.getFloatArray("preview"), b.getInt("channels"));
+		client_send_status(null);
+		if(playing_paused)	/* Reloaded while paused */
+		    client_send_pause(null);
 		return true;
 	    case 'e':
 		b = msg.getData();
 		client_send_error(null, b.getString("message"));
 		decoder_reap();
 		return true;
+	    case 'w':
+		b = msg.getData();
+		client_send_error(null, b.getString("message"));
+		return true;
 	    default:
 		warn("Unknown message: %s", msg);
 		return false;
@@ -115,17 +155,54 @@ public class Binaural_player extends Service implements Handler.Callback
 	}
     }
 
+    /*
+     * The status is sent often and stays small; the text of the sequence
+     * and its preview go in their own messages, only when they change.
+     */
     void client_send_status(Messenger client)
     {
 	Bundle b = new Bundle(2);
-	b.putString("seq", playing_sequence);
+	b.putBoolean("playing", playing_sequence != null);
 	b.putInt("duration", playing_total_time);
 	client_send_message(client, 'S', 0, b);
     }
 
+    void client_send_sequence(Messenger client)
+    {
+	Bundle b = new Bundle(1);
+	b.putString("seq", playing_sequence);
+	client_send_message(client, 'Q', 0, b);
+    }
+
+    void client_send_preview(Messenger client)
+    {
+	Bundle b = new Bundle(2);
+	b.putInt("channels", playing_channels);
+	b.putFloatArray("preview", playing_preview);
+	client_send_message(client, 'V', 0, b);
+    }
+
+    /* A reload that does not change the preview does not resend it. */
+    void preview_update(float[] preview, int channels)
+    {
+	if(channels == playing_channels &&
+	    Arrays.equals(preview, playing_preview))
+	    return;
+	playing_preview = preview;
+	playing_channels = channels;
+	client_send_preview(null);
+    }
+
+    /*
+     * The clients move the time on by themselves while it is moving, from
+     * the same uptime clock, until the next message.
+     */
     void client_send_time(Messenger client)
     {
-	client_send_message(client, 'T', playing_time, null);
+	Bundle b = new Bundle(2);
+	b.putLong("at", playing_time_at);
+	b.putBoolean("moving", playing_time_moving);
+	client_send_message(client, 'T', playing_time, b);
     }
 
     void client_send_pause(Messenger client)
@@ -150,16 +227,25 @@ public class Binaural_player extends Service implements Handler.Callback
 
     void client_send_message(Messenger client, Message msg)
     {
-	if(client == null) {
-	    for(Messenger c : clients)
-		client_send_message(c, msg);
+	if(client != null) {
+	    if(!client_send(client, msg))
+		clients.remove(client);
 	    return;
 	}
+	for(Iterator<Messenger> i = clients.iterator(); i.hasNext(); )
+	    if(!client_send(i.next(), msg))
+		i.remove();
+    }
+
+    /* False if the client is gone. */
+    boolean client_send(Messenger client, Message msg)
+    {
 	try {
 	    client.send(msg);
+	    return true;
 	} catch(RemoteException e) {
 	    warn("client_send: exception: %s", e);
-	    clients.remove(client);
+	    return false;
 	}
     }
 
@@ -170,25 +256,102 @@ public class Binaural_player extends Service implements Handler.Callback
     Binaural_decoder decoder;
     Thread decoder_thread;
     String playing_next;
+    boolean playing_next_cache;
+    String playing_next_path;
+    boolean playing_next_more;
+    String playing_path;	/* File the sequence playing comes from */
+    boolean playing_cache;
+    boolean playing_more;	/* More of it is to come with 'A' */
 
-    void decoder_start(String seq)
+    /*
+     * Plays seq; if it is an edited version of the sequence playing, from
+     * the same file, the decoder reloads it where it is instead, while the
+     * same text starts again. With more set, seq is only the beginning of
+     * the sequence, the rest comes with decoder_append(); with state set,
+     * it goes on from that checkpoint.
+     */
+    void decoder_start(String seq, boolean cache, String path, boolean more,
+	byte[] state)
     {
+	if(decoder != null && playing_next == null && path != null &&
+	    path.equals(playing_path) && !seq.equals(playing_sequence)) {
+	    decoder.reload(seq);
+	    playing_sequence = seq;
+	    client_send_sequence(null);
+	    client_send_status(null);
+	    client_send_pause(null);
+	    return;
+	}
 	if(decoder != null) {
 	    decoder_stop();
 	    playing_next = seq;
+	    playing_next_cache = cache;
+	    playing_next_path = path;
+	    playing_next_more = more;
 	    return;
 	}
 	playing_sequence = seq;
-	playing_total_time = parse_total_time(seq);
+	playing_path = path;
+	playing_cache = cache;
+	playing_more = more;
+	playing_total_time = -1;	/* Until the decoder has parsed it */
 	playing_time = 0;
+	playing_time_at = SystemClock.uptimeMillis();
+	playing_time_moving = false;
 	playing_paused = false;
-	decoder = new Binaural_decoder(incoming_messenger, seq);
+	decoder = new Binaural_decoder(incoming_messenger, seq, more,
+	    cache ? getCacheDir().getPath() : null, state);
+	decoder_update_mode();
 	decoder_thread = new Thread(decoder);
 	decoder_thread.start();
+	preview_update(null, 0);
+	client_send_sequence(null);
 	client_send_status(null);
 	set_foreground();
     }
 
+    /* Reads the playback clock of the decoder, without waiting for it. */
+    void clock_update()
+    {
+	long[] c = decoder == null ? null : decoder.sbagen_get_clock();
+	if(c == null)
+	    return;
+	playing_time = (int)c[Binaural_decoder.CLOCK_TIME];
+	playing_time_at = SystemClock.uptimeMillis();
+	playing_time_moving = c[Binaural_decoder.CLOCK_PLAYING] != 0;
+	client_send_time(null);
+    }
+
+    /* The next part of the sequence started with more set. */
+    void decoder_append(String text, boolean more)
+    {
+	if(playing_next != null) {
+	    if(playing_next_more) {
+		playing_next += text;
+		playing_next_more = more;
+	    }
+	    return;
+	}
+	if(decoder == null || !playing_more)
+	    return;
+	decoder.append(text, more);
+	playing_sequence += text;
+	playing_more = more;
+	if(!more)
+	    client_send_sequence(null);
+    }
+
+    /*
+     * Small blocks while someone is looking at the player, large ones to
+     * spare the battery otherwise.
+     */
+    void decoder_update_mode()
+    {
+	if(decoder == null)
+	    return;
+	decoder.set_interactive(screen_on && clients.size() > 0);
+    }
+
     void decoder_stop()
     {
 	if(decoder == null)
@@ -207,7 +370,12 @@ public class Binaural_player extends Service implements Handler.Callback
 
     void decoder_reap()
     {
+	resume_clear();			/* Played out, stopped or failed */
 	playing_sequence = null;
+	playing_path = null;
+	playing_more = false;
+	preview_update(null, 0);
+	client_send_sequence(null);
 	client_send_status(null);
 	if(decoder == null)
 	    return;
@@ -226,20 +394,183 @@ public class Binaural_player extends Service implements Handler.Callback
 	if(playing_next != null) {
 	    String s = playing_next;
 	    playing_next = null;
-	    decoder_start(s);
+	    decoder_start(s, playing_next_cache, playing_next_path,
+		playing_next_more, null);
 	} else {
 	    exit_if_finished();
 	}
     }
 
+    /*
+     * Resuming after the process was killed: the last checkpoint of the
+     * decoder is kept in a file with what it needs to start again, until
+     * the sequence ends.
+     */
+
+    /*
+     * The resume file holds the path, cache flag and text of the sequence
+     * playing, written once per sequence; resume.state holds its last
+     * checkpoint, replaced every few seconds. Both are written in order by
+     * resume_writer, away from the main thread.
+     */
+    final ExecutorService resume_writer = Executors.newSingleThreadExecutor();
+    String resume_seq;		/* Sequence in the resume file */
+
+    File resume_file(String name)
+    {
+	return new File(getFilesDir(), name);
+    }
+
+    void resume_save(String seq, byte[] state)
+    {
+	if(decoder == null || playing_next != null)
+	    return;
+	final String text = seq.equals(resume_seq) ? null : seq;
+	final String path = playing_path == null ? "" : playing_path;
+	final boolean cache = playing_cache;
+	final byte[] st = state;
+	resume_seq = seq;
+	resume_writer.execute(new Runnable() {
+	    public void run()
+	    {
+		try {
+		    if(text != null) {
+			/* The old state would not fit the new sequence. */
+			resume_file("resume.state").delete();
+			ByteArrayOutputStream b = new ByteArrayOutputStream();
+			DataOutputStream out = new DataOutputStream(b);
+			byte[] t = text.getBytes("UTF-8");
+			out.writeUTF(path);
+			out.writeBoolean(cache);
+			out.writeInt(t.length);
+			out.write(t);
+			out.close();
+			resume_write("resume", b.toByteArray());
+		    }
+		    resume_write("resume.state", st);
+		} catch(IOException e) {
+		    warn("resume_save: %s", e);
+		}
+	    }
+	});
+    }
+
+    /* Replaces file name with data, in resume_writer. */
+    void resume_write(String name, byte[] data) throws IOException
+    {
+	File file = resume_file(name);
+	File tmp = resume_file(name + ".tmp");
+	try {
+	    FileOutputStream out = new FileOutputStream(tmp);
+	    try {
+		out.write(data);
+	    } finally {
+		out.close();
+	    }
+	    if(!tmp.renameTo(file))
+		throw new IOException("cannot rename " + tmp);
+	} catch(IOException e) {
+	    tmp.delete();
+	    throw e;
+	}
+    }
+
+    void resume_clear()
+    {
+	resume_seq = null;
+	resume_writer.execute(new Runnable() {
+	    public void run()
+	    {
+		resume_file("resume").delete();
+		resume_file("resume.state").delete();
+	    }
+	});
+    }
+
+    /* Starts the sequence of the resume file, if any, paused. */
+    void resume_load()
+    {
+	File file = resume_file("resume");
+	File state_file = resume_file("resume.state");
+	if(!file.exists())
+	    return;
+	String path, seq;
+	boolean cache;
+	byte[] state = null;
+	try {
+	    DataInputStream in =
+		new DataInputStream(new FileInputStream(file));
+	    try {
+		path = in.readUTF();
+		cache = in.readBoolean();
+		byte[] text = new byte[in.readInt()];
+		in.readFully(text);
+		seq = new String(text, "UTF-8");
+	    } finally {
+		in.close();
+	    }
+	    if(state_file.exists()) {
+		in = new DataInputStream(new FileInputStream(state_file));
+		try {
+		    state = new byte[(int)state_file.length()];
+		    in.readFully(state);
+		} finally {
+		    in.close();
+		}
+	    }
+	} catch(IOException e) {
+	    warn("resume_load: %s", e);
+	    file.delete();
+	    state_file.delete();
+	    return;
+	}
+	decoder_start(seq, cache, path.length() == 0 ? null : path, false,
+	    state);
+	resume_seq = seq;
+	decoder_pause(true);
+    }
+
     /*
      * System interaction
      */
 
+    boolean screen_on = true;
+
+    final BroadcastReceiver screen_receiver = new BroadcastReceiver() {
+	@Override
+	public void onReceive(Context context, Intent intent)
+	{
+	    screen_on = Intent.ACTION_SCREEN_ON.equals(intent.getAction());
+	    decoder_update_mode();
+	}
+    };
+
+    @Override
+    public void onCreate()
+    {
+	super.onCreate();
+	IntentFilter filter = new IntentFilter(Intent.ACTION_SCREEN_ON);
+	filter.addAction(Intent.ACTION_SCREEN_OFF);
+	registerReceiver(screen_receiver, filter);
+	resume_load();
+    }
+
+    @Override
+    public void onDestroy()
+    {
+	unregisterReceiver(screen_receiver);
+	super.onDestroy();
+    }
+
     public void exit_if_finished()
     {
 	if(clients.size() == 0 && decoder == null) {
 	    stopSelf();
+	    resume_writer.shutdown();	/* Let it finish first */
+	    try {
+		resume_writer.awaitTermination(5, TimeUnit.SECONDS);
+	    } catch(InterruptedException e) {
+	    }
 	    System.exit(0);
 	}
     }
@@ -262,28 +593,6 @@ public class Binaural_player extends Service implements Handler.Callback
      * Utility functions
      */
 
-    final Matcher sequence_time_parser =
-	Pattern.compile("\\s*\\+(\\d+(?::\\d+)*)\\s+.*").matcher("");
-
-    int parse_total_time(String seq)
-    {
-	String[] lines = seq.split("\n");
-	for(int i = lines.length - 1; i >= 0; i--) {
-	    if(lines[i].length() > 0) {
-		sequence_time_parser.reset(lines[i]);
-		if(sequence_time_parser.matches()) {
-		    String[] c = sequence_time_parser.group(1).split(":");
-		    int r = 0;
-		    for(int j = 0; j < c.length; j++)
-			r = r * 60 + Integer.parseInt(c[j]);
-		    return r * 1000;
-		}
-		break;
-	    }
-	}
-	return -1;
-    }
-
     static void warn(String fmt, Object... args) {
 	android.util.Log.v("Binaural_player", String.format(fmt, args));
     }
@@ -30,6 +30,7 @@ import android.os.Handler;
 import android.os.Message;
 import android.os.Messenger;
 import android.os.RemoteException;
+import android.os.SystemClock;
 import android.content.Context;
 import android.content.ComponentName;
 import android.content.Intent;
@@ -55,6 +56,7 @@ public class Binaural_player_GUI extends TabActivity
     int play_total_time;
     String play_total_time_s;
     boolean play_paused = false;
+    boolean visible = false;
 
     @Override
     public void onCreate(Bundle state)
@@ -69,6 +71,22 @@ public class Binaural_player_GUI extends TabActivity
 	browser.chdir(dir);
     }
 
+    @Override
+    public void onResume()
+    {
+	super.onResume();
+	visible = true;
+	tab_play_tick();
+    }
+
+    @Override
+    public void onPause()
+    {
+	super.onPause();
+	visible = false;
+	tab_play_time.removeCallbacks(tab_play_ticker);
+    }
+
     @Override
     public void onDestroy()
     {
@@ -151,11 +169,21 @@ public class Binaural_player_GUI extends TabActivity
 	switch(msg.what) {
 	    case 'S':
 		b = msg.getData();
-		tab_play_set_sequence(b.getString("seq"),
+		tab_play_set_sequence(b.getBoolean("playing"),
 		    b.getInt("duration"));
 		return true;
+	    case 'Q':
+		tab_play_description.setText(msg.getData().getString("seq"));
+		return true;
+	    case 'V':
+		b = msg.getData();
+		tab_play_preview.set_data(b.getFloatArray("preview"),
+		    b.getInt("channels"));
+		return true;
 	    case 'T':
-		tab_play_set_time(msg.arg1);
+		b = msg.getData();
+		tab_play_set_clock(msg.arg1, b.getLong("at"),
+		    b.getBoolean("moving"));
 		return true;
 	    case 'P':
 		tab_play_set_pause(msg.arg1 != 0);
@@ -192,10 +220,12 @@ public class Binaural_player_GUI extends TabActivity
     TextView tab_play_description;
     TextView tab_play_time;
     ProgressBar tab_play_progress;
+    Preview tab_play_preview;
     Button tab_play_button_pause;
     Button tab_play_button_stop;
 
     MenuItem menu_item_default_dir;
+    MenuItem menu_item_cache;
     MenuItem menu_item_about;
     MenuItem menu_item_exit;
 
@@ -227,6 +257,7 @@ public class Binaural_player_GUI extends TabActivity
 	    (TextView)findViewById(R.id.tab_play_description);
 	tab_play_time = (TextView)findViewById(R.id.tab_play_time);
 	tab_play_progress = (ProgressBar)findViewById(R.id.tab_play_progress);
+	tab_play_preview = (Preview)findViewById(R.id.tab_play_preview);
 	tab_play_button_pause = (Button)findViewById(R.id.tab_play_pause);
 	tab_play_button_pause.setOnClickListener(this);
 	tab_play_button_stop = (Button)findViewById(R.id.tab_play_stop);
@@ -234,7 +265,7 @@ public class Binaural_player_GUI extends TabActivity
 
 	browser = new Browser(this);
 	browser.set_file_click_listener(this);
-	browser.set_glob(".*\\.sbg.*");
+	browser.set_glob("*.sbg*");
 
 	shell_script_view = new LinearLayout(this);
 	shell_script_view.setOrientation(LinearLayout.VERTICAL);
@@ -264,6 +295,9 @@ public class Binaural_player_GUI extends TabActivity
     {
 	menu_item_default_dir = menu.add("Set default dir");
 	menu_item_default_dir.setIcon(android.R.drawable.ic_menu_mylocation);
+	menu_item_cache = menu.add("Cache rendered audio");
+	menu_item_cache.setCheckable(true);
+	menu_item_cache.setChecked(global_settings.getBoolean("cache", false));
 	menu_item_about = menu.add("About");
 	menu_item_about.setIcon(android.R.drawable.ic_menu_info_details);
 	menu_item_exit = menu.add("Exit");
@@ -279,6 +313,12 @@ public class Binaural_player_GUI extends TabActivity
 	    editor.commit();
 	    Toast.makeText(this, "Default directory saved.", Toast.LENGTH_SHORT)
 		.show();
+	} else if(item == menu_item_cache) {
+	    boolean cache = !item.isChecked();
+	    item.setChecked(cache);
+	    SharedPreferences.Editor editor = global_settings.edit();
+	    editor.putBoolean("cache", cache);
+	    editor.commit();
 	} else if(item == menu_item_about) {
 	    about_dialog_show();
 	} else if(item == menu_item_exit) {
@@ -326,7 +366,7 @@ public class Binaural_player_GUI extends TabActivity
 	    sequence.startsWith("#!/bin/sh\n")) {
 	    shell_script_play(tab_seq_file_path, null);
 	} else {
-	    play_sequence(sequence);
+	    play_sequence(sequence, tab_seq_file_path);
 	}
     }
 
@@ -341,16 +381,21 @@ public class Binaural_player_GUI extends TabActivity
     {
 	String seq = edit_generate();
 	if(seq != null)
-	    play_sequence(seq);
+	    play_sequence(seq, null);
     }
 
-    void play_sequence(String sequence)
+    /* path: file the sequence was loaded from, for the service to reload
+       it in place if it is playing, or null. */
+    void play_sequence(String sequence, File path)
     {
 	if(sequence == null || sequence.indexOf(':') < 0)
 	    return;
 	Message msg = Message.obtain(null, 'R');
-	Bundle b = new Bundle(1);
+	Bundle b = new Bundle(3);
 	b.putString("seq", sequence);
+	if(path != null)
+	    b.putString("path", path.getPath());
+	b.putBoolean("cache", global_settings.getBoolean("cache", false));
 	msg.setData(b);
 	player_service_send_message(msg);
     }
@@ -419,10 +464,9 @@ public class Binaural_player_GUI extends TabActivity
 	sequence_set(sequence);
     }
 
-    void tab_play_set_sequence(String seq, int d)
+    void tab_play_set_sequence(boolean playing, int d)
     {
-	tab_play_description.setText(seq);
-	if(seq == null) {
+	if(!playing) {
 	    tab_play_button_pause.setClickable(false);
 	    tab_play_button_stop.setClickable(false);
 	} else {
@@ -433,6 +477,8 @@ public class Binaural_player_GUI extends TabActivity
 	    play_total_time_s = d <= 0 ? "" : String.format(" / %d:%02d",
 		(d + 500) / 60000, ((d + 500) / 1000) % 60);
 	}
+	play_clock_time = -1;
+	play_clock_moving = false;
 	tab_play_progress.setProgress(0);
 	tab_play_time.setText(null);
 	tab_play_set_pause(false);
@@ -440,16 +486,63 @@ public class Binaural_player_GUI extends TabActivity
 
     void tab_play_set_pause(boolean pause)
     {
+	if(pause && play_clock_moving && play_clock_time >= 0) {
+	    long now = SystemClock.uptimeMillis();
+	    play_clock_time += (int)(now - play_clock_at);
+	    play_clock_at = now;
+	    play_clock_moving = false;
+	}
 	play_paused = pause;
 	tab_play_button_pause.setText(pause ? "▶" : "❚❚");
     }
 
+    /*
+     * Playback clock: the service only sends the time when it starts,
+     * stops or jumps, and every few seconds; in between, it is moved on
+     * from the uptime clock at the display rate.
+     */
+    int play_clock_time = -1;
+    long play_clock_at;
+    boolean play_clock_moving = false;
+
+    final Runnable tab_play_ticker = new Runnable() {
+	public void run()
+	{
+	    tab_play_tick();
+	}
+    };
+
+    void tab_play_set_clock(int t, long at, boolean moving)
+    {
+	play_clock_time = t;
+	play_clock_at = at;
+	play_clock_moving = moving;
+	tab_play_tick();
+    }
+
+    void tab_play_tick()
+    {
+	tab_play_time.removeCallbacks(tab_play_ticker);
+	if(play_clock_time < 0)
+	    return;
+	int t = play_clock_time;
+	if(play_clock_moving && !play_paused) {
+	    t += (int)(SystemClock.uptimeMillis() - play_clock_at);
+	    if(play_total_time > 0 && t > play_total_time)
+		t = play_total_time;
+	    if(visible)
+		tab_play_time.postDelayed(tab_play_ticker, 1000 / 60);
+	}
+	tab_play_set_time(t);
+    }
+
     void tab_play_set_time(int t)
     {
 	String dt = String.format("%d:%02d", t / 60000, (t / 1000) % 60);
 	if(play_total_time > 0) {
 	    dt += play_total_time_s;
 	    tab_play_progress.setProgress(100 * t / play_total_time);
+	    tab_play_preview.set_position((float)t / play_total_time);
 	}
 	tab_play_time.setText(dt);
     }
@@ -467,9 +560,13 @@ public class Binaural_player_GUI extends TabActivity
     String[][] shell_script_options_vals;
     String[] shell_script_options_val;
 
-    void shell_script_play(File file, String[] opts)
+    /*
+     * Runs the script; a sequence it prints is played while it comes in,
+     * the options to ask for are shown when it is done.
+     */
+    void shell_script_play(final File file, String[] opts)
     {
-	String filtered = null;
+	final Process process;
 	try {
 	    int nopts = opts == null ? 0 : opts.length;
 	    String cmd[] = new String[2 + nopts];
@@ -477,14 +574,73 @@ public class Binaural_player_GUI extends TabActivity
 	    cmd[1] = file.getPath();
 	    for (int i = 0; i < nopts; i++)
 		cmd[i + 2] = opts[i];
-	    Process process = Runtime.getRuntime().exec(cmd);
-	    Reader r = new InputStreamReader(process.getInputStream());
-	    filtered = read_from_stream(r);
+	    process = Runtime.getRuntime().exec(cmd);
 	} catch (java.io.IOException e) {
 	    error_dialog_show("Error reading from script:\n" + e);
 	    return;
 	}
+	new Thread() {
+	    public void run()
+	    {
+		shell_script_read(file, process);
+	    }
+	}.start();
+    }
 
+    /* Runs in its own thread: the script may take a while. */
+    void shell_script_read(final File file, Process process)
+    {
+	Reader r = new InputStreamReader(process.getInputStream());
+	StringBuilder text = new StringBuilder();
+	char[] buf = new char[4096];
+	boolean streaming = false;
+	String error = null;
+	try {
+	    int n;
+	    while ((n = r.read(buf)) >= 0) {
+		text.append(buf, 0, n);
+		if (streaming) {
+		    shell_script_send('A', new String(buf, 0, n), true);
+		} else if (text.length() >= 4 &&
+		    text.substring(0, 4).equals("-SE\n")) {
+		    streaming = true;
+		    shell_script_send('R', text.toString(), true);
+		}
+	    }
+	} catch (java.io.IOException e) {
+	    error = "Error reading from script:\n" + e;
+	}
+	if (streaming)
+	    shell_script_send('A', "", false);
+	final String filtered = text.toString();
+	final String failed = error;
+	runOnUiThread(new Runnable() {
+	    public void run()
+	    {
+		if (failed != null)
+		    error_dialog_show(failed);
+		else
+		    shell_script_done(file, filtered);
+	    }
+	});
+    }
+
+    /* 'R' starts playing the beginning of the sequence, 'A' appends to it;
+       more is false for the last part. */
+    void shell_script_send(char what, String seq, boolean more)
+    {
+	Message msg = Message.obtain(null, what);
+	Bundle b = new Bundle(3);
+	b.putString("seq", seq);
+	b.putBoolean("more", more);
+	if (what == 'R')
+	    b.putBoolean("cache", false);
+	msg.setData(b);
+	player_service_send_message(msg);
+    }
+
+    void shell_script_done(File file, String filtered)
+    {
 	if (filtered.startsWith("sbg_script_options\n")) {
 	    String[] lines = filtered.substring(19).split("\n");
 	    shell_script_configure(file, lines);
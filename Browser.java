@@ -16,21 +16,48 @@
 package org.cigaes.binaural_player;
 
 import java.io.File;
-import java.util.Arrays;
 import android.content.Context;
 import android.widget.*;
 import android.view.View;
-import android.os.PatternMatcher;
+import android.view.ViewGroup;
 
+/*
+ * Lists the directories through sbagen_index(), which keeps an index of
+ * each with the summary of its sequences: the index is shown at once,
+ * then the directory is scanned again in a thread for what changed.
+ */
 public class Browser extends LinearLayout
     implements TabHost.TabContentFactory, AdapterView.OnItemClickListener
 {
     File cur_dir;
-    PatternMatcher glob;
+    String glob;
+    String index_dir;
     File_click_listener callback;
     final TextView wid_cur_dir;
     final ListView wid_files;
-    final ArrayAdapter<String> files;
+    final ArrayAdapter<Entry> files;
+    Thread scanner;
+
+    /* Threads reading the files while scanning, for slow storage. */
+    static final int SCAN_JOBS = 4;
+
+    /* One line of the list: a name, and the summary of a sequence. */
+    static class Entry
+    {
+	final String name;
+	final String summary;
+
+	Entry(String n, String s)
+	{
+	    name = n;
+	    summary = s;
+	}
+
+	public String toString()
+	{
+	    return name;
+	}
+    }
 
     public Browser(Context context)
     {
@@ -40,8 +67,18 @@ public class Browser extends LinearLayout
 	addView(wid_cur_dir);
 	wid_files = new ListView(context);
 	wid_files.setFastScrollEnabled(true);
-	files = new ArrayAdapter<String>(context,
-	    android.R.layout.simple_list_item_1);
+	files = new ArrayAdapter<Entry>(context,
+	    android.R.layout.simple_list_item_2, android.R.id.text1) {
+	    @Override
+	    public View getView(int pos, View view, ViewGroup parent)
+	    {
+		view = super.getView(pos, view, parent);
+		((TextView)view.findViewById(android.R.id.text2))
+		    .setText(getItem(pos).summary);
+		return view;
+	    }
+	};
+	index_dir = context.getCacheDir().getPath();
 	wid_files.setAdapter(files);
 	wid_files.setOnItemClickListener(this);
 	addView(wid_files);
@@ -52,14 +89,10 @@ public class Browser extends LinearLayout
 	callback = c;
     }
 
+    /* g: fnmatch() pattern of the files to list. */
     public void set_glob(String g)
     {
-	set_glob(new PatternMatcher(g, PatternMatcher.PATTERN_SIMPLE_GLOB));
-    }
-
-    public void set_glob(PatternMatcher m)
-    {
-	glob = m;
+	glob = g;
     }
 
     public void chdir(String dir)
@@ -67,32 +100,79 @@ public class Browser extends LinearLayout
 	chdir(new File(dir));
     }
 
-    public void chdir(File dir)
+    public void chdir(final File dir)
     {
 	cur_dir = dir;
 	wid_cur_dir.setText(cur_dir.getPath());
-	files.clear();
-	files.add("../");
-	File[] lf = dir.listFiles();
-	if(lf == null)
-	    return;
-	Arrays.sort(lf);
-	for(int i = 0; i < lf.length; i++) {
-	    if(lf[i].isDirectory()) {
-		files.add(lf[i].getName() + "/");
-		lf[i] = null;
+	show(list(dir, false));
+	wid_files.scrollTo(0, 0);
+	if(scanner != null)
+	    scanner.interrupt();
+	scanner = new Thread() {
+	    public void run()
+	    {
+		final Object[] l = list(dir, true);
+		if(isInterrupted())
+		    return;
+		post(new Runnable() {
+		    public void run()
+		    {
+			if(dir.equals(cur_dir))
+			    show(l);
+		    }
+		});
 	    }
+	};
+	scanner.start();
+    }
+
+    Object[] list(File dir, boolean scan)
+    {
+	try {
+	    return sbagen_index(dir.getPath(), glob, index_dir, SCAN_JOBS, scan);
+	} catch(IllegalArgumentException e) {
+	    return null;
 	}
-	for(int i = 0; i < lf.length; i++) {
-	    if(lf[i] == null)
-		continue;
-	    String n = lf[i].getName();
-	    if(glob != null && !glob.match(n))
-		continue;
-	    files.add(n);
-	    lf[i] = null;
+    }
+
+    /* Shows the result of sbagen_index(), keeping the scroll position. */
+    void show(Object[] l)
+    {
+	files.setNotifyOnChange(false);
+	files.clear();
+	files.add(new Entry("../", null));
+	if(l != null) {
+	    String[] names = (String[])l[0];
+	    String[] errors = (String[])l[1];
+	    int[] info = (int[])l[2];
+	    for(int i = 0; i < names.length; i++)
+		files.add(new Entry(names[i],
+		    summary(names[i], errors[i], info, i * INDEX_FIELDS)));
 	}
-	wid_files.scrollTo(0, 0);
+	files.notifyDataSetChanged();
+    }
+
+    static final String[] type_names = {
+	null, "binaural", "pink", "bell", "spin", "mix", "wave"
+    };
+
+    /* Duration, voice types and channels, or the first line of the error. */
+    static String summary(String name, String error, int[] info, int o)
+    {
+	if(error != null) {
+	    int nl = error.indexOf('\n');
+	    return nl < 0 ? error : error.substring(0, nl);
+	}
+	if(name.endsWith("/"))
+	    return null;
+	int d = info[o + INDEX_DURATION];
+	StringBuilder s = new StringBuilder(d < 0 ? "endless" :
+	    String.format("%d:%02d", (d + 500) / 60000, (d + 500) / 1000 % 60));
+	for(int t = 1; t < type_names.length; t++)
+	    if((info[o + INDEX_TYPES] & (1 << t)) != 0)
+		s.append(' ').append(type_names[t]);
+	s.append(String.format(", %d voices", info[o + INDEX_CHANNELS]));
+	return s.toString();
     }
 
     public File get_dir()
@@ -102,7 +182,7 @@ public class Browser extends LinearLayout
 
     public void onItemClick(AdapterView list, View view, int item, long row)
     {
-	String f = files.getItem(item);
+	String f = files.getItem(item).name;
 	int fl = f.length() - 1;
 	if(fl >= 0 && f.charAt(fl) == '/') {
 	    String d = f.substring(0, fl);
@@ -122,4 +202,18 @@ public class Browser extends LinearLayout
     public interface File_click_listener {
 	public void on_browser_file_click(File f);
     }
+
+    static {
+	System.loadLibrary("sbagen");
+    }
+
+    /* Indexes in the int array returned by sbagen_index(), per entry. */
+    static final int INDEX_DURATION = 0;
+    static final int INDEX_CHANNELS = 1;
+    static final int INDEX_TYPES = 2;
+    static final int INDEX_PEAK = 3;	/* Total amplitude, % */
+    static final int INDEX_FIELDS = 4;
+    static native Object[] sbagen_index(String dir, String glob,
+	String index_dir, int jobs, boolean scan)
+	throws IllegalArgumentException;
 }
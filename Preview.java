@@ -0,0 +1,146 @@
+/*
+ * Binaural player
+ * © Nicolas George -- 2010
+ * Overview of a whole sequence for the Play tab
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ */
+
+package org.cigaes.binaural_player;
+
+import android.content.Context;
+import android.graphics.Canvas;
+import android.graphics.Color;
+import android.graphics.Paint;
+import android.graphics.Path;
+import android.util.AttributeSet;
+import android.view.View;
+
+/*
+ * Draws the data of sbagen_preview(): the overall level as a filled
+ * envelope, and for each channel the beat frequency as a line whose
+ * opacity follows its amplitude; the carriers are written on the left.
+ */
+public class Preview extends View
+{
+    static final int[] colors = {
+	0xFF40C0FF, 0xFFFFC040, 0xFF80FF80, 0xFFFF8080,
+	0xFFC080FF, 0xFFFFFF80, 0xFF80FFFF, 0xFFFF80FF,
+    };
+
+    float[] data;
+    int channels;
+    int points;
+    float max_level;
+    float max_beat;
+    int position = -1;	/* Playback position in points, -1 for none */
+    final Paint paint = new Paint();
+    final Path path = new Path();
+
+    public Preview(Context context, AttributeSet attrs)
+    {
+	super(context, attrs);
+	paint.setAntiAlias(true);
+	paint.setTextSize(10 * context.getResources()
+	    .getDisplayMetrics().scaledDensity);
+    }
+
+    /* data as returned by sbagen_preview(), or null to clear. */
+    public void set_data(float[] d, int ch)
+    {
+	data = d;
+	channels = ch;
+	points = d == null ? 0 : d.length / (1 + 3 * ch);
+	max_level = 0;
+	max_beat = 0;
+	for(int i = 0; i < points; i++) {
+	    int o = i * (1 + 3 * channels);
+	    max_level = Math.max(max_level, data[o]);
+	    for(int c = 0; c < channels; c++)
+		if(data[o + 3 + 3 * c] > 0)
+		    max_beat = Math.max(max_beat,
+			Math.abs(data[o + 2 + 3 * c]));
+	}
+	position = -1;
+	invalidate();
+    }
+
+    /* Moves the cursor to fraction f of the sequence. */
+    public void set_position(float f)
+    {
+	int p = points < 2 ? -1 : Math.round(f * (points - 1));
+	if(p != position) {
+	    position = p;
+	    invalidate();
+	}
+    }
+
+    @Override
+    protected void onDraw(Canvas canvas)
+    {
+	int w = getWidth(), h = getHeight();
+	if(points < 2 || w == 0 || h == 0)
+	    return;
+	int s = 1 + 3 * channels;
+	float dx = (float)w / (points - 1);
+
+	/* Overall level */
+	if(max_level > 0) {
+	    path.reset();
+	    path.moveTo(0, h);
+	    for(int i = 0; i < points; i++)
+		path.lineTo(i * dx, h - h * data[i * s] / max_level);
+	    path.lineTo(w, h);
+	    path.close();
+	    paint.setStyle(Paint.Style.FILL);
+	    paint.setColor(0xFF404040);
+	    canvas.drawPath(path, paint);
+	}
+
+	/* Beat frequency of each channel */
+	paint.setStyle(Paint.Style.STROKE);
+	paint.setStrokeWidth(2);
+	for(int c = 0; c < channels && max_beat > 0; c++) {
+	    int color = colors[c % colors.length];
+	    for(int i = 1; i < points; i++) {
+		int o0 = (i - 1) * s + 1 + 3 * c, o1 = o0 + s;
+		float amp = Math.max(data[o0 + 2], data[o1 + 2]);
+		if(amp <= 0)
+		    continue;
+		float a = Math.min(1, amp / max_level * 2);
+		paint.setColor(color & 0xFFFFFF |
+		    (int)(64 + 191 * a) << 24);
+		canvas.drawLine((i - 1) * dx,
+		    h - h * Math.abs(data[o0 + 1]) / max_beat,
+		    i * dx, h - h * Math.abs(data[o1 + 1]) / max_beat, paint);
+	    }
+	}
+
+	/* Carriers at the cursor, or at the start */
+	paint.setStyle(Paint.Style.FILL);
+	int o = Math.max(position, 0) * s;
+	float y = paint.getTextSize();
+	for(int c = 0; c < channels; c++) {
+	    if(data[o + 3 + 3 * c] <= 0)
+		continue;
+	    paint.setColor(colors[c % colors.length]);
+	    canvas.drawText(String.format("%.1f%+.2f Hz", data[o + 1 + 3 * c],
+		data[o + 2 + 3 * c]), 2, y, paint);
+	    y += paint.getTextSize();
+	}
+
+	/* Playback position */
+	if(position >= 0) {
+	    paint.setColor(Color.WHITE);
+	    paint.setStrokeWidth(1);
+	    canvas.drawLine(position * dx, 0, position * dx, h, paint);
+	}
+    }
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Binaural player
+# Checkpoint and restore: cost and exactness
+#
+# Usage: bench/checkpoint.sh [sbagen-test]
+# Renders a sequence of tones, noise, spinning noise and bells sliding
+# into each other whole, saving a checkpoint at several points; goes on
+# from each checkpoint in a new process, checks that the output is the
+# same as the rest of the whole one, and prints the size of the
+# checkpoint and the time to take and restore it.
+
+prog=${1:-./sbagen-test}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-checkpoint.$$
+trap 'rm -f "$tmp" "$tmp.ck" "$tmp.log" "$tmp.whole" "$tmp.rest"' EXIT
+
+cat > "$tmp" <<SEQ
+a: pink/20 200+10/10 spin:300+0.5/15
+b: 150+4/10 bell400/20 spin:250+1/15
+c: -
+00:00 a
+00:00:30 <> b ->
+00:01:30 a
+00:02:30 c
+SEQ
+for ms in 1000 45000 89900 130000; do
+    "$prog" -k "$tmp.ck@$ms" "$tmp" > "$tmp.whole" 2> "$tmp.log" || exit 1
+    off=$(sed -n 's/.* after \([0-9]*\) octets.*/\1/p' "$tmp.log")
+    "$prog" -K "$tmp.ck" "$tmp" > "$tmp.rest" 2>> "$tmp.log" || exit 1
+    if tail -c +$((off + 1)) "$tmp.whole" | cmp -s - "$tmp.rest"; then
+	same=same
+    else
+	same=DIFFERENT
+    fi
+    awk -v ms=$ms -v same=$same '
+	/^checkpoint/ { size = $3; take = $NF }
+	/^restored/ { restore = $NF }
+	END {
+	    printf "at %6d ms: %d octets, taken in %s, restored in %s, " \
+		"output %s\n", ms, size, take, restore, same
+	}' "$tmp.log"
+done
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Binaural player
+# Rendering speed in each output sample format
+#
+# Usage: bench/formats.sh [sbagen-test [minutes]]
+# Renders the same sequence of tones and noise in each format, interleaved
+# and planar, and prints how many times faster than real time each one
+# runs.
+
+prog=${1:-./sbagen-test}
+min=${2:-30}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-formats.$$
+trap 'rm -f "$tmp"' EXIT
+
+printf "a: pink/10 100+4/10 200+5/10 300+6/10\nb: -\n00:00 a\n+%02d:%02d b\n" \
+    $((min / 60)) $((min % 60)) > "$tmp"
+for f in s16 s24 f32 s16p s24p f32p; do
+    start=$(date +%s.%N)
+    "$prog" -f $f -O null "$tmp" || exit 1
+    end=$(date +%s.%N)
+    echo "$f $start $end $min" | awk '{
+	t = $3 - $2
+	printf "%-4s: %7.3f s for %d min, %7.1fx real time\n", \
+	    $1, t, $4, $4 * 60 / t
+    }'
+done
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Binaural player
+# Listing time of a directory of sequences, with and without its index
+#
+# Usage: bench/index.sh [sbagen-test [files]]
+# Writes files (default 5000) small sequences into a directory, then lists
+# it with sbagen-test -I three times: with no index file, with an up to
+# date one, and with one sequence in ten edited since.
+
+prog=${1:-./sbagen-test}
+files=${2:-5000}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-index.$$
+trap 'rm -rf "$tmp"' EXIT
+mkdir -p "$tmp/lib" "$tmp/index" || exit 1
+
+awk -v n=$files -v dir="$tmp/lib" 'BEGIN {
+    for (i = 0; i < n; i++) {
+	f = sprintf("%s/seq%05d.sbg", dir, i)
+	printf "ts: %d+%g/20 pink/10\noff: -\n", 100 + i % 300, 4 + i % 7 > f
+	printf "NOW ts\n+00:%02d:00 off\n", 5 + i % 50 > f
+	close(f)
+    }
+}'
+for run in "no index" "up to date" "10% edited"; do
+    if [ "$run" = "10% edited" ]; then
+	for f in "$tmp"/lib/seq????[05].sbg; do echo "# edited" >> "$f"; done
+    fi
+    printf "%6d files, %-10s: " $files "$run"
+    "$prog" -I "$tmp/index" "$tmp/lib" 2>&1 >/dev/null |
+	sed 's/^[^:]*: //' || exit 1
+done
@@ -0,0 +1,74 @@
+#!/bin/sh
+# Binaural player
+# Oscillator kernels: accuracy and rendering speed
+#
+# Usage: bench/kernel.sh [sbagen-test [minutes]]
+# For each kernel of -G, renders a steady 205/195 Hz binaural tone as
+# floats and prints the signal to error ratio of each ear against the
+# best-fitting exact sine, then renders N binaural voices for N in 1, 4,
+# 16 and 64 and prints how many times faster than real time it runs.
+# The given sbagen-test can be a cross-built one run on the device.
+
+prog=${1:-./sbagen-test}
+min=${2:-10}
+rate=44100
+tmp=${TMPDIR:-/tmp}/sbagen-bench-kernel.$$
+trap 'rm -f "$tmp" "$tmp.raw"' EXIT
+
+printf "t: 200+10/50\noff: -\n00:00 t\n00:01:00 t\n00:02:00 t\n00:03:00 off\n" \
+    > "$tmp"
+for k in table rotate; do
+    # 10 s from 80 s on, away from the fades
+    "$prog" -G $k -f f32 "$tmp" > "$tmp.raw" || exit 1
+    tail -c +$((80 * rate * 8 + 1)) "$tmp.raw" | head -c $((10 * rate * 8)) |
+	od -An -v -tf4 -w8 | awk -v k=$k -v rate=$rate '
+	BEGIN {
+	    pi = atan2(0, -1)
+	    # Frequencies as rounded to the phase increments
+	    w[1] = int(205 / rate * 2^30) * 2 * pi / 2^30
+	    w[2] = int(195 / rate * 2^30) * 2 * pi / 2^30
+	}
+	{
+	    for (c = 1; c <= 2; c++) {
+		x[c, NR] = $c
+		s = sin(w[c] * NR); o = cos(w[c] * NR)
+		xs[c] += $c * s; xo[c] += $c * o
+		ss[c] += s * s; oo[c] += o * o; so[c] += s * o
+	    }
+	}
+	END {
+	    printf "%-6s:", k
+	    for (c = 1; c <= 2; c++) {
+		d = ss[c] * oo[c] - so[c] * so[c]
+		a = (xs[c] * oo[c] - xo[c] * so[c]) / d
+		b = (xo[c] * ss[c] - xs[c] * so[c]) / d
+		sig = err = 0
+		for (i = 1; i <= NR; i++) {
+		    y = a * sin(w[c] * i) + b * cos(w[c] * i)
+		    sig += y * y; err += (x[c, i] - y)^2
+		}
+		printf " %s %5.1f dB SNR", c == 1 ? "left" : "right", \
+		    10 * log(sig / err) / log(10)
+	    }
+	    printf "\n"
+	}' || exit 1
+done
+
+for n in 1 4 16 64; do
+    awk -v n=$n -v min=$min 'BEGIN {
+	printf "tones:"
+	for (i = 0; i < n; i++)
+	    printf " %d+%g/%g", 100 + 3 * i, 4 + i % 7, 80 / n
+	printf "\noff: -\n00:00 tones\n+%02d:%02d off\n", min / 60, min % 60
+    }' > "$tmp"
+    for k in table rotate; do
+	start=$(date +%s.%N)
+	"$prog" -G $k -O null "$tmp" || exit 1
+	end=$(date +%s.%N)
+	echo "$n $k $start $end $min" | awk '{
+	    t = $4 - $3
+	    printf "%3d voices, %-6s: %7.3f s for %d min, %7.1fx real time\n", \
+		$1, $2, t, $5, $5 * 60 / t
+	}'
+    done
+done
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Binaural player
+# Parse and free time against the size of the sequence
+#
+# Usage: bench/parse.sh [sbagen-test [count]]
+# Parses sequences of N time lines for N in 1000, 5000 and 20000, count
+# times each, and prints the average parse and free times and the peak
+# memory use.
+
+prog=${1:-./sbagen-test}
+count=${2:-20}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-parse.$$
+trap 'rm -f "$tmp"' EXIT
+
+for n in 1000 5000 20000; do
+    awk -v n=$n 'BEGIN {
+	for (i = 0; i < 64; i++)
+	    printf "ts%d: %d+%g/10 pink/%d\n", i, 100 + i, 4 + i % 7, 5 + i % 10
+	for (i = 0; i < n; i++) {
+	    t = i * 4
+	    printf "%02d:%02d:%02d == ts%d\n", \
+		int(t / 3600), int(t / 60) % 60, t % 60, i % 64
+	}
+    }' > "$tmp"
+    printf "%6d lines: " $n
+    "$prog" -P $count "$tmp" 2>&1 | sed 's/^[^:]*: //' || exit 1
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Binaural player
+# Rendering speed of silent stretches against audible ones
+#
+# Usage: bench/quiet.sh [sbagen-test [minutes]]
+# Renders a sequence that is off, one whose tones are all at zero
+# amplitude, the same with pink noise at zero amplitude somewhere in it,
+# and one with the tones audible, and prints how many times faster than
+# real time each one runs.
+
+prog=${1:-./sbagen-test}
+min=${2:-60}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-quiet.$$
+trap 'rm -f "$tmp"' EXIT
+
+for kind in off muted muted+pink tones; do
+    case $kind in
+	off)        set -- "-" "-" ;;
+	muted)      set -- "100+4/0 200+5/0 300+6/0" "-" ;;
+	muted+pink) set -- "100+4/0 200+5/0 300+6/0" "pink/0" ;;
+	tones)      set -- "100+4/10 200+5/10 300+6/10" "-" ;;
+    esac
+    printf "a: %s\nb: %s\n00:00 a\n+%02d:%02d b\n" "$1" "$2" \
+	$((min / 60)) $((min % 60)) > "$tmp"
+    start=$(date +%s.%N)
+    "$prog" -O null "$tmp" || exit 1
+    end=$(date +%s.%N)
+    echo "$kind $start $end $min" | awk '{
+	t = $3 - $2
+	printf "%-10s: %7.3f s for %d min, %8.1fx real time\n", \
+	    $1, t, $4, $4 * 60 / t
+    }'
+done
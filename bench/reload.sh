@@ -0,0 +1,35 @@
+#!/bin/sh
+# Binaural player
+# Reload time against the size of the sequence
+#
+# Usage: bench/reload.sh [sbagen-test [count]]
+# For sequences of N time lines using blocks, for N in 1000, 5000 and
+# 20000, prints the average parse time and the time to reload a copy with
+# one voice-set definition changed, then one with one time line changed.
+
+prog=${1:-./sbagen-test}
+count=${2:-20}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-reload.$$
+trap 'rm -f "$tmp" "$tmp.def" "$tmp.line"' EXIT
+
+for n in 1000 5000 20000; do
+    awk -v n=$n 'BEGIN {
+	for (i = 0; i < 64; i++)
+	    printf "ts%d: %d+%g/10 pink/%d\n", i, 100 + i, 4 + i % 7, 5 + i % 10
+	for (i = 0; i < 8; i++)
+	    printf "blk%d: {\n  +00:00:00 ts%d\n  +00:00:02 ts%d ->\n}\n", \
+		i, i, i + 8
+	for (i = 0; i < n; i++) {
+	    t = i * 4
+	    printf "%02d:%02d:%02d == %s%d\n", int(t / 3600), int(t / 60) % 60, \
+		t % 60, i % 4 ? "ts" : "blk", i % 4 ? i % 64 : i % 8
+	}
+    }' > "$tmp"
+    sed 's/^ts41: 141+/ts41: 142+/' "$tmp" > "$tmp.def"
+    awk -v n=$n 'NR == 64 + 32 + int(n / 2) { sub(/== ts/, "<> ts") } 1' \
+	"$tmp" > "$tmp.line"
+    printf "%6d lines, one definition changed: " $n
+    "$prog" -P $count -L "$tmp.def" "$tmp" 2>&1 | sed 's/^[^:]*: //' || exit 1
+    printf "%6d lines, one time line changed:  " $n
+    "$prog" -P $count -L "$tmp.line" "$tmp" 2>&1 | sed 's/^[^:]*: //' || exit 1
+done
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Binaural player
+# Time to first sample
+#
+# Usage: bench/startup.sh [sbagen-test [runs]]
+# Measures, from the trace events, the time from the start of sbagen_init()
+# to the first writeOut() of a short sequence, and prints the best and
+# median of several runs.
+
+prog=${1:-./sbagen-test}
+runs=${2:-11}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-startup.$$
+trap 'rm -f "$tmp.sbg" "$tmp.json" "$tmp.times"' EXIT
+
+printf 'tones: 200+10/10 pink/20\noff: -\n00:00 tones\n00:00:01 off\n' \
+    > "$tmp.sbg"
+i=0
+while [ $i -lt $runs ]; do
+    "$prog" -O null -T "$tmp.json" "$tmp.sbg" || exit 1
+    awk -F'"ts":' '
+	/"name":"sbagen_init","ph":"B"/ { split($2, a, ","); t0 = a[1] }
+	/"name":"writeOut","ph":"B"/ && !t1 { split($2, a, ","); t1 = a[1] }
+	END { print t1 - t0 }' "$tmp.json"
+    i=$((i + 1))
+done > "$tmp.times"
+sort -n "$tmp.times" | awk '
+    { t[NR] = $1 }
+    END { printf "first sample after sbagen_init: best %d us, median %d us\n",
+	t[1], t[int((NR + 1) / 2)] }'
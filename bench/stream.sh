@@ -0,0 +1,31 @@
+#!/bin/sh
+# Binaural player
+# Time to the first output of a sequence still being generated
+#
+# Usage: bench/stream.sh [sbagen-test]
+# For -SE sequences of N time lines, for N in 1000 and 5000, written on
+# a pipe 100 lines at a time with a pause of 10ms between them, as a
+# slow script would, prints when sbagen-test -s first output samples and
+# when it had read the whole input, in between rendering what it had.
+
+prog=${1:-./sbagen-test}
+
+for n in 1000 5000; do
+    printf "%6d lines: " $n
+    awk -v n=$n 'BEGIN {
+	print "-SE"
+	print "off: -"
+	for (i = 0; i < 64; i++)
+	    printf "ts%d: %d+%g/10 pink/%d\n", i, 100 + i, 4 + i % 7, 5 + i % 10
+	for (i = 0; i < n; i++) {
+	    t = i * 4
+	    printf "%02d:%02d:%02d == ts%d\n", int(t / 3600), int(t / 60) % 60, \
+		t % 60, i % 64
+	    if (i % 100 == 99) {
+		fflush()
+		system("sleep 0.01")
+	    }
+	}
+	print "+00:00:04 off"
+    }' | "$prog" -s -O null 2>&1 || exit 1
+done
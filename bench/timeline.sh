@@ -0,0 +1,29 @@
+#!/bin/sh
+# Binaural player
+# Previews computed at once from one shared timeline
+#
+# Usage: bench/timeline.sh [sbagen-test]
+# For a sequence of 20000 time lines, prints the time for 1, 2, 4 and 8
+# threads to each compute a preview of 200000 points from the same
+# timeline; without locking, it only grows once there are more threads
+# than CPUs.
+
+prog=${1:-./sbagen-test}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-timeline.$$
+trap 'rm -f "$tmp"' EXIT
+
+awk 'BEGIN {
+    print "off: -"
+    for (i = 0; i < 64; i++)
+	printf "ts%d: %d+%g/10 pink/%d spin:%d+%g/5\n", i, 100 + i, 4 + i % 7, \
+	    5 + i % 10, 200 + i, 1 + i % 3
+    for (i = 0; i < 20000; i++) {
+	t = i * 4
+	printf "%02d:%02d:%02d <> ts%d\n", int(t / 3600), int(t / 60) % 60, \
+	    t % 60, i % 64
+    }
+}' > "$tmp"
+for j in 1 2 4 8; do
+    printf "%d thread(s): " $j
+    "$prog" -j $j -p 200000 "$tmp" | sed -n 's/^# [^:]*: //p' || exit 1
+done
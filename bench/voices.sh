@@ -0,0 +1,29 @@
+#!/bin/sh
+# Binaural player
+# Rendering speed against the number of voices
+#
+# Usage: bench/voices.sh [sbagen-test [minutes]]
+# Renders a sequence of N binaural voices for N in 1, 4, 16, 64 and 256 and
+# prints how many times faster than real time each one runs.
+
+prog=${1:-./sbagen-test}
+min=${2:-10}
+tmp=${TMPDIR:-/tmp}/sbagen-bench-voices.$$
+trap 'rm -f "$tmp"' EXIT
+
+for n in 1 4 16 64 256; do
+    awk -v n=$n -v min=$min 'BEGIN {
+	printf "tones:"
+	for (i = 0; i < n; i++)
+	    printf " %d+%g/%g", 100 + 3 * i, 4 + i % 7, 80 / n
+	printf "\noff: -\n00:00 tones\n+00:%02d off\n", min
+    }' > "$tmp"
+    start=$(date +%s.%N)
+    "$prog" -O null "$tmp" || exit 1
+    end=$(date +%s.%N)
+    echo "$n $start $end $min" | awk '{
+	t = $3 - $2
+	printf "%4d voices: %7.3f s for %d min, %7.1fx real time\n", \
+	    $1, t, $4, $4 * 60 / t
+    }'
+done
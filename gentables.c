@@ -0,0 +1,45 @@
+/*
+ * Binaural player
+ * © Nicolas George -- 2010
+ * Build-time generator for the tables of sbagen.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+ * Public License for more details.
+ */
+
+/*
+ * Usage: gentables > tmp/sbagen-tables.h
+ *
+ * The tables end up in the read-only data of the library, so they are
+ * shared through the page cache instead of being computed by every
+ * process at sbagen_init() time.
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+#define ST_AMP 0x7FFFF		/* Must match sbagen.c */
+#define ST_SIZ 16384
+
+int
+main(void)
+{
+    int a;
+
+    printf("/* Generated by gentables.c, do not edit. */\n\n");
+    printf("#if ST_AMP != %d || ST_SIZ != %d\n", ST_AMP, ST_SIZ);
+    printf("# error sbagen-tables.h is out of date\n");
+    printf("#endif\n\n");
+    printf("static const int sin_table_data[ST_SIZ] = {");
+    for(a = 0; a < ST_SIZ; a++)
+	printf("%s%d,", a % 8 ? " " : "\n    ",
+	    (int)(ST_AMP * sin((a * 3.14159265358979323846 * 2) / ST_SIZ)));
+    printf("\n};\n");
+    return ferror(stdout) ? 1 : 0;
+}
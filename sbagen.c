@@ -54,7 +54,8 @@ All fonctions that can fail return 0 in case of success and -1 in case of
 error.
 
 int sbagen_init(void);
--> Computes the sin table; can fail if malloc fails.
+-> Computes the sin table, unless built with SBAGEN_TABLES and the tables
+   generated by gentables.c; can fail if malloc fails.
 
 int sbagen_set_parameters(int rate, int prate, int fade, const char *roll);
 -> Sets decoding parameters; can fail if roll is invalid.
@@ -67,12 +68,107 @@ int sbagen_parse_seq(const char *seq);
 -> Parses the sequence; can fail on syntax error or out of memory.
 	seq: the text of the sequence, not the filename.
 
+int sbagen_query(const char *seq, struct sbagen_info *info);
+-> Frees any sequence already loaded, parses seq like sbagen_parse_seq and
+   fills info; the sequence stays loaded, ready for sbagen_run. Fails like
+   sbagen_parse_seq.
+	duration: exact length in ms, -1 if it loops over 24 hours
+	periods, channels: size of the corrected period list
+	types: bit 1 << SBAGEN_VOICE_* set for each voice type used
+	peak: highest total amplitude of all voices, in %
+
+int sbagen_get_info(struct sbagen_info *info);
+-> The same for the sequence already parsed; fails if there is none.
+
+int sbagen_preview(int n, float *data);
+-> Computes the voices of the parsed sequence at n evenly spaced times
+   from its start to its end (over 24 hours if it loops), from the
+   periods and with the same interpolation as playback, without
+   rendering. For each time, data gets the total amplitude then, for each
+   of the sbagen_info.channels channels, carrier (spin width in us for
+   spin), beat (spin rate) and amplitude; amplitudes are in % as in the
+   sequence. data must hold n * (1 + 3 * channels) floats; fails if
+   there is no sequence or n < 2.
+
 int sbagen_run(void);
 -> Generates the waves; can fail on out of memory or if writeOut fails.
 
+int sbagen_reload(const char *seq);
+-> Replaces the parsed sequence with seq, an edited version of it, only
+   reading again the lines that changed; if sbagen_run is running (from
+   writeOut or the output callback, not with listeners), playback goes on
+   from the same time and with the same phases; output replayed from the
+   cache goes on rendered from there instead. Fails like
+   sbagen_parse_seq, leaving the old sequence loaded and playing.
+
+int sbagen_stream(const char *seq, int more);
+-> Loads seq, the text of a sequence received so far, for instance from
+   a script: the first call parses it, the next ones reload it with
+   the text that came since. With more set, only the complete
+   statements are read and sbagen_run only plays up to the fourth last
+   voice-set, the last ones possibly changing with what comes next,
+   calling the function given to sbagen_set_stream_wait when it gets
+   there. Returns 1 when there is something to play, 0 if the text is
+   too short yet, -1 on error. The opening fade comes from the last
+   voice-set so far rather than the last of the sequence: the same
+   output as the complete text needs a sequence ending with the
+   voice-set it starts from, as most do.
+
+void sbagen_set_stream_wait(int (*wait)(void *opaque), void *opaque);
+-> Sets the function sbagen_run calls with opaque, outside the real-time
+   section, while it waits for sbagen_stream; it should return once it
+   was called again, or -1 to stop playback.
+
 void sbagen_free_seq(void);
 -> Frees the memory allocates by sbagen_parse_seq.
 
+struct sbagen_timeline *sbagen_timeline_get(void);
+-> Returns a new reference to the compiled timeline of the sequence
+   parsed last: its periods, voices and waveforms, which are not written
+   any more once it is shared, so that any number of threads can walk it
+   at once without locking, each with a cursor of its own. Fails (NULL)
+   without a complete sequence, or while it is still coming in through
+   sbagen_stream. Reloading or freeing the sequence leaves the timeline
+   as it is: sbagen_reload builds a new one rather than splice into a
+   shared one. Only the walks that do not render are concurrent: the
+   render state is global, one sbagen_run at a time per process.
+
+void sbagen_timeline_put(struct sbagen_timeline *tl);
+-> Drops a reference from sbagen_timeline_get; the last one frees the
+   timeline. Can be called from any thread.
+
+int sbagen_timeline_use(struct sbagen_timeline *tl);
+-> Frees any sequence loaded and loads tl in its place, without parsing
+   anything, for sbagen_run, sbagen_run_listeners and the functions
+   working on the parsed sequence; the next sbagen_reload reads all of
+   its text. Fails while rendering.
+
+int sbagen_timeline_info(struct sbagen_timeline *tl,
+    struct sbagen_info *info);
+int sbagen_timeline_preview(struct sbagen_timeline *tl, int n, float *data);
+-> sbagen_get_info and sbagen_preview for tl, from any thread, including
+   while tl is being played or previewed elsewhere.
+
+int sbagen_index(const char *dir, const char *pattern, const char *index,
+    int jobs, int scan, struct sbagen_entry **entries);
+-> Lists directory dir for a file browser: its subdirectories, with a
+   trailing /, then its files whose name matches the fnmatch pattern
+   (all if NULL), each sorted by name, with the summary of each file as
+   sbagen_query gives it or its parse error. Returns the number of
+   entries, stored in a new array at *entries, or -1 if dir cannot be
+   read or out of memory.
+	index: directory where an index file is kept for each directory
+	  listed, or NULL; only the files whose modification time or size
+	  changed since they were indexed are parsed again
+	jobs: number of threads reading the files; they are parsed one at
+	  a time, which frees any sequence loaded as sbagen_query does, so
+	  a scan fails while sbagen_run is rendering
+	scan: 0 to only return what the index file has, without reading
+	  the directory, for a quick first display
+
+void sbagen_free_index(struct sbagen_entry *entries, int n);
+-> Frees the entries returned by sbagen_index.
+
 void
 sbagen_exit(void);
 -> Frees the sin table.
@@ -81,8 +177,156 @@ char *
 sbagen_get_error(void);
 -> Returns the error message; never fails.
 
+int sbagen_set_mix(const char *path);
+-> Selects the file mixed into the output by the mix/ voices, or at
+   100% if the sequence has none, from the start of each sbagen_run;
+   NULL removes it. The file is a WAV file of 16-bit PCM, mono or
+   stereo, or else raw 16-bit stereo samples at the output rate, in the
+   native byte order; it is memory-mapped and read from there while
+   rendering, with linear interpolation if its rate differs from the
+   output rate. Past its end, it is silent. Fails if the file cannot be
+   mapped or is in another format, or during sbagen_run.
+
+int sbagen_set_cache(const char *dir, long max_size);
+-> Enables caching of the rendered output in directory dir, which must
+   exist, keeping at most max_size octets in it; NULL disables the cache.
+   Can fail if out of memory. A sequence already rendered with the same
+   text and parameters is then read back from its cache file instead of
+   being synthesized again.
+
+int sbagen_add_listener(double gain, const char *roll, int start_ms,
+    int (*out)(void *opaque, char *buf, int size), void *opaque);
+-> Adds an output stream to be rendered by sbagen_run_listeners; can fail
+   if roll is invalid or out of memory.
+	gain: volume multiplier, 1.0 for the sequence as written
+	roll: headphone roll-off compensation as for -c, or NULL
+	start_ms: time into the sequence when the stream starts
+	out: called like writeOut with opaque as first argument
+
+int sbagen_run_listeners(void);
+-> Renders the parsed sequence once for all the listeners: the timeline
+   is only interpolated once per buffer-ful, each listener gets its own
+   phases, volume and compensation. Fails like sbagen_run, or if no
+   listener was added.
+
+void sbagen_free_listeners(void);
+-> Removes all the listeners; also done by sbagen_exit.
+
+int sbagen_set_output(int kind, int fd, const char *path);
+-> Selects where sbagen_run sends the samples; can fail if the WAV file
+   cannot be created.
+	SBAGEN_OUT_DEFAULT: writeOut, as provided by the build mode
+	SBAGEN_OUT_NULL: discarded, to measure synthesis alone
+	SBAGEN_OUT_MEMORY: appended to a buffer, see sbagen_output_memory
+	SBAGEN_OUT_FD: written to fd, which is left open
+	SBAGEN_OUT_WAV: written to a new WAV file at path, whose header is
+	  completed at the end of each sbagen_run, as RF64 past 4 GB
+   All of these take SBAGEN_FMT_S16 at the -R block size, until
+   sbagen_set_output_format.
+
+int sbagen_set_output_format(int format);
+-> Selects the sample format of the output selected last; fails if it
+   is not supported, or planar for a WAV file.
+	SBAGEN_FMT_S16: 16-bit integers, dithered, as always
+	SBAGEN_FMT_S24: 24-bit integers packed in 3 octets, dithered
+	SBAGEN_FMT_F32: floats from -1 to 1, not dithered
+	with SBAGEN_FMT_PLANAR: each block holds all its left samples,
+	  then all its right ones, instead of interleaving them
+   The samples are converted straight from the mix into the block
+   handed to the output, whatever the format. Rendered output is only
+   cached for interleaved formats; sbagen_run_listeners always gives
+   SBAGEN_FMT_S16.
+
+int sbagen_set_output_callback(int (*write)(void *opaque, char *buf, int size),
+    void *opaque, int block, int format);
+-> Sends the samples to write, called like writeOut with opaque as first
+   argument, in blocks of block frames (0 for the -R rate) and in the
+   given format, as for sbagen_set_output_format; fails if the block
+   size or format is not supported.
+
+char *sbagen_output_memory(size_t *size);
+-> Returns the samples collected by SBAGEN_OUT_MEMORY and their size in
+   octets; they are freed when another output is selected.
+
+int sbagen_set_blocks(int min, int max);
+-> Lets sbagen_run write blocks of min to max frames, chosen before each
+   block (see below), instead of one block per parameter update; the
+   samples are the same whatever the blocks, the parameters are still
+   updated at the -R rate. 0, 0 restores the default; fails if the range
+   is invalid. Ignored with a block given to sbagen_set_output_callback.
+
+void sbagen_set_mode(int mode);
+void sbagen_report_output(int latency, int underruns);
+-> Can be called from any thread, even during sbagen_run. With
+   SBAGEN_MODE_INTERACTIVE (the default), blocks are min frames, doubled
+   for each underrun and halved back after 10 s without one; with
+   SBAGEN_MODE_BACKGROUND, they are max frames. In both cases they stay
+   under half the latency of the consumer, in frames (0 if unknown);
+   underruns is its total underrun count so far.
+
+void sbagen_report_played(long long frames, int playing);
+-> Tells how many frames of the output of the current sbagen_run the
+   consumer has played, and whether it is playing (0 if paused). Can be
+   called from any thread, but from one at a time; the output callback
+   is the natural place. Without it, the played position is estimated
+   from the latency given to sbagen_report_output.
+
+int sbagen_get_clock(struct sbagen_clock *clock);
+-> Fills clock with the position of the last or current sbagen_run,
+   from any thread, without locking nor waiting for the render thread:
+	rendered: frames handed to the output so far
+	audible: estimate of the frame being heard now, from the last
+	  sbagen_report_played moved on by the time elapsed since while
+	  playing, never past rendered
+	latency: the difference of the two, in frames
+	time: time of the audible frame from the start of the sequence (ms)
+	period_start, period_end: bounds of the period it falls in, in ms
+	  from the start of the sequence, the start clipped to 0;
+	  approximate if more than 16 periods went by during the latency
+	playing: 1 if audible is moving on, 0 if paused or played out
+   Fails, without an error message, before the first sbagen_run.
+
+int sbagen_checkpoint(void *buf, int size);
+-> Only from the output callback of sbagen_run: saves the state of the
+   render just after the block being written (period, time, channel
+   phases and envelopes, noise, dither and mix positions) into buf, if
+   size is enough. Returns the size it needs, about 1.3 KB; fails if
+   not rendering, or while the sequence is still coming in.
+
+int sbagen_restore(const void *data, int size);
+-> Makes the next sbagen_run continue from the checkpoint in data,
+   sample for sample as if the first run had gone on: call it after
+   parsing the same sequence with the same parameters and output format
+   as when it was saved, the output being set up as for a new run.
+   Fails if the checkpoint does not match them or is damaged.
+
+int sbagen_set_realtime(int priority, int lock);
+-> Runs the render loop of sbagen_run and sbagen_run_listeners with
+   SCHED_FIFO at the given priority (0 for the normal scheduling) and, if
+   lock is set, with the memory locked, restoring the thread afterwards;
+   fails if priority is out of range. Both are best-effort: without the
+   privileges, rendering goes on normally. The loop itself never
+   allocates nor locks, everything is set up before it starts.
+
+int sbagen_set_kernel(int kernel);
+-> Selects how the binaural tones are synthesized, for the next
+   sbagen_run or sbagen_run_listeners; fails while rendering or if the
+   kernel is unknown. The other voices always read the tables.
+	SBAGEN_KERNEL_TABLE: two sine-table lookups per frame (the default)
+	SBAGEN_KERNEL_ROTATE: a fixed-point phasor per ear rotated each
+	  frame, in registers, and set again from the exact phase every
+	  4096 frames; it does not round the phase to the table, so the
+	  output differs slightly, but not with the blocks
+
+void sbagen_trace_enable(int on);
+int sbagen_trace_dump(const char *path);
+-> Only when built with SBAGEN_TRACE. Starts or stops recording trace
+   events, and writes the recorded events to path in Chrome trace-event
+   JSON (load it in chrome://tracing); the dump can fail on I/O errors.
+
 static int writeOut(char *buf, int size);
--> To be implemented. Called by sbagen_run; can return -1 to fail.
+-> Implemented by the build mode, if any. Called by sbagen_run for
+   SBAGEN_OUT_DEFAULT; can return -1 to fail.
 	buf: samples; actually "short (*buf)[2]"
 	size: size of buf in octets; divide by 4 (2 o/sample, 2 channels)
 
@@ -90,6 +334,64 @@ static int writeOut(char *buf, int size);
 
 #define VERSION "1.4.4"
 
+// Outputs for sbagen_set_output()
+#define SBAGEN_OUT_DEFAULT 0
+#define SBAGEN_OUT_NULL 1
+#define SBAGEN_OUT_MEMORY 2
+#define SBAGEN_OUT_FD 3
+#define SBAGEN_OUT_WAV 4
+
+// Sample formats
+#define SBAGEN_FMT_S16 0	// Signed 16-bit, native endian, stereo interleaved
+#define SBAGEN_FMT_S24 1	// Signed 24-bit packed, little endian, interleaved
+#define SBAGEN_FMT_F32 2	// 32-bit float, native endian, interleaved
+#define SBAGEN_FMT_PLANAR 0x100	// Or'ed with one of the above: each block
+				//   holds its left samples, then its right ones
+
+// Kernels for sbagen_set_kernel()
+#define SBAGEN_KERNEL_TABLE 0	// Sine-table lookups
+#define SBAGEN_KERNEL_ROTATE 1	// Phasor rotation
+
+// Modes for sbagen_set_mode()
+#define SBAGEN_MODE_INTERACTIVE 0	// Small blocks, quick to react
+#define SBAGEN_MODE_BACKGROUND 1	// Large blocks, fewer wake-ups
+
+// Playback position, for sbagen_get_clock()
+struct sbagen_clock {
+  long long rendered;		// Frames handed to the output
+  long long audible;		// Estimate of the frame being heard
+  int latency;			// Frames between the two
+  int time;			// Time of the audible frame (ms from the start)
+  int period_start, period_end;	// Period it falls in (ms from the start)
+  int playing;			// Audible is moving on
+};
+
+// Summary of a parsed sequence, for sbagen_query()
+struct sbagen_info {
+  int duration;			// Length of the sequence (ms), or -1 if it loops forever
+  int periods;			// Number of periods after correction
+  int channels;			// Number of channels (voices at once)
+  int types;			// Voice types used: bit 1<<SBAGEN_VOICE_*
+  double peak;			// Peak total amplitude, in % as in the sequence
+};
+#define SBAGEN_VOICE_BINAURAL 1	// Bits of sbagen_info.types
+#define SBAGEN_VOICE_PINK 2
+#define SBAGEN_VOICE_BELL 3
+#define SBAGEN_VOICE_SPIN 4
+#define SBAGEN_VOICE_MIX 5
+#define SBAGEN_VOICE_WAVE 6
+
+// Compiled timeline, see sbagen_timeline_get()
+struct sbagen_timeline;
+
+// One entry of a directory, for sbagen_index()
+struct sbagen_entry {
+  char *name;			// File name, with a trailing / for directories
+  long long mtime, size;	// As stat() gave them when the file was parsed
+  char *error;			// Why the file did not parse, or 0
+  struct sbagen_info info;	// Summary of the file if it did
+};
+
 // This should be built with one of the following target macros
 // defined, which selects options for that platform, or else with some
 // of the individual named flags #defined as listed later.
@@ -109,17 +411,27 @@ static int writeOut(char *buf, int size);
 #include <time.h>
 
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <stddef.h>
 typedef int64_t S64;
 
 #include <sys/times.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fnmatch.h>
 
 typedef struct Channel Channel;
 typedef struct Voice Voice;
 typedef struct Period Period;
 typedef struct NameDef NameDef;
 typedef struct BlockDef BlockDef;
+typedef struct Stmt Stmt;
+typedef struct StmtList StmtList;
+typedef struct sbagen_timeline Timeline;
+typedef struct Cursor Cursor;
 typedef unsigned char uchar;
 
 static inline int t_per24(int t0, int t1) ;
@@ -127,27 +439,104 @@ static inline int t_per0(int t0, int t1) ;
 static inline int t_mid(int t0, int t1) ;
 static int init_sin_table(void) ;
 static void * Alloc(size_t len) ;
+typedef struct Arena Arena;
+typedef struct ArenaChunk ArenaChunk;
+static void * aAlloc(Arena *, size_t) ;
+static char * aStrDup(Arena *, char *) ;
+static void aFree(Arena *) ;
 static char * StrDup(char *str) ;
 static int loop() ;
-static int outChunk() ;
+static int loopListeners() ;
+static int outChunk(int *) ;
+static void noiseChunk(int) ;
+static void mixChunk(Channel *, int) ;
+static void mixSource(int) ;
+static void mixFetch(int) ;
+static void mixStart() ;
+static void mixInput(int *, int, int) ;
+static void ditherChunk(short *, int, int *, int *) ;
+static int quietChunk(Channel *, int) ;
+static void ditherSkip(int, int *, int *) ;
+static void rotSetup(int, int *, int *) ;
+static void rotChunk(int *, int, Channel *) ;
+static void clockStart(S64) ;
+static void clockPeriod(S64) ;
+static void clockRendered(S64) ;
+static void clockStop(void) ;
+static int ckptApply(void) ;
+static int skipFrames(S64) ;
+static void tlView(Timeline *) ;
+static Timeline *tlUnshare(void) ;
 static void corrVal(int ) ;
+static int reloadCount(int) ;
+static void corrTime(int ) ;
+static void cursorMove(Cursor *, int) ;
+static void spinClip(Voice *, double) ;
+static Period *seekPeriod(Period *, int) ;
+static void slideVoice(Voice *, Period *, int, int, double) ;
+struct AmpAdj;
+static void corrChan(Channel *, Period **, double, int, struct AmpAdj *) ;
+static void setupChan(Channel *, double, int, struct AmpAdj *, int) ;
+static int compilePeriods(void) ;
+static int compilePeriod(Period *) ;
 static int readLine() ;
 static char * getWord(void) ;
 static void badSeq(void) ;
 static int readSeq(const char *text) ;
 static int correctPeriods();
-static int setup_device(void) ;
+static int setup_device(int) ;
+static void free_device(void) ;
 static int readNameDef();
-static int readTimeLine();
+static int readTimeLine(Stmt *);
+static int addPeriod(BlockDef *);
+static int streamEnd(StmtList *);
+static void free_blockdefs(BlockDef *);
+static NameDef *free_namedef(NameDef *);
+static uint64_t fnv1a(const void *, size_t, uint64_t);
+static void cache_end(uint64_t, int);
+static int readBlockLine(BlockDef *);
 static int voicesEq(Voice *, Voice *);
 static void error(char *fmt, ...) ;
 static int readTime(char *, int *);
 static int writeOut(char *, int);
 static int sinc_interpolate(double *, int, int *);
 static int handleOptions(char *p);
-static int setupOptC(const char *spec) ;
-
-#define N_CH 16			// Number of channels
+static int setupOptC(const char *spec, struct AmpAdj *, int *) ;
+static void cacheWrite(char *, int);
+static int outWrite(char *, int);
+static int outFormat(void);
+static int fmtBytes(int);
+static void outClose(void);
+static int outBlockLen(void);
+static int ctlBlockLen(void);
+static int nextBlockLen(void);
+static void blockReset(void);
+int sbagen_set_cache(const char *dir, long max_size);
+int sbagen_set_realtime(int priority, int lock);
+int sbagen_set_kernel(int kernel);
+int sbagen_set_blocks(int min, int max);
+void sbagen_set_mode(int mode);
+void sbagen_report_output(int latency, int underruns);
+void sbagen_report_played(long long frames, int playing);
+int sbagen_get_clock(struct sbagen_clock *clock);
+int sbagen_checkpoint(void *buf, int size);
+int sbagen_restore(const void *data, int size);
+int sbagen_set_output_format(int format);
+void sbagen_free_listeners(void);
+void sbagen_free_seq(void);
+int sbagen_parse_seq(const char *seq);
+int sbagen_reload(const char *seq);
+int sbagen_stream(const char *seq, int more);
+void sbagen_set_stream_wait(int (*wait)(void *opaque), void *opaque);
+int sbagen_query(const char *seq, struct sbagen_info *info);
+struct sbagen_timeline *sbagen_timeline_get(void);
+void sbagen_timeline_put(struct sbagen_timeline *tl);
+int sbagen_timeline_use(struct sbagen_timeline *tl);
+int sbagen_timeline_info(struct sbagen_timeline *tl, struct sbagen_info *info);
+int sbagen_timeline_preview(struct sbagen_timeline *tl, int n, float *data);
+void sbagen_free_index(struct sbagen_entry *entries, int n);
+
+#define MAX_CH 1024		// Maximum number of channels (voices in a voice-set)
 
 struct Voice {
   int typ;			// Voice type: 0 off, 1 binaural, 2 pink noise, 3 bell, 4 spin,
@@ -164,25 +553,117 @@ struct Channel {
   int amp, amp2;		// Current state, according to current type
   int inc1, off1;		//  ::  (for binaural tones, offset + increment into sine 
   int inc2, off2;		//  ::   table * 65536)
+  int rc1, rs1, rc2, rs2;	// For binaural tones with SBAGEN_KERNEL_ROTATE: rotation
+				//   by inc1 and inc2, cos and sin << ROT_BITS,
+  int pc1, ps1, pc2, ps2;	//   phasors at off1 and off2, in the same units,
+  int rot_left;			//   and frames before setting them from those again
+};
+
+struct ArenaChunk {
+  ArenaChunk *nxt;		// Next in chain
+  double align[];		// Start of the data, aligned
+};
+
+struct Arena {
+  ArenaChunk *chunks;		// Chunks allocated, most recent first
+  char *cur;			// Free space in the current chunk
+  size_t left;			//  :: and its size
 };
 
 struct Period {
   Period *nxt, *prv;		// Next/prev in chain
   int tim;			// Start time (end time is ->nxt->tim)
-  Voice v0[N_CH], v1[N_CH];	// Start and end voices
+  int nch;			// Number of channels in v0[] and v1[]
+  Voice *v0, *v1;		// Start and end voices (one allocation, v0 first)
+  Voice *dv;			// Change per ms of the channels that vary (typ != 0),
+				//   or 0 if the period is steady
   int fi, fo;			// Temporary: Fade-in, fade-out modes
+  BlockDef *src;		// Voice-set of the time line it comes from
+};
+
+//
+//	A compiled timeline, once sbagen_timeline_get() has shared it: the
+//	Period ring and the waveforms, never written again.  Every walk
+//	over it goes through a Cursor of its own; the loaded sequence holds
+//	one of the references while it uses the timeline.
+//
+
+struct sbagen_timeline {
+  int refs;			// References, only changed atomically
+  Arena arena;			// Periods and their voices
+  Period *per;			// Some period of the ring
+  int *waves[100];		// Waveforms used, as waves[]
+  int n_ch;			// Number of channels
+  int tim0, tim1;		// First and last times mentioned
+  int n_periods;		// Number of Period structures
+  int ns_used;			// Some period has pink or spinning noise
+  int mix_flag;			// 'mix/*' is used
+  uint64_t hash;		// Hash of the sequence text
+};
+
+//
+//	A position in a timeline and the voice settings there
+//
+
+struct Cursor {
+  Period *per;			// Period the time falls in
+  Period *cur_per;		// Period v[] was last set up for
+  Voice *v;			// Voice settings for the time
+  int n_ch;			// Channels in v[]
+  int trigger;			// Moved into another period: trigger bells
+  double clip;			// Maximum 'carrier' value for spin (really max width in us)
 };
 
 struct NameDef {
   NameDef *nxt;
   char *name;			// Name of definition
   BlockDef *blk;		// Non-zero for block definition
-  Voice vv[N_CH];		// Voice-set for it (unless a block definition)
+  BlockDef *flat;		// Memoized expansion of blk down to voice-sets
+  NameDef *flat_list;		// Value of nlist when flat was built
+  int nvv;			// Number of voices in vv[]
+  Voice *vv;			// Voice-set for it (unless a block definition)
+  int seen;			// Reload that last reached its definition
 };
 
 struct BlockDef {
   BlockDef *nxt;		// Next in chain
-  char *lin;			// StrDup'd line
+  int tim;			// Time relative to the start of the block
+  int fi, fo;			// Fade-in, fade-out modes
+  int slide;			// 1 if followed by '->', -1 if followed by junk
+  char *name;			// StrDup'd name used on the line (0 in flat lists)
+  NameDef *nd;			// Voice-set (in flat lists only)
+  Period *first;		// For a time line: its first period, or 0
+};
+
+//
+//	Statements of the loaded sequence, in order: what each name
+//	definition and time line produced, with a hash of its text, so
+//	that sbagen_reload() can keep the ones that did not change
+//
+
+struct Stmt {
+  uint64_t hash;		// Hash of the text of the statement
+  int kind;			// STMT_*
+  int wave;			// Waveform number (STMT_WAVE)
+  NameDef *nd;			// Name defined, or used by a time line
+  BlockDef *tl;			// Voice-sets started by a time line, as in flat lists
+  int nt, nch;			//  :: how many, and their most channels
+  int tim0, tim1;		// Time of a time line, and of its last voice-set
+  int abs0, abs1;		// last_abs_time before and after a time line
+  int rel;			// Time line relative to last_abs_time
+  int used;			// Taken over by the reload in progress
+  Stmt *old;			// During a reload: statement taken over, or 0
+  const char *text;		//  :: time line still to read, and its line
+  int line;
+};
+
+#define STMT_NAME 0		// Block or voice-set definition
+#define STMT_WAVE 1		// Waveform definition
+#define STMT_TIME 2		// Time line
+
+struct StmtList {
+  Stmt *st;
+  int n, alloc;
 };
 
 #define ST_AMP 0x7FFFF		// Amplitude of wave in sine-table
@@ -190,52 +671,232 @@ struct BlockDef {
 #define NS_DITHER 16		// How many bits right to shift the noise for dithering
 #define NS_AMP (ST_AMP<<NS_ADJ)
 #define ST_SIZ 16384		// Number of elements in sine-table (power of 2)
-static int *sin_table;
+#define ROT_BITS 30		// Fixed point of the rotations of SBAGEN_KERNEL_ROTATE
+#define ROT_OUT (ROT_BITS - 19)	// Shift from the phasors to the sine-table scale
+#define ROT_SYNC 4096		// Frames between resets of the phasors to the exact phase
+static const int *sin_table;
+
+// With SBAGEN_TABLES, the tables come precomputed from gentables.c
+// and live in read-only data
+#if SBAGEN_TABLES
+#include "tmp/sbagen-tables.h"
+#endif
 #define AMP_DA(pc) (40.96 * (pc))	// Display value (%age) to ->amp value
 #define AMP_AD(amp) ((amp) / 40.96)	// Amplitude value to display %age
 static int *waves[100];		// Pointers are either 0 or point to a sin_table[]-style array of int
 
-static Channel chan[N_CH];	// Current channel states
+static Channel *chan;		// Current channel states
+static Cursor play;		// Where rendering is, shared by all listeners
+static Period *chan_per;	// Period chan[] was last set up for
+static int n_ch;		// Number of channels used by the sequence
 static int now;			// Current time (milliseconds from midnight)
-static Period *per= 0;		// Current period
+static Period *per= 0;		// Some period of the ring of the loaded sequence
+static Arena seq_arena;		// Periods, unless seq_tl has them
+static Timeline *seq_tl;	// Timeline the loaded sequence uses, if shared
+static Arena parse_arena;	// Names and blocks, freed at the end of the parse
 static NameDef *nlist;		// Full list of name definitions
 
-static int *tmp_buf;		// Temporary buffer for 20-bit mix values
-static short *out_buf;		// Output buffer
-static int out_bsiz;		// Output buffer size (bytes)
-static int out_blen;		// Output buffer length (samples) (1.0* or 0.5* out_bsiz)
-static int out_bps;		// Output bytes per sample (2 or 4)
+static int *tot_buf;		// Left and right mix accumulators for a buffer-ful
+static int *ns_hist;		// Noise for a buffer-ful, after NS_HIST previous values
+static int ns_last;		// Frames in ns_hist after the history
+static int ns_used;		// Some period has pink or spinning noise
+static char *out_buf;		// Output buffer, for the largest write block
+static int out_fmt;		// Its sample format, SBAGEN_FMT_*
+static int out_bsiz;		// Bytes rendered between parameter updates
+static int out_blen;		// Samples rendered between parameter updates
+static int out_bps;		// Output bytes per frame (4 to 8)
 static int out_buf_ms;		// Time to output a buffer-ful in ms
 static int out_buf_lo;		// Time to output a buffer-ful, fine-tuning in ms/0x10000
-static int out_fd;		// Output file descriptor
+static int out_fd= 1;		// Output file descriptor
 static int out_rate= 44100;	// Sample rate
 static int out_prate= 10;	// Rate of parameter change (for file and pipe output only)
 static int fade_int= 60000;	// Fade interval (ms)
+static int osc_kernel;		// SBAGEN_KERNEL_* for the binaural tones
 static const char *in_text;	// Input sequence text
+static const char *line_start;	// Start of the line read last in in_text
 static int in_lin;		// Current input line
 static char buf[4096];		// Buffer for current line
 static char buf_copy[4096];	// Used to keep unmodified copy of line
 static char *lin;		// Input line (uses buf[])
 static char *lin_copy;		// Copy of input line
-static double spin_carr_max;	// Maximum 'carrier' value for spin (really max width in us)
 static char error_message[256];	// Buffer for the error message
 
 #define NS_BIT 10
 //static int ns_tbl[1<<NS_BIT];
 //static int ns_off= 0;
 
+//
+//	Limits that keep a hostile sequence file from using unbounded
+//	time, memory or stack while being parsed
+//
+
+#define MAX_BLOCK_DEPTH 16	// Maximum nesting of block definitions
+#define MAX_PERIODS 65536	// Maximum number of Period structures per sequence
+#define MAX_PARSE_WORK (1<<24)	// Maximum lines read or expanded plus periods visited
+
+#define FNV_INIT 0xCBF29CE484222325ULL
+#define SPLICE_MARGIN 4		// Voice-sets built again around a reloaded edit
+
+static int n_periods;		// Number of Period structures allocated
+static int n_timed;		// Voice-sets started by the time lines read
+static int parse_work;		// Parse work done so far
+static size_t parse_mem;	// Bytes allocated since the start of the parse
+static int last_abs_time= -1;	// Last absolute time seen in the sequence
+
 static int fast_tim0= -1;	// First time mentioned in the sequence file (for -q and -S option)
 static int fast_tim1= -1;	// Last time mentioned in the sequence file (for -E option)
 				//  output rate, with the multiplier indicated
 static S64 byte_count= -1;	// Number of bytes left to output, or -1 if unlimited
+static S64 byte_done;		// Bytes output by loop() so far
+static int ctl_left;		// Samples loop() renders before the next update
+static int out_pending;		// Bytes of the block being written, not in byte_done
+static int run_tim0;		// fast_tim0 when loop() or cache_play() started
+static struct Checkpoint *ckpt;	// State for loop() to start from, see sbagen_restore()
 static int tty_erase;		// Chars to erase from current line (for ESC[K emulation)
 
 static int mix_flag= 0;		// Has 'mix/*' been used in the sequence?
-
+static const short *mix_data;	// Samples of the mix input, see sbagen_set_mix()
+static void *mix_map;		// Its mapping, and the length of it
+static size_t mix_map_len;
+static S64 mix_frames;		// Frames in the mix input
+static int mix_chans;		// 1 or 2 channels
+static int mix_rate;		// Its sample rate, 0 for the output rate
+static int mix_sec;		// Input frames per second while rendering
+static long mix_page;		// Page size, for prefetching
+static uint64_t mix_step;	// Input frames per output frame, 32.32 fixed point
+static uint64_t mix_pos;	// Input position of the next buffer-ful, 32.32
+static uint64_t mix_cur;	// Input position of the current buffer-ful
+static S64 mix_ahead;		// Input frame up to which it was prefetched
+
+static StmtList stmts;		// Statements of the last text parsed
+static int stmts_whole;		// They make up the whole loaded sequence
+static int stmts_stale;		// Statements read again since parse_arena was new
+static int reload_serial;	// Number of reloads so far
+static int running;		// 1 in sbagen_run, 2 in sbagen_run_listeners,
+				// 3 while cache_play() replays
+static S64 cache_stop;		// Frames cache_play() replayed before a reload
+static int seq_reloaded;	// Reloaded from writeOut: remaining length unknown
+static int seq_more;		// More text is to come, see sbagen_stream()
+static int (*stream_wait)(void *);	// Called when playback catches up with it
+static void *stream_opaque;
+static int chan_max;		// Channels allocated in chan[] and play.v[]
+
+static char *cache_dir;		// Directory of the rendered output cache, or 0
+static long cache_max;		// Maximum total size of the cache files
+static int cache_fd= -1;	// Cache file being written while rendering
+static uint64_t seq_hash;	// Hash of the sequence text, or 0 if none parsed
+
+#define AMPADJ_MAX 16		// Maximum number of -c option points
 static int opt_c;		// Number of -c option points provided (max 16)
 static struct AmpAdj { 
    double freq, adj;
-} ampadj[16];			// List of maximum 16 (freq,adj) pairs, freq-increasing order
+} ampadj[AMPADJ_MAX];		// List of maximum 16 (freq,adj) pairs, freq-increasing order
+
+//
+//	Additional output streams rendered from the same timeline,
+//	each with its own volume, -c compensation and start time
+//
+
+typedef struct Listener Listener;
+struct Listener {
+  Listener *nxt;		// Next in chain
+  double gain;			// Volume multiplier
+  int opt_c;			// Number of -c option points
+  struct AmpAdj ampadj[AMPADJ_MAX]; // -c option points
+  int start;			// Time since the start of the sequence (ms) when the stream starts
+  Channel *chan;		// Channel states
+  Period *per;			// Period chan[] was last set up for
+  short *out_buf;		// Output buffer
+  int rand0, rand1;		// Dither state
+  int (*out)(void *opaque, char *buf, int size);
+  void *opaque;
+};
+static Listener *listeners;	// List of listeners, in the order added
+
+//
+//	Trace points, compiled in with -DSBAGEN_TRACE=1 and enabled at
+//	run time with sbagen_trace_enable().  Each thread records into
+//	its own fixed buffer, so recording takes no lock; the buffers
+//	are dumped in Chrome trace-event JSON by sbagen_trace_dump().
+//
+
+#if SBAGEN_TRACE
+
+#define TRACE_NEV 65536		// Events kept per thread (older ones are overwritten)
+
+typedef struct TraceBuf TraceBuf;
+struct TraceBuf {
+  TraceBuf *nxt;		// Next buffer in the list of all threads
+  int tid;			// Thread number in the dump
+  unsigned cnt;			// Number of events ever recorded
+  struct TraceEv {
+    const char *name;		// Static string
+    char ph;			// 'B'egin or 'E'nd
+    S64 ts;			// Monotonic time in microseconds
+  } ev[TRACE_NEV];
+};
+
+static int trace_enabled;
+static TraceBuf *trace_bufs;	// Lock-free list of per-thread buffers
+static __thread TraceBuf *trace_buf;
+
+static void
+trace_event(const char *name, char ph) {
+  struct timespec ts;
+  struct TraceEv *ev;
+  TraceBuf *tb= trace_buf;
+
+  if (!tb) {
+    if (!(tb= (TraceBuf*)calloc(1, sizeof(*tb)))) return;
+    do {
+      tb->nxt= trace_bufs;
+      tb->tid= tb->nxt ? tb->nxt->tid + 1 : 1;
+    } while (!__sync_bool_compare_and_swap(&trace_bufs, tb->nxt, tb));
+    trace_buf= tb;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ev= &tb->ev[tb->cnt % TRACE_NEV];
+  ev->name= name;
+  ev->ph= ph;
+  ev->ts= ts.tv_sec * (S64)1000000 + ts.tv_nsec / 1000;
+  __sync_synchronize();
+  tb->cnt++;
+}
+
+#define TRACE_BEGIN(name) do { if (trace_enabled) trace_event(name, 'B'); } while (0)
+#define TRACE_END(name) do { if (trace_enabled) trace_event(name, 'E'); } while (0)
+
+#else
+
+#define TRACE_BEGIN(name) do { } while (0)
+#define TRACE_END(name) do { } while (0)
+
+#endif
+
+//
+//	Real-time rendering.  Everything the render loop uses is
+//	allocated by setup_device() before it starts, so that between
+//	RT_ENTER() and RT_LEAVE() nothing allocates, locks or makes a
+//	system call.  Built with -DSBAGEN_RT_CHECK=1, the standalone
+//	test program hooks malloc() and friends and aborts if they are
+//	called there.  sbagen_set_realtime() optionally runs the render
+//	loop with SCHED_FIFO and its memory locked.
+//
+
+#if SBAGEN_RT_CHECK
+static volatile int rt_check;	// Inside the render loop
+#define RT_ENTER() (rt_check= 1)
+#define RT_LEAVE() (rt_check= 0)
+#else
+#define RT_ENTER() do { } while (0)
+#define RT_LEAVE() do { } while (0)
+#endif
+
+static int rt_priority;		// SCHED_FIFO priority while rendering, or 0
+static int rt_lock;		// Lock memory while rendering
+static int rt_locked;		// Memory actually locked
+static int rt_policy= -1;	// Scheduling to restore after rendering
+static struct sched_param rt_param;
 
 //
 //	Time-keeping functions
@@ -269,21 +930,22 @@ handleOptions(char *str0) {
 }
 
 //
-//	Setup the ampadj[] array from the given -c spec-string
+//	Setup an ampadj[] array (AMPADJ_MAX entries) and its count
+//	from the given -c spec-string
 //
 
 int
-setupOptC(const char *spec) {
+setupOptC(const char *spec, struct AmpAdj *ampadj, int *nadj) {
    const char *p= spec, *q;
    int a, b;
+   int opt_c= *nadj;
    
    while (1) {
       while (isspace(*p) || *p == ',') p++;
       if (!*p) break;
 
-      if (opt_c >= sizeof(ampadj) / sizeof(ampadj[0])) {
-	 error("Too many -c option frequencies; maxmimum is %d", 
-	       sizeof(ampadj) / sizeof(ampadj[0]));
+      if (opt_c >= AMPADJ_MAX) {
+	 error("Too many -c option frequencies; maxmimum is %d", AMPADJ_MAX);
 	 return -1;
       }
 
@@ -303,6 +965,7 @@ setupOptC(const char *spec) {
 	    tmp= ampadj[a].freq; ampadj[a].freq= ampadj[b].freq; ampadj[b].freq= tmp;
 	    tmp= ampadj[a].adj; ampadj[a].adj= ampadj[b].adj; ampadj[b].adj= tmp;
 	 }
+   *nadj= opt_c;
    return 0;
       
  bad:
@@ -313,6 +976,9 @@ setupOptC(const char *spec) {
 
 static int
 init_sin_table(void) {
+#if SBAGEN_TABLES
+  sin_table= sin_table_data;
+#else
   int a;
   int *arr= (int*)Alloc(ST_SIZ * sizeof(int));
   if(arr == NULL)
@@ -320,6 +986,7 @@ init_sin_table(void) {
   for (a= 0; a<ST_SIZ; a++)
     arr[a]= (int)(ST_AMP * sin((a * 3.14159265358979323846 * 2) / ST_SIZ));
   sin_table= arr;
+#endif
   return 0;
 }
 
@@ -333,6 +1000,7 @@ static void *
 Alloc(size_t len) {
   void *p= calloc(1, len);
   if (!p) error("Out of memory");
+  parse_mem += len;
   return p;
 }
 
@@ -340,9 +1008,119 @@ static char *
 StrDup(char *str) {
   char *rv= strdup(str);
   if (!rv) error("Out of memory");
+  parse_mem += strlen(str) + 1;
+  return rv;
+}
+
+//
+//	Arena allocation: objects that live as long as the sequence (or
+//	as the parse) are carved out of large zeroed chunks, and the
+//	whole arena is released at once
+//
+
+#define ARENA_CHUNK 65536
+
+static void *
+aAlloc(Arena *a, size_t len) {
+  ArenaChunk *c;
+  void *p;
+
+  len= (len + 15) & ~(size_t)15;
+  if (len > a->left) {
+    size_t siz= len > ARENA_CHUNK ? len : ARENA_CHUNK;
+    if (!(c= (ArenaChunk*)Alloc(sizeof(ArenaChunk) + siz)))
+      return 0;
+    c->nxt= a->chunks;
+    a->chunks= c;
+    a->cur= (char*)(c + 1);
+    a->left= siz;
+  }
+  p= a->cur;
+  a->cur += len;
+  a->left -= len;
+  return p;
+}
+
+static char *
+aStrDup(Arena *a, char *str) {
+  size_t len= strlen(str) + 1;
+  char *rv= (char*)aAlloc(a, len);
+  if (rv) memcpy(rv, str, len);
   return rv;
 }
 
+static void
+aFree(Arena *a) {
+  ArenaChunk *c;
+
+  while ((c= a->chunks)) {
+    a->chunks= c->nxt;
+    free(c);
+  }
+  a->cur= 0;
+  a->left= 0;
+}
+
+//
+//	Account for parse work, failing once the limit is reached
+//
+
+static int
+parseWork(int n) {
+  if ((parse_work += n) > MAX_PARSE_WORK) {
+    error("Sequence too complex, line %d", in_lin);
+    return -1;
+  }
+  return 0;
+}
+
+//
+//	Allocate a Period, within the limit
+//
+
+static Period *
+newPeriod(int nch) {
+  Period *pp;
+
+  if (n_periods >= MAX_PERIODS) {
+    error("Too many periods (maximum %d), line %d", MAX_PERIODS, in_lin);
+    return 0;
+  }
+  n_periods++;
+  if (!(pp= (Period*)aAlloc(&seq_arena, sizeof(Period))) ||
+      !(pp->v0= (Voice*)aAlloc(&seq_arena, (2 * nch + 1) * sizeof(Voice))))
+    return 0;
+  pp->nch= nch;
+  pp->v1= pp->v0 + nch;
+  return pp;
+}
+
+//
+//	Give all periods n_ch channels, once all the voice-sets used
+//	are known
+//
+
+static int
+widenPeriods(void) {
+  Period *pp= per;
+  Voice *vv;
+
+  do {
+    if (pp->nch < n_ch) {
+      if (!(vv= (Voice*)aAlloc(&seq_arena, 2 * n_ch * sizeof(Voice))))
+	return -1;
+      memcpy(vv, pp->v0, pp->nch * sizeof(Voice));
+      memcpy(vv + n_ch, pp->v1, pp->nch * sizeof(Voice));
+      pp->v0= vv;
+      pp->dv= 0;		// Too narrow now, compilePeriods() makes a new one
+      pp->v1= vv + n_ch;
+      pp->nch= n_ch;
+    }
+    pp= pp->nxt;
+  } while (pp != per);
+  return 0;
+}
+
 //
 //	Simple random number generator.  Generates a repeating
 //	sequence of 65536 odd numbers in the range -65535->65535.
@@ -374,8 +1152,7 @@ struct Noise {
 };
 static Noise ntbl[NS_BANDS];
 static int nt_off;
-static int noise_buf[256];
-static uchar noise_off= 0;
+#define NS_HIST 256		// Previous noise values kept for spinning noise
 
 static inline int 
 noise2() {
@@ -398,7 +1175,7 @@ noise2() {
     ns++;
   }
 
-  return noise_buf[noise_off++]= (tot >> NS_ADJ);
+  return tot >> NS_ADJ;
 }
 
 //	//
@@ -429,45 +1206,192 @@ noise2() {
 //	Play loop
 //
 
+static int now_lo;		// Low-order 16 bits of 'now' (fractional)
+
+//
+//	Advance 'now' by one buffer-ful; returns the increment in ms
+//
+
+static int
+nextChunkTime(void) {
+  int ms_inc= out_buf_ms;
+
+  now_lo += out_buf_lo;
+  if (now_lo >= 0x10000) { ms_inc += now_lo >> 16; now_lo &= 0xFFFF; }
+  now += ms_inc;
+  if (now > H24) now -= H24;
+  return ms_inc;
+}
+
+//
+//	Switch the calling thread to the real-time settings, once
+//	everything is allocated; failures leave the normal settings
+//
+
+static void
+rtBegin(void) {
+  struct sched_param sp;
+
+  rt_locked= rt_lock && mlockall(MCL_CURRENT) == 0;
+  rt_policy= -1;
+  if (rt_priority > 0 &&
+      pthread_getschedparam(pthread_self(), &rt_policy, &rt_param) == 0) {
+    sp.sched_priority= rt_priority;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+      rt_policy= -1;
+  }
+}
+
+static void
+rtEnd(void) {
+  if (rt_policy >= 0)
+    pthread_setschedparam(pthread_self(), rt_policy, &rt_param);
+  if (rt_locked)
+    munlockall();
+  rt_locked= 0;
+  rt_policy= -1;
+}
+
+//
+//	Rewind the mix input for a new run at the current output rate
+//
+
+static void
+mixStart() {
+  mix_sec= mix_rate ? mix_rate : out_rate;
+  mix_step= ((uint64_t)mix_sec << 32) / out_rate;
+  mix_page= sysconf(_SC_PAGESIZE);
+  mix_pos= mix_cur= 0;
+  mix_ahead= 0;
+  if (mix_data) {
+    mixSource(0);
+    mixFetch(outBlockLen() / 2);
+  }
+}
+
 static int
 loop() {	
-  int c, cnt;
-  int now_lo= 0;			// Low-order 16 bits of 'now' (fractional)
-  int err_lo= 0;
-  int ms_inc;
+  S64 resume= cache_stop;
   int r;
 
-  if(setup_device() < 0)
+  if(setup_device(outFormat()) < 0)
       return -1;
-  spin_carr_max= 127.0 / 1E-6 / out_rate;
-  cnt= 1 + 1999 / out_buf_ms;	// Update every 2 seconds or so
-  now= fast_tim0;
+  rtBegin();
+  running= 1;
+  play.clip= 127.0 / 1E-6 / out_rate;
+  if (!resume)
+    run_tim0= fast_tim0;	// Else still the start of the replay
+  now= run_tim0;
+  now_lo= 0;
+  mixStart();
   byte_count= out_bps * (S64)(t_per0(now, fast_tim1) * 0.001 * out_rate);
+  byte_done= 0;
+  ctl_left= 0;
+  cache_stop= 0;
 
+  r= resume ? skipFrames(resume) : 1;	// Where the replay of the cache was
   corrVal(0);		// Get into correct period
+  if (ckpt) r= ckptApply();	// Or where sbagen_restore() says
+  if (resume)
+    clockPeriod(resume);	// The clock of the replay goes on
+  else
+    clockStart(byte_done / out_bps);
   
+  while (r > 0) {
+    TRACE_BEGIN("outChunk");
+    RT_ENTER();
+    r = outChunk(&ctl_left);
+    TRACE_END("outChunk");
+  }
+  running= 0;
+  clockStop();
+  rtEnd();
+  free_device();
+  return r;
+}
+
+//
+//	Render all the listeners in one pass over the timeline: the
+//	period interpolation and the noise are done once per buffer-ful,
+//	only the channel states, mixing and dither are per listener
+//
+
+static int
+loopListeners() {
+  Listener *l;
+  int elapsed= 0;
+  int siz, r= 0;
+
+  if (setup_device(SBAGEN_FMT_S16) < 0)
+    return -1;
+  running= 2;
+  for (l= listeners; l; l= l->nxt) {
+    l->chan= (Channel*)Alloc(n_ch * sizeof(Channel));
+    l->out_buf= (short*)Alloc(out_blen * sizeof(short));
+    l->rand0= l->rand1= 0;
+    l->per= 0;
+    if ((l->chan == NULL && n_ch) || l->out_buf == NULL) {
+      r= -1;
+      goto done;
+    }
+  }
+  play.clip= 127.0 / 1E-6 / out_rate;
+  now= fast_tim0;
+  now_lo= 0;
+  mixStart();
+  byte_count= out_bps * (S64)(t_per0(now, fast_tim1) * 0.001 * out_rate);
+
+  corrTime(0);		// Get into correct period
+  rtBegin();
+
   while (1) {
-    for (c= 0; c < cnt; c++) {
-      corrVal(1);
-      r = outChunk();
-      if(r == 0)
-	goto break2; /* all done */
-      if(r < 0) {
-	  free(tmp_buf);
-	  free(out_buf);
-	  return -1;
+    TRACE_BEGIN("corrVal");
+    RT_ENTER();
+    corrTime(1);
+    TRACE_END("corrVal");
+    if (ns_used) noiseChunk(out_blen / 2);
+    if (mix_data) mixSource(out_blen / 2);
+    RT_LEAVE();
+    siz= out_bsiz;
+    if (byte_count > 0 && byte_count <= out_bsiz)
+      siz= byte_count;
+    for (l= listeners; l; l= l->nxt) {
+      if (elapsed < l->start)
+	continue;
+      TRACE_BEGIN("outChunk");
+      RT_ENTER();
+      corrChan(l->chan, &l->per, l->gain, l->opt_c, l->ampadj);
+      if (quietChunk(l->chan, out_blen / 2)) {
+	memset(l->out_buf, 0, out_blen * sizeof(short));
+	ditherSkip(out_blen / 2, &l->rand0, &l->rand1);
+      } else {
+	mixChunk(l->chan, out_blen / 2);
+	ditherChunk(l->out_buf, out_blen / 2, &l->rand0, &l->rand1);
+      }
+      RT_LEAVE();
+      TRACE_END("outChunk");
+      if (l->out(l->opaque, (char*)l->out_buf, siz) < 0) {
+	r= -1;
+	goto done;
       }
-      ms_inc= out_buf_ms;
-      now_lo += out_buf_lo + err_lo;
-      if (now_lo >= 0x10000) { ms_inc += now_lo >> 16; now_lo &= 0xFFFF; }
-      now += ms_inc;
-      if (now > H24) now -= H24;
     }
+    if (mix_data) mixFetch(out_blen / 2);
+    if (byte_count > 0) {
+      if (byte_count <= out_bsiz)
+	break;		// All done
+      byte_count -= out_bsiz;
+    }
+    elapsed += nextChunkTime();
   }
-break2:
-  free(tmp_buf);
-  free(out_buf);
-  return 0;
+done:
+  running= 0;
+  rtEnd();
+  for (l= listeners; l; l= l->nxt) {
+    free(l->chan); l->chan= 0;
+    free(l->out_buf); l->out_buf= 0;
+  }
+  free_device();
+  return r;
 }
 
 
@@ -481,138 +1405,623 @@ break2:
 
 static int rand0, rand1;
 
-static int
-outChunk() {
-   int off= 0;
+//
+//	Generate the pink noise for n frames, shared by all channels and
+//	listeners
+//
+
+static void
+noiseChunk(int n) {
+   int *ns= ns_hist + NS_HIST;
+   int i;
+
+   // Keep the end of the previous buffer-ful for spinning noise
+   memmove(ns_hist, ns_hist + ns_last, NS_HIST * sizeof(int));
+   for (i= 0; i<n; i++)
+      ns[i]= noise2();
+   ns_last= n;
+}
+
+//
+//	Set *rc and *rs to the cosine and sine of the phase step inc,
+//	in sine-table units * 65536, with ROT_BITS fraction bits
+//
 
-   while (off < out_blen) {
-      int ns= noise2();		// Use same pink noise source for everything
-      int tot1, tot2;		// Left and right channels
-      int mix1, mix2;		// Incoming mix signals
-      int val, a;
-      Channel *ch;
-      int *tab;
+static void
+rotSetup(int inc, int *rc, int *rs) {
+   double w= inc * (2 * M_PI / ST_SIZ / 65536);
 
-      mix1= tmp_buf[off];
-      mix2= tmp_buf[off+1];
+   *rc= (int)lrint(cos(w) * (1 << ROT_BITS));
+   *rs= (int)lrint(sin(w) * (1 << ROT_BITS));
+}
 
-      // Do default mixing at 100% if no mix/* stuff is present
-      if (!mix_flag) {
-	 tot1= mix1 << 12;
-	 tot2= mix2 << 12;
-      } else {
-	 tot1= tot2= 0;
+//
+//	Add the binaural tones of ch to tot[] for n frames, as the table
+//	loop would, by rotating a phasor per ear by (rc, rs) each frame.
+//	The phasors go on from one call to the next, and are set again
+//	from the exact phase every ROT_SYNC frames of the channel, so
+//	neither phase nor level drifts and the blocks do not matter.
+//	Both ears in one loop, for the two chains of multiplications to
+//	overlap
+//
+
+static void
+rotChunk(int *tot, int n, Channel *ch) {
+   const double mag= (double)ST_AMP * (1 << ROT_OUT);
+   const double rad= 2 * M_PI / ST_SIZ / 65536;
+   const S64 half= 1LL << (ROT_BITS - 1);
+   const int rc1= ch->rc1, rs1= ch->rs1, rc2= ch->rc2, rs2= ch->rs2;
+   const int amp1= ch->amp, amp2= ch->amp2;
+   int c1, s1, c2, s2, t1, t2;
+   int i, end;
+
+   for (i= 0; i<n; ) {
+      if (ch->rot_left == 0) {
+	 double ph1= (((unsigned)ch->off1 + (unsigned)ch->inc1 * i) &
+		      ((ST_SIZ << 16) - 1)) * rad;
+	 double ph2= (((unsigned)ch->off2 + (unsigned)ch->inc2 * i) &
+		      ((ST_SIZ << 16) - 1)) * rad;
+	 ch->pc1= (int)lrint(cos(ph1) * mag);
+	 ch->ps1= (int)lrint(sin(ph1) * mag);
+	 ch->pc2= (int)lrint(cos(ph2) * mag);
+	 ch->ps2= (int)lrint(sin(ph2) * mag);
+	 ch->rot_left= ROT_SYNC;
       }
-      
-      ch= &chan[0];
-      for (a= 0; a<N_CH; a++, ch++) switch (ch->typ) {
+      c1= ch->pc1; s1= ch->ps1;
+      c2= ch->pc2; s2= ch->ps2;
+      end= n - i < ch->rot_left ? n : i + ch->rot_left;
+      ch->rot_left -= end - i;
+      // 32 by 32 bit products into 64 bits: one SMULL or SMLAL each
+      // on ARM, rather than a full 64-bit multiply
+      for (; i<end; i++, tot += 2) {
+	 t1= (int)(((S64)c1 * rc1 - (S64)s1 * rs1 + half) >> ROT_BITS);
+	 t2= (int)(((S64)c2 * rc2 - (S64)s2 * rs2 + half) >> ROT_BITS);
+	 s1= (int)(((S64)s1 * rc1 + (S64)c1 * rs1 + half) >> ROT_BITS);
+	 s2= (int)(((S64)s2 * rc2 + (S64)c2 * rs2 + half) >> ROT_BITS);
+	 c1= t1;
+	 c2= t2;
+	 tot[0] += amp1 * (s1 >> ROT_OUT);
+	 tot[1] += amp2 * (s2 >> ROT_OUT);
+      }
+      ch->pc1= c1; ch->ps1= s1;
+      ch->pc2= c2; ch->ps2= s2;
+   }
+}
+
+//
+//	Mix n frames of the channels in chan[] into tot_buf[]
+//
+
+static void
+mixChunk(Channel *chan, int n) {
+   int *ns= ns_hist + NS_HIST;	// Use same pink noise source for everything
+   int a, i;
+   Channel *ch;
+
+   // Do default mixing at 100% if no mix/* stuff is present
+   memset(tot_buf, 0, 2*n * sizeof(int));
+   if (!mix_flag && mix_data)
+      mixInput(tot_buf, n, 4096);
+
+   // Mix one channel at a time, skipping the ones that are off
+   for (a= 0, ch= chan; a<n_ch; a++, ch++) {
+      int *tot= tot_buf;
+      const int *tab= sin_table;
+      int off1= ch->off1, off2= ch->off2;
+      int inc1= ch->inc1, inc2= ch->inc2;
+      int amp= ch->amp, amp2= ch->amp2;
+      int val;
+
+      switch (ch->typ) {
        case 0:
-	  break;
+	  continue;
        case 1:	// Binaural tones
-	  ch->off1 += ch->inc1;
-	  ch->off1 &= (ST_SIZ << 16) - 1;
-	  tot1 += ch->amp * sin_table[ch->off1 >> 16];
-	  ch->off2 += ch->inc2;
-	  ch->off2 &= (ST_SIZ << 16) - 1;
-	  tot2 += ch->amp2 * sin_table[ch->off2 >> 16];
+	  if (osc_kernel == SBAGEN_KERNEL_ROTATE) {
+	     rotChunk(tot, n, ch);
+	     off1= ((unsigned)off1 + (unsigned)inc1 * n) & ((ST_SIZ << 16) - 1);
+	     off2= ((unsigned)off2 + (unsigned)inc2 * n) & ((ST_SIZ << 16) - 1);
+	     break;
+	  }
+	  for (i= 0; i<n; i++, tot += 2) {
+	     off1 += inc1;
+	     off1 &= (ST_SIZ << 16) - 1;
+	     tot[0] += amp * tab[off1 >> 16];
+	     off2 += inc2;
+	     off2 &= (ST_SIZ << 16) - 1;
+	     tot[1] += amp2 * tab[off2 >> 16];
+	  }
 	  break;
        case 2:	// Pink noise
-	  val= ns * ch->amp;
-	  tot1 += val;
-	  tot2 += val;
+	  for (i= 0; i<n; i++, tot += 2) {
+	     val= ns[i] * amp;
+	     tot[0] += val;
+	     tot[1] += val;
+	  }
 	  break;
        case 3:	// Bell
-	  if (ch->off2) {
-	     ch->off1 += ch->inc1;
-	     ch->off1 &= (ST_SIZ << 16) - 1;
-	     val= ch->off2 * sin_table[ch->off1 >> 16];
-	     tot1 += val; tot2 += val;
-	     if (--ch->inc2 < 0) {
-		ch->inc2= out_rate/20;
-		ch->off2 -= 1 + ch->off2 / 12;	// Knock off 10% each 50 ms
+	  for (i= 0; i<n && off2; i++, tot += 2) {
+	     off1 += inc1;
+	     off1 &= (ST_SIZ << 16) - 1;
+	     val= off2 * tab[off1 >> 16];
+	     tot[0] += val; tot[1] += val;
+	     if (--inc2 < 0) {
+		inc2= out_rate/20;
+		off2 -= 1 + off2 / 12;	// Knock off 10% each 50 ms
 	     }
 	  }
 	  break;
        case 4:	// Spinning pink noise
-	  ch->off1 += ch->inc1;
-	  ch->off1 &= (ST_SIZ << 16) - 1;
-	  val= (ch->inc2 * sin_table[ch->off1 >> 16]) >> 24;
-	  tot1 += ch->amp * noise_buf[(uchar)(noise_off+128+val)];
-	  tot2 += ch->amp * noise_buf[(uchar)(noise_off+128-val)];
+	  for (i= 0; i<n; i++, tot += 2) {
+	     off1 += inc1;
+	     off1 &= (ST_SIZ << 16) - 1;
+	     val= (inc2 * tab[off1 >> 16]) >> 24;
+	     tot[0] += amp * ns[i - 127 + val];
+	     tot[1] += amp * ns[i - 127 - val];
+	  }
 	  break;
        case 5:	// Mix level
-	  tot1 += mix1 * ch->amp;
-	  tot2 += mix2 * ch->amp;
+	  if (mix_data && amp)
+	     mixInput(tot_buf, n, amp);
 	  break;
        default:	// Waveform-based binaural tones
 	  tab= waves[-1 - ch->typ];
-	  ch->off1 += ch->inc1;
-	  ch->off1 &= (ST_SIZ << 16) - 1;
-	  tot1 += ch->amp * tab[ch->off1 >> 16];
-	  ch->off2 += ch->inc2;
-	  ch->off2 &= (ST_SIZ << 16) - 1;
-	  tot2 += ch->amp * tab[ch->off2 >> 16];
+	  for (i= 0; i<n; i++, tot += 2) {
+	     off1 += inc1;
+	     off1 &= (ST_SIZ << 16) - 1;
+	     tot[0] += amp * tab[off1 >> 16];
+	     off2 += inc2;
+	     off2 &= (ST_SIZ << 16) - 1;
+	     tot[1] += amp * tab[off2 >> 16];
+	  }
 	  break;
       }
-
-
-      // // Add pink noise as dithering
-      // tot1 += (ns >> NS_DITHER) + 0x8000;
-      // tot2 += (ns >> NS_DITHER) + 0x8000;
-      
-      // // Add white noise as dithering
-      // tot1 += (seed >> 1) + 0x8000;
-      // tot2 += (seed >> 1) + 0x8000;
-
-      // White noise dither; you could also try (rand0-rand1) for a
-      // dither with more high frequencies
-      rand0= rand1; 
-      rand1= (rand0 * 0x660D + 0xF35F) & 0xFFFF;
-      if (tot1 <= 0x7FFF0000) tot1 += rand0;
-      if (tot2 <= 0x7FFF0000) tot2 += rand0;
-
-      out_buf[off++]= tot1 >> 16;
-      out_buf[off++]= tot2 >> 16;
-  }
-
-  // Check and update the byte count if necessary
-  if (byte_count > 0) {
-    if (byte_count <= out_bsiz) {
-      if(writeOut((char*)out_buf, byte_count) < 0)
-	return -1;
-      return 0;		// All done
-    }
-    else {
-      if(writeOut((char*)out_buf, out_bsiz) < 0)
-	return -1;
-      byte_count -= out_bsiz;
-    }
-  }
-  else {
-    if(writeOut((char*)out_buf, out_bsiz) < 0)
-      return -1;
-  }
-  return 1;
-} 
+      ch->off1= off1; ch->off2= off2;
+      ch->inc2= inc2;
+   }
+}
 
 //
-//	Calculate amplitude adjustment factor for frequency 'freq'
+//	If none of the channels in chan[] makes a sound over the next n
+//	frames, move them on as mixChunk() would and return 1: the
+//	dither then rounds every frame to zero, so the caller can write
+//	silence without mixing anything
 //
 
-static double 
-ampAdjust(double freq) {
-   int a;
-   struct AmpAdj *p0, *p1;
-
-   if (!opt_c) return 1.0;
-   if (freq <= ampadj[0].freq) return ampadj[0].adj;
-   if (freq >= ampadj[opt_c-1].freq) return ampadj[opt_c-1].adj;
+static int
+quietChunk(Channel *chan, int n) {
+   const unsigned mask= (ST_SIZ << 16) - 1;
+   Channel *ch, *end= chan + n_ch;
 
-   for (a= 1; a<opt_c; a++) 
-      if (freq < ampadj[a].freq) 
-	 break;
-   
-   p0= &ampadj[a-1];
+   if (!mix_flag && mix_data)
+      return 0;
+   for (ch= chan; ch < end; ch++) {
+      switch (ch->typ) {
+       case 0:
+	  break;
+       case 1:
+	  if (ch->amp || ch->amp2) return 0;
+	  break;
+       case 3:
+	  if (ch->off2) return 0;
+	  break;
+       case 5:
+	  if (mix_data && ch->amp) return 0;
+	  break;
+       default:
+	  if (ch->amp) return 0;
+	  break;
+      }
+   }
+
+   // The phases wrap modulo the table size, so n steps are one
+   for (ch= chan; ch < end; ch++) {
+      switch (ch->typ) {
+       case 0:
+       case 2:
+       case 3:
+       case 5:
+	  break;
+       case 4:
+	  ch->off1= ((unsigned)ch->off1 + (unsigned)ch->inc1 * n) & mask;
+	  break;
+       default:
+	  ch->off1= ((unsigned)ch->off1 + (unsigned)ch->inc1 * n) & mask;
+	  ch->off2= ((unsigned)ch->off2 + (unsigned)ch->inc2 * n) & mask;
+	  ch->rot_left= 0;	// Phasors left behind
+	  break;
+      }
+   }
+   return 1;
+}
+
+//
+//	Add n frames of the mix input at amp (4096 for 100%) to tot[],
+//	straight from the mapped file, interpolating between its frames
+//	if its rate differs
+//
+
+static void
+mixInput(int *tot, int n, int amp) {
+   uint64_t pos= mix_cur;
+   S64 f= pos >> 32;
+   const short *s;
+   int i, l, r, fr;
+
+   if (f >= mix_frames)
+      return;
+   if (mix_step == 1ULL << 32) {
+      if (n > mix_frames - f)
+	 n= mix_frames - f;
+      s= mix_data + f * mix_chans;
+      if (mix_chans == 2) {
+	 for (i= 0; i<2*n; i++)
+	    tot[i] += (s[i] << 4) * amp;
+      } else {
+	 for (i= 0; i<n; i++, tot += 2) {
+	    l= (s[i] << 4) * amp;
+	    tot[0] += l;
+	    tot[1] += l;
+	 }
+      }
+      return;
+   }
+   for (i= 0; i<n; i++, tot += 2, pos += mix_step) {
+      if ((f= pos >> 32) + 1 >= mix_frames)
+	 break;
+      s= mix_data + f * mix_chans;
+      fr= (pos >> 17) & 0x7FFF;
+      l= s[0] + (((s[mix_chans] - s[0]) * fr) >> 15);
+      r= mix_chans == 2 ? s[1] + (((s[3] - s[1]) * fr) >> 15) : l;
+      tot[0] += (l << 4) * amp;
+      tot[1] += (r << 4) * amp;
+   }
+}
+
+//
+//	Move the mix input on by n frames of output, shared by all the
+//	listeners
+//
+
+static void
+mixSource(int n) {
+   mix_cur= mix_pos;
+   mix_pos += n * mix_step;
+}
+
+//
+//	Between two blocks, out of the render loop: ask for the next two
+//	seconds of the mix input to be read ahead once less than one is
+//	left, and touch the pages the next n frames of output read, so
+//	that mixInput() neither waits on the storage nor faults
+//
+
+static void
+mixFetch(int n) {
+   S64 f= mix_pos >> 32, e= ((mix_pos + n * mix_step) >> 32) + 2, a;
+   char *p, *q;
+
+   if (f >= mix_frames)
+      return;
+   p= (char*)(mix_data + f * mix_chans);
+   p -= (p - (char*)mix_map) % mix_page;
+   if (f + mix_sec >= mix_ahead && mix_ahead < mix_frames) {
+      a= f + 2 * mix_sec;
+      if (a > mix_frames) a= mix_frames;
+      madvise(p, (char*)(mix_data + a * mix_chans) - p, MADV_WILLNEED);
+      mix_ahead= a;
+   }
+   if (e > mix_frames) e= mix_frames;
+   for (q= (char*)(mix_data + e * mix_chans); p < q; p += mix_page)
+      (void)*(volatile char*)p;
+}
+
+//
+//	Dither tot_buf[] down to 16 bits into out_buf
+//
+
+static void
+ditherChunk(short *out_buf, int n, int *rnd0, int *rnd1) {
+   int rand0= *rnd0, rand1= *rnd1;
+   int i;
+
+   for (i= 0; i<2*n; i += 2) {
+      int tot1= tot_buf[i], tot2= tot_buf[i+1];
+
+      // // Add pink noise as dithering
+      // tot1 += (ns >> NS_DITHER) + 0x8000;
+      // tot2 += (ns >> NS_DITHER) + 0x8000;
+      
+      // // Add white noise as dithering
+      // tot1 += (seed >> 1) + 0x8000;
+      // tot2 += (seed >> 1) + 0x8000;
+
+      // White noise dither; you could also try (rand0-rand1) for a
+      // dither with more high frequencies
+      rand0= rand1; 
+      rand1= (rand0 * 0x660D + 0xF35F) & 0xFFFF;
+      if (tot1 <= 0x7FFF0000) tot1 += rand0;
+      if (tot2 <= 0x7FFF0000) tot2 += rand0;
+
+      out_buf[i]= tot1 >> 16;
+      out_buf[i+1]= tot2 >> 16;
+   }
+   *rnd0= rand0;
+   *rnd1= rand1;
+}
+
+//
+//	The same for the other formats, into the block at buf of len
+//	frames, from frame off: planar blocks hold their left samples,
+//	then their right ones.  Each is one pass over tot_buf[] with the
+//	layout fixed, for the compiler to unroll or vectorize
+//
+
+static void
+ditherPlanar(short *lp, short *rp, int n, int *rnd0, int *rnd1) {
+   int rand0= *rnd0, rand1= *rnd1;
+   int i;
+
+   for (i= 0; i<n; i++) {
+      int tot1= tot_buf[2*i], tot2= tot_buf[2*i+1];
+
+      rand0= rand1;
+      rand1= (rand0 * 0x660D + 0xF35F) & 0xFFFF;
+      if (tot1 <= 0x7FFF0000) tot1 += rand0;
+      if (tot2 <= 0x7FFF0000) tot2 += rand0;
+      lp[i]= tot1 >> 16;
+      rp[i]= tot2 >> 16;
+   }
+   *rnd0= rand0;
+   *rnd1= rand1;
+}
+
+static void
+dither24(uchar *lp, uchar *rp, int st, int n, int *rnd0, int *rnd1) {
+   int rand0= *rnd0, rand1= *rnd1;
+   int i;
+
+   for (i= 0; i<n; i++, lp += st, rp += st) {
+      int tot1= tot_buf[2*i], tot2= tot_buf[2*i+1];
+
+      // Same dither, a 256th of it at this depth
+      rand0= rand1;
+      rand1= (rand0 * 0x660D + 0xF35F) & 0xFFFF;
+      if (tot1 <= 0x7FFFFF00) tot1 += rand0 >> 8;
+      if (tot2 <= 0x7FFFFF00) tot2 += rand0 >> 8;
+      lp[0]= tot1 >> 8; lp[1]= tot1 >> 16; lp[2]= tot1 >> 24;
+      rp[0]= tot2 >> 8; rp[1]= tot2 >> 16; rp[2]= tot2 >> 24;
+   }
+   *rnd0= rand0;
+   *rnd1= rand1;
+}
+
+static void
+floatChunk(float *lp, float *rp, int st, int n) {
+   const float k= 1.0f / 2147483648.0f;	// Full scale of 16 bits after >> 16
+   int i;
+
+   for (i= 0; i<n; i++) {
+      lp[i*st]= tot_buf[2*i] * k;
+      rp[i*st]= tot_buf[2*i+1] * k;
+   }
+}
+
+static void
+outConvert(char *buf, int off, int len, int n, int *rnd0, int *rnd1) {
+   int planar= out_fmt & SBAGEN_FMT_PLANAR;
+   int l= planar ? off : 2 * off;		// First left sample
+   int r= planar ? len + off : 2 * off + 1;	// First right sample
+   int st= planar ? 1 : 2;			// Samples between frames
+
+   switch (out_fmt & ~SBAGEN_FMT_PLANAR) {
+    case SBAGEN_FMT_S16:
+      if (planar)
+	 ditherPlanar((short*)buf + l, (short*)buf + r, n, rnd0, rnd1);
+      else
+	 ditherChunk((short*)buf + l, n, rnd0, rnd1);
+      break;
+    case SBAGEN_FMT_S24:
+      dither24((uchar*)buf + 3*l, (uchar*)buf + 3*r, 3*st, n, rnd0, rnd1);
+      break;
+    case SBAGEN_FMT_F32:
+      floatChunk((float*)buf + l, (float*)buf + r, st, n);
+      break;
+   }
+}
+
+//
+//	Write n frames of silence in the same layout
+//
+
+static void
+outSilence(char *buf, int off, int len, int n) {
+   int bps= out_bps / 2;	// Bytes per sample
+
+   if (out_fmt & SBAGEN_FMT_PLANAR) {
+      memset(buf + off * bps, 0, n * bps);
+      memset(buf + (len + off) * bps, 0, n * bps);
+   } else
+      memset(buf + off * out_bps, 0, n * out_bps);
+}
+
+//
+//	Move the dither generator on by n frames as ditherChunk() would,
+//	in log(n) steps: n applications of x*0x660D+0xF35F are one affine
+//	map too, built up by squaring
+//
+
+static void
+ditherSkip(int n, int *rnd0, int *rnd1) {
+   unsigned a= 1, c= 0;		// Map for the first n-1 frames
+   unsigned ma= 0x660D, mc= 0xF35F;
+   int k;
+
+   if (n <= 0)
+      return;
+   for (k= n - 1; k; k >>= 1) {
+      if (k & 1) {
+	 a= (a * ma) & 0xFFFF;
+	 c= (c * ma + mc) & 0xFFFF;
+      }
+      mc= (mc * ma + mc) & 0xFFFF;
+      ma= (ma * ma) & 0xFFFF;
+   }
+   *rnd0= (*rnd1 * a + c) & 0xFFFF;
+   *rnd1= (*rnd0 * 0x660D + 0xF35F) & 0xFFFF;
+}
+
+//
+//	Render and write one block, of nextBlockLen() samples; the
+//	parameters are updated every out_blen samples, whatever the
+//	block size, so the output does not depend on it
+//
+
+static int
+outChunk(int *ctl_left) {
+  int blk= nextBlockLen();
+  int bsiz= blk / 2 * out_bps;		// Octets in the block
+  int off, n, siz, r;
+
+  // Wait for the rest of a sequence still coming in rather than
+  // play past what is final of it
+  while (seq_more && byte_count < bsiz) {
+    RT_LEAVE();
+    if (!stream_wait) {
+      error("The sequence is not complete");
+      return -1;
+    }
+    if (stream_wait(stream_opaque) < 0)
+      return -1;
+    if (seq_reloaded && !reloadCount(*ctl_left))
+      return 0;
+    RT_ENTER();
+  }
+
+  // Only render what is left at the end, for planar blocks to be whole
+  if (byte_count > 0 && byte_count < bsiz) {
+    bsiz= byte_count;
+    blk= bsiz / out_bps * 2;
+  }
+
+  for (off= 0; off < blk; off += n) {
+    if (*ctl_left == 0) {
+      TRACE_BEGIN("corrVal");
+      corrVal(1);
+      TRACE_END("corrVal");
+      clockPeriod(byte_done / out_bps + off / 2);
+      *ctl_left= out_blen;
+    }
+    n= blk - off < *ctl_left ? blk - off : *ctl_left;
+    if (ns_used) noiseChunk(n / 2);
+    if (mix_data) mixSource(n / 2);
+    if (quietChunk(chan, n / 2)) {
+      outSilence(out_buf, off / 2, blk / 2, n / 2);
+      ditherSkip(n / 2, &rand0, &rand1);
+    } else {
+      mixChunk(chan, n / 2);
+      outConvert(out_buf, off / 2, blk / 2, n / 2, &rand0, &rand1);
+    }
+    if ((*ctl_left -= n) == 0)
+      nextChunkTime();
+  }
+  RT_LEAVE();
+
+  siz= bsiz;
+  clockRendered((byte_done + siz) / out_bps);
+  TRACE_BEGIN("writeOut");
+  out_pending= siz;
+  r= outWrite((char*)out_buf, siz);
+  out_pending= 0;
+  TRACE_END("writeOut");
+  if (r < 0)
+    return -1;
+  if (cache_fd >= 0)
+    cacheWrite((char*)out_buf, siz);
+  byte_done += siz;
+  if (mix_data) mixFetch(outBlockLen() / 2);
+  if (seq_reloaded)
+    return reloadCount(*ctl_left);
+
+  // Check and update the byte count if necessary
+  if (byte_count > 0) {
+    if (byte_count <= siz && !seq_more)
+      return 0;		// All done
+    byte_count -= siz;
+  }
+  return 1;
+} 
+
+//
+//	Move on to frames into the sequence, where a reload ended the
+//	replay of the cache: by whole control chunks from the start of the
+//	replay, as rendering it would have, with the bytes left counted
+//	as after a reload while running.  Rets: as reloadCount().
+//
+
+static int
+skipFrames(S64 frames) {
+  for (; frames >= out_blen / 2; frames -= out_blen / 2) {
+    byte_done += out_blen / 2 * out_bps;
+    nextChunkTime();
+  }
+  if (frames) {
+    byte_done += frames * out_bps;
+    ctl_left= out_blen - 2 * frames;
+  }
+  return reloadCount(ctl_left);
+}
+
+//
+//	Count the bytes left from the current position, ctl_left samples
+//	before the next update, to the end of a sequence reloaded while
+//	running: exactly from the bytes done if it still starts at the
+//	same time, as the output then has the same length as if it had
+//	been played from the start.  Rets: 0 if the end is already past
+//	(never while more of the sequence is to come), else 1.
+//
+
+static int
+reloadCount(int ctl_left) {
+  int len= t_per0(fast_tim0, fast_tim1);
+  int pos= now, done;
+
+  seq_reloaded= 0;
+  if (ctl_left)
+    pos= (pos + (int)((out_blen - ctl_left) / 2 * 1000.0 / out_rate)) % H24;
+  if (len == 0) {
+    byte_count= -1;		// Endless
+    return 1;
+  }
+  if (fast_tim0 == run_tim0) {
+    byte_count= out_bps * (S64)(len * 0.001 * out_rate) - byte_done;
+    return byte_count > 0 || seq_more;
+  }
+  if ((done= t_per0(fast_tim0, pos)) >= len) {
+    byte_count= 0;
+    return seq_more;
+  }
+  byte_count= out_bps * (S64)((len - done) * 0.001 * out_rate);
+  return 1;
+}
+
+//
+//	Calculate amplitude adjustment factor for frequency 'freq'
+//
+
+static double 
+ampAdjust(struct AmpAdj *ampadj, int opt_c, double freq) {
+   int a;
+   struct AmpAdj *p0, *p1;
+
+   if (!opt_c) return 1.0;
+   if (freq <= ampadj[0].freq) return ampadj[0].adj;
+   if (freq >= ampadj[opt_c-1].freq) return ampadj[opt_c-1].adj;
+
+   for (a= 1; a<opt_c; a++) 
+      if (freq < ampadj[a].freq) 
+	 break;
+   
+   p0= &ampadj[a-1];
    p1= &ampadj[a];
       
    return p0->adj + (p1->adj - p0->adj) * (freq - p0->freq) / (p1->freq - p0->freq);
@@ -626,41 +2035,132 @@ ampAdjust(double freq) {
 
 static void 
 corrVal(int running) {
+   corrTime(running);
+   corrChan(chan, &chan_per, 1.0, opt_c, ampadj);
+}
+
+//
+//	Move to the current period and calculate the voice settings for
+//	the current time into play.v[], shared by all listeners
+//
+
+static void
+corrTime(int running) {
+   cursorMove(&play, now);
+   if (play.trigger && running && tty_erase) {
+      fprintf(stderr, "%*s\r", tty_erase, ""); 
+      tty_erase= 0;
+   }
+}
+
+//
+//	Move cursor cu to time t and calculate the voice settings there
+//	into cu->v[]; only cu is written
+//
+
+static void
+cursorMove(Cursor *cu, int t) {
+   Period *pp= cu->per;
    int a;
-   int t0= per->tim;
-   int t1= per->nxt->tim;
-   Channel *ch;
-   Voice *v0, *v1, *vv;
-   double rat0, rat1;
-   int trigger= 0;
+
+   cu->trigger= 0;
    
    // Move to the correct period
-   while ((now >= t0) ^ (now >= t1) ^ (t1 > t0)) {
-      per= per->nxt;
-      t0= per->tim;
-      t1= per->nxt->tim;
-      if (running) {
-	 if (tty_erase) {
-	    fprintf(stderr, "%*s\r", tty_erase, ""); 
-	    tty_erase= 0;
+   if ((pp= seekPeriod(pp, t)) != cu->per) {
+      cu->per= pp;
+      cu->trigger= 1;		// Trigger bells or whatever
+   }
+   
+   // Start from the initial values on entering a period, then only
+   // follow the channels that vary along their slopes
+   if (pp != cu->cur_per) {
+      cu->cur_per= pp;
+      memcpy(cu->v, pp->v0, cu->n_ch * sizeof(Voice));
+      for (a= 0; a<cu->n_ch; a++)
+	 if (cu->v[a].typ == 4) spinClip(&cu->v[a], cu->clip);
+   }
+   if (pp->dv) {
+      int dt= t_per0(pp->tim, t);
+      for (a= 0; a<cu->n_ch; a++)
+	 if (pp->dv[a].typ) slideVoice(&cu->v[a], pp, a, dt, cu->clip);
+   }
+}
+
+//
+//	Find the period that time t falls in, starting from pp
+//
+
+static Period *
+seekPeriod(Period *pp, int t) {
+   int t0= pp->tim;
+   int t1= pp->nxt->tim;
+
+   while ((t >= t0) ^ (t >= t1) ^ (t1 > t0)) {
+      pp= pp->nxt;
+      t0= pp->tim;
+      t1= pp->nxt->tim;
+   }
+   return pp;
+}
+
+//
+//	Set *vv to channel a of period pp, dt ms into the period, for a
+//	channel that varies over it
+//
+
+static void
+slideVoice(Voice *vv, Period *pp, int a, int dt, double clip) {
+   Voice *v0= &pp->v0[a];
+   Voice *dv= &pp->dv[a];
+
+   vv->amp= v0->amp + dt * dv->amp;
+   vv->carr= v0->carr + dt * dv->carr;
+   vv->res= v0->res + dt * dv->res;
+   if (vv->typ == 4) spinClip(vv, clip);
+}
+
+static void
+spinClip(Voice *vv, double clip) {
+   if (vv->carr > clip) vv->carr= clip; // Clipping sweep width
+   if (vv->carr < -clip) vv->carr= -clip;
+}
+
+//
+//	Update the channel states in chan[] from play.v[], with the
+//	given volume and -c option points.  *perp is the period chan[]
+//	was last set up for: within the same period only the channels
+//	that vary are updated, unless the -c limiting couples them.
+//
+
+static void
+corrChan(Channel *chan, Period **perp, double gain, int opt_c, struct AmpAdj *ampadj) {
+   int a;
+   Channel *ch;
+   Voice *vv;
+   int trigger= play.trigger;
+
+   if (*perp == play.per) {
+      if (!play.per->dv) return;	// Steady period: nothing changes
+      if (!opt_c) {
+	 for (a= 0; a<n_ch; a++) {
+	    if (!play.per->dv[a].typ) continue;
+	    ch= &chan[a];
+	    ch->v= play.v[a];
+	    setupChan(ch, gain, opt_c, ampadj, trigger);
 	 }
+	 return;
       }
-      trigger= 1;		// Trigger bells or whatever
    }
-   
-   // Run through to calculate voice settings for current time
-   rat1= t_per0(t0, now) / (double)t_per24(t0, t1);
-   rat0= 1 - rat1;
-   for (a= 0; a<N_CH; a++) {
+   *perp= play.per;
+
+   for (a= 0; a<n_ch; a++) {
       ch= &chan[a];
-      v0= &per->v0[a];
-      v1= &per->v1[a];
       vv= &ch->v;
       
-      if (vv->typ != v0->typ) {
-	 switch (vv->typ= ch->typ= v0->typ) {
+      if (vv->typ != play.v[a].typ) {
+	 switch (ch->typ= play.v[a].typ) {
 	  case 1:
-	     ch->off1= ch->off2= 0; break;
+	     ch->off1= ch->off2= 0; ch->rot_left= 0; break;
 	  case 2:
 	     break;
 	  case 3:
@@ -673,47 +2173,17 @@ corrVal(int running) {
 	     ch->off1= ch->off2= 0; break;
 	 }
       }
-      
-      // Setup vv->*
-      switch (vv->typ) {
-       case 1:
-	  vv->amp= rat0 * v0->amp + rat1 * v1->amp;
-	  vv->carr= rat0 * v0->carr + rat1 * v1->carr;
-	  vv->res= rat0 * v0->res + rat1 * v1->res;
-	  break;
-       case 2:
-	  vv->amp= rat0 * v0->amp + rat1 * v1->amp;
-	  break;
-       case 3:
-	  vv->amp= v0->amp;		// No need to slide, as bell only rings briefly
-	  vv->carr= v0->carr;
-	  break;
-       case 4:
-	  vv->amp= rat0 * v0->amp + rat1 * v1->amp;
-	  vv->carr= rat0 * v0->carr + rat1 * v1->carr;
-	  vv->res= rat0 * v0->res + rat1 * v1->res;
-	  if (vv->carr > spin_carr_max) vv->carr= spin_carr_max; // Clipping sweep width
-	  if (vv->carr < -spin_carr_max) vv->carr= -spin_carr_max;
-	  break;
-       case 5:
-	  vv->amp= rat0 * v0->amp + rat1 * v1->amp;
-	  break;
-       default:		// Waveform based binaural
-	  vv->amp= rat0 * v0->amp + rat1 * v1->amp;
-	  vv->carr= rat0 * v0->carr + rat1 * v1->carr;
-	  vv->res= rat0 * v0->res + rat1 * v1->res;
-	  break;
-      }
+      *vv= play.v[a];
    }
    
    // Check and limit amplitudes if -c option in use
    if (opt_c) {
       double tot_beat= 0, tot_other= 0;
-      for (a= 0; a<N_CH; a++) {
+      for (a= 0; a<n_ch; a++) {
 	 vv= &chan[a].v;
 	 if (vv->typ == 1) {
-	    double adj1= ampAdjust(vv->carr + vv->res/2);
-	    double adj2= ampAdjust(vv->carr - vv->res/2);
+	    double adj1= ampAdjust(ampadj, opt_c, vv->carr + vv->res/2);
+	    double adj2= ampAdjust(ampadj, opt_c, vv->carr - vv->res/2);
 	    if (adj2 > adj1) adj1= adj2;
 	    tot_beat += vv->amp * adj1;
 	 } else if (vv->typ) {
@@ -723,7 +2193,7 @@ corrVal(int running) {
       if (tot_beat + tot_other > 4096) {
 	 double adj_beat= (tot_beat > 4096) ? 4096 / tot_beat : 1.0;
 	 double adj_other= (4096 - tot_beat * adj_beat) / tot_other;
-	 for (a= 0; a<N_CH; a++) {
+	 for (a= 0; a<n_ch; a++) {
 	    vv= &chan[a].v;
 	    if (vv->typ == 1)
 	       vv->amp *= adj_beat;
@@ -733,86 +2203,117 @@ corrVal(int running) {
       }
    }
    
-   // Setup Channel data from Voice data
-   for (a= 0; a<N_CH; a++) {
-      ch= &chan[a];
-      vv= &ch->v;
+   for (a= 0; a<n_ch; a++)
+      setupChan(&chan[a], gain, opt_c, ampadj, trigger);
+}
+
+//
+//	Setup Channel data from its Voice data
+//
+
+static void
+setupChan(Channel *ch, double gain, int opt_c, struct AmpAdj *ampadj, int trigger) {
+   Voice *vv= &ch->v;
+
+   if (gain != 1.0) vv->amp *= gain;
       
-      // Setup ch->* from vv->*
-      switch (vv->typ) {
-	 double freq1, freq2;
-       case 1:
-	  freq1= vv->carr + vv->res/2;
-	  freq2= vv->carr - vv->res/2;
-	  if (opt_c) {
-	     ch->amp= vv->amp * ampAdjust(freq1);
-	     ch->amp2= vv->amp * ampAdjust(freq2);
-	  } else 
-	     ch->amp= ch->amp2= (int)vv->amp;
-	  ch->inc1= (int)(freq1 / out_rate * ST_SIZ * 65536);
-	  ch->inc2= (int)(freq2 / out_rate * ST_SIZ * 65536);
-	  break;
-       case 2:
-	  ch->amp= (int)vv->amp;
-	  break;
-       case 3:
-	  ch->amp= (int)vv->amp;
-	  ch->inc1= (int)(vv->carr / out_rate * ST_SIZ * 65536);
-	  if (trigger) {		// Trigger the bell only on entering the period
-	     ch->off2= ch->amp;
-	     ch->inc2= out_rate/20;
-	  }
-	  break;
-       case 4:
-	  ch->amp= (int)vv->amp;
-	  ch->inc1= (int)(vv->res / out_rate * ST_SIZ * 65536);
-	  ch->inc2= (int)(vv->carr * 1E-6 * out_rate * (1<<24) / ST_AMP);
-	  break;
-       case 5:
-	  ch->amp= (int)vv->amp;
-	  break;
-       default:		// Waveform based binaural
-	  ch->amp= (int)vv->amp;
-	  ch->inc1= (int)((vv->carr + vv->res/2) / out_rate * ST_SIZ * 65536);
-	  ch->inc2= (int)((vv->carr - vv->res/2) / out_rate * ST_SIZ * 65536);
-	  if (ch->inc1 > ch->inc2) 
-	     ch->inc2= -ch->inc2;
-	  else 
-	     ch->inc1= -ch->inc1;
-	  break;
-      }
+   // Setup ch->* from vv->*
+   switch (vv->typ) {
+      double freq1, freq2;
+    case 1:
+       freq1= vv->carr + vv->res/2;
+       freq2= vv->carr - vv->res/2;
+       if (opt_c) {
+	  ch->amp= vv->amp * ampAdjust(ampadj, opt_c, freq1);
+	  ch->amp2= vv->amp * ampAdjust(ampadj, opt_c, freq2);
+       } else 
+	  ch->amp= ch->amp2= (int)vv->amp;
+       ch->inc1= (int)(freq1 / out_rate * ST_SIZ * 65536);
+       ch->inc2= (int)(freq2 / out_rate * ST_SIZ * 65536);
+       if (osc_kernel == SBAGEN_KERNEL_ROTATE) {
+	  rotSetup(ch->inc1, &ch->rc1, &ch->rs1);
+	  rotSetup(ch->inc2, &ch->rc2, &ch->rs2);
+       }
+       break;
+    case 2:
+       ch->amp= (int)vv->amp;
+       break;
+    case 3:
+       ch->amp= (int)vv->amp;
+       ch->inc1= (int)(vv->carr / out_rate * ST_SIZ * 65536);
+       if (trigger) {		// Trigger the bell only on entering the period
+	  ch->off2= ch->amp;
+	  ch->inc2= out_rate/20;
+       }
+       break;
+    case 4:
+       ch->amp= (int)vv->amp;
+       ch->inc1= (int)(vv->res / out_rate * ST_SIZ * 65536);
+       ch->inc2= (int)(vv->carr * 1E-6 * out_rate * (1<<24) / ST_AMP);
+       break;
+    case 5:
+       ch->amp= (int)vv->amp;
+       break;
+    default:		// Waveform based binaural
+       ch->amp= (int)vv->amp;
+       ch->inc1= (int)((vv->carr + vv->res/2) / out_rate * ST_SIZ * 65536);
+       ch->inc2= (int)((vv->carr - vv->res/2) / out_rate * ST_SIZ * 65536);
+       if (ch->inc1 > ch->inc2) 
+	  ch->inc2= -ch->inc2;
+       else 
+	  ch->inc1= -ch->inc1;
+       break;
    }
-}       
+}
       
 //
 //	Setup audio device
 //
 
 static int
-setup_device(void) {
+setup_device(int format) {
 
   // Handle output to files and pipes
   out_fd= 1;		// stdout
-  out_blen= out_rate * 2 / out_prate;		// 10 fragments a second by default
-  while (out_blen & (out_blen-1)) out_blen &= out_blen-1;		// Make power of two
-  out_bsiz= out_blen * 2;
-  out_bps= 4;
-  out_buf= (short*)Alloc(out_blen * sizeof(short));
-  if(out_buf == NULL)
-      return -1;
+  out_blen= ctlBlockLen();
+  out_fmt= format;
+  out_bps= fmtBytes(format);
+  out_bsiz= out_blen / 2 * out_bps;
+  out_buf= (char*)Alloc((outBlockLen() > out_blen ? outBlockLen() : out_blen) /
+			2 * out_bps);
   out_buf_lo= (int)(0x10000 * 1000.0 * 0.5 * out_blen / out_rate);
   out_buf_ms= out_buf_lo >> 16;
   out_buf_lo &= 0xFFFF;
-  tmp_buf= (int*)Alloc(out_blen * sizeof(int));
-  if(tmp_buf == NULL)
+  tot_buf= (int*)Alloc(out_blen * sizeof(int));
+  ns_hist= (int*)Alloc((NS_HIST + out_blen / 2) * sizeof(int));
+  ns_last= 0;
+  chan= (Channel*)Alloc(n_ch * sizeof(Channel));
+  play.v= (Voice*)Alloc(n_ch * sizeof(Voice));
+  play.n_ch= chan_max= n_ch;
+  play.per= per;
+  play.cur_per= chan_per= 0;
+  blockReset();
+  if(out_buf == NULL || tot_buf == NULL || ns_hist == NULL ||
+     ((chan == NULL || play.v == NULL) && n_ch)) {
+      free_device();
       return -1;
+  }
   return 0;
 }
 
+static void
+free_device(void) {
+  free(out_buf); out_buf= 0;
+  free(tot_buf); tot_buf= 0;
+  free(ns_hist); ns_hist= 0;
+  free(chan); chan= 0;
+  free(play.v); play.v= 0;
+}
+
 //
 //	Read a line, discarding blank lines and comments.  Rets:
-//	Another line?  Comments starting with '##' are displayed on
-//	stderr.
+//	Another line?  -1 on error.  Comments starting with '##' are
+//	displayed on stderr.
 //   
 
 static int 
@@ -831,9 +2332,12 @@ readLine() {
 	 llin = sizeof(buf) - 1;
       memcpy(buf, in_text, llin);
       buf[llin] = 0;
+      line_start = in_text;
       in_text += llin;
       
       in_lin++;
+      if (parseWork(1) < 0)
+	 return -1;
       
       while (isspace(*lin)) lin++;
       p= strchr(lin, '#');
@@ -876,20 +2380,103 @@ badSeq(void) {
 }
 
 //
-//	Read a list of sequence files, and generate a list of Period
-//	structures
+//	Check whether line p fits the form of <name>:<white-space>; if
+//	so, return what follows the colon
+//
+
+static char *
+nameDefRest(char *p) {
+   if (!isalpha(*p)) 
+      return 0;
+   while (isalnum(*p) || *p == '_' || *p == '-') p++;
+   if (*p++ != ':' || !isspace(*p)) 
+      return 0;
+   return p;
+}
+
+//
+//	Waveform number defined by line p, or -1
+//
+
+static int
+stmtWave(char *p) {
+   if (0 == memcmp(p, "wave", 4) && isdigit(p[4]) && isdigit(p[5]) &&
+       p[6] == ':')
+      return (p[4] - '0') * 10 + (p[5] - '0');
+   return -1;
+}
+
+static uint64_t
+stmtHash(const char *p, const char *end, int kind) {
+   return fnv1a(p, end - p, FNV_INIT ^ kind);
+}
+
+//
+//	Append a zeroed statement to *sl
+//
+
+static Stmt *
+addStmt(StmtList *sl) {
+   if (sl->n == sl->alloc) {
+      int na= sl->alloc ? 2 * sl->alloc : 256;
+      Stmt *st= (Stmt*)realloc(sl->st, na * sizeof(Stmt));
+      if (!st) {
+	 error("Out of memory");
+	 return 0;
+      }
+      sl->st= st;
+      sl->alloc= na;
+   }
+   memset(&sl->st[sl->n], 0, sizeof(Stmt));
+   return &sl->st[sl->n++];
+}
+
+//
+//	Forget the names and statements of the last text parsed
+//
+
+static void
+dropStmts(void) {
+   while (nlist)
+      nlist= free_namedef(nlist);
+   aFree(&parse_arena);
+   free(stmts.st);
+   memset(&stmts, 0, sizeof(stmts));
+   stmts_whole= 0;
+   stmts_stale= 0;
+}
+
+//
+//	Check an option line, only permitted at the start
+//
+
+static int
+readOption(char *p, int start) {
+   if (!start) {
+      error("Options are only permitted at start of sequence file:\n  %s", p);
+      return -1;
+   }
+   return handleOptions(p);
+}
+
+//
+//	Read a sequence file into stmts; buildPeriods() then generates
+//	the list of Period structures
 //
 
 static int
 readSeq(const char *text) {
    // Setup a 'now' value to use for NOW in the sequence file
    int start= 1;
+   int r;
+   Stmt *st;
    now= 0;
    
    in_text = text;
    in_lin= 0;
    
-   while (readLine()) {
+   while ((r= readLine()) > 0) {
+      const char *s0= line_start;
       char *p= lin;
 
       // Blank lines
@@ -897,992 +2484,5491 @@ readSeq(const char *text) {
       
       // Look for options
       if (*p == '-') {
-	 if (!start) {
-	    error("Options are only permitted at start of sequence file:\n  %s", p);
+	 if (readOption(p, start) < 0)
 	    return -1;
-	 }
-	 if(handleOptions(p) < 0)
-	     return -1;
 	 continue;
       }
 
-      // Check to see if it fits the form of <name>:<white-space>
       start= 0;
-      if (!isalpha(*p)) 
-	 p= 0;
-      else {
-	 while (isalnum(*p) || *p == '_' || *p == '-') p++;
-	 if (*p++ != ':' || !isspace(*p)) 
-	    p= 0;
-      }
-      
-      if (p) {
+      if (!(st= addStmt(&stmts)))
+	 return -1;
+      if (nameDefRest(p)) {
+	 st->wave= stmtWave(p);
+	 st->kind= st->wave < 0 ? STMT_NAME : STMT_WAVE;
 	 if(readNameDef() < 0)
 	     return -1;
+	 if (st->kind == STMT_NAME)
+	    st->nd= nlist;
       } else {
-	 if(readTimeLine() < 0)
+	 st->kind= STMT_TIME;
+	 if(readTimeLine(st) < 0)
 	     return -1;
       }
+      st->hash= stmtHash(s0, in_text, st->kind);
    }
-   return 0;
+   return r;
 }
 
-
 //
-//	Fill in all the correct information for the Periods, assuming
-//	they have just been loaded using readTimeLine()
+//	End of the complete statements of a sequence still coming in:
+//	past the last line break outside of a block definition
 //
 
+static const char *
+streamCut(const char *text) {
+   const char *p, *q, *r, *cut= text;
+   int blk= 0;
+
+   for (p= text; (q= strchr(p, '\n')); p= q + 1) {
+      while (p < q && isspace(*p)) p++;
+      if (blk)
+	 blk= *p != '}';
+      else
+	 for (r= p; r < q && *r != '#'; r++)
+	    if (*r == '{') {
+	       blk= 1;
+	       break;
+	    }
+      if (!blk)
+	 cut= q + 1;
+   }
+   return cut;
+}
+
+//
+//	Time up to which the periods of a sequence still coming in are
+//	final: the start of the voice-set SPLICE_MARGIN from the last, as
+//	the time lines to come can change those after it the way an edit
+//	does in spliceSeq()
+//
 
 static int
-correctPeriods() {
-  // Get times all correct
-  {
-    Period *pp= per;
-    do {
-      if (pp->fi == -2) {
-	pp->tim= pp->nxt->tim;
-	pp->fi= -1;
+streamEnd(StmtList *sl) {
+   Stmt *st= sl->st + sl->n;
+   BlockDef *bd;
+   int k= 0, i;
+
+   while (st-- > sl->st) {
+      if (st->kind != STMT_TIME)
+	 continue;
+      if ((k += st->nt) >= SPLICE_MARGIN) {
+	 for (bd= st->tl, i= k - SPLICE_MARGIN; i > 0; i--)
+	    bd= bd->nxt;
+	 return bd->tim;
       }
+   }
+   return fast_tim0;
+}
 
-      pp= pp->nxt;
-    } while (pp != per);
-  }
+//
+//	Add the periods started by the time lines of sl, from statement
+//	i0 on, and get them ready for playing
+//
 
-  // Make sure that the transitional periods each have enough time
-  {
-    Period *pp= per;
-    do {
-      if (pp->fi == -1) {
-	int per= t_per0(pp->tim, pp->nxt->tim);
-	if (per < fade_int) {
-	  int adj= (fade_int - per) / 2, adj0, adj1;
-	  adj0= t_per0(pp->prv->tim, pp->tim);
-	  adj0= (adj < adj0) ? adj : adj0;
-	  adj1= t_per0(pp->nxt->tim, pp->nxt->nxt->tim);
-	  adj1= (adj < adj1) ? adj : adj1;
-	  pp->tim= (pp->tim - adj0 + H24) % H24;
-	  pp->nxt->tim= (pp->nxt->tim + adj1) % H24;
-	}
-      }
+static int
+buildPeriods(StmtList *sl, int i0) {
+   Stmt *st;
+   BlockDef *bd;
+   int r;
 
-      pp= pp->nxt;
-    } while (pp != per);
+   for (st= sl->st + i0; st < sl->st + sl->n; st++) {
+      if (st->kind != STMT_TIME)
+	 continue;
+      if (fast_tim0 < 0) fast_tim0= st->tim0;		// First time
+      fast_tim1= st->tim1;				// Last time
+      for (bd= st->tl; bd; bd= bd->nxt)
+	 if (addPeriod(bd) < 0)
+	    return -1;
+   }
+   if (!per) {
+      error("No time lines in the sequence");
+      return -1;
+   }
+   if (seq_more)
+      fast_tim1= streamEnd(sl);
+   r= widenPeriods();
+   if (r == 0) {
+      TRACE_BEGIN("correctPeriods");
+      r= correctPeriods();
+      TRACE_END("correctPeriods");
+   }
+   if (r == 0)
+      r= compilePeriods();
+   return r;
+}
+
+//
+//	Map from hashes to the statements of the loaded sequence not
+//	taken over yet, with the first one in text order returned first
+//
+
+typedef struct StmtMap StmtMap;
+struct StmtMap {
+  Stmt *st;			// Statements mapped
+  int n;
+  int next;			// Statement following the last one taken over
+  int mask;			// Size of hash[] and head[], minus one
+  uint64_t *hash;		// Hash of each slot
+  int *head;			// First statement with that hash, or -1 if free
+  int *same;			// Next statement with the same hash, or -1
+};
+
+static int
+smInit(StmtMap *m, StmtList *sl) {
+  int i, j;
+
+  m->st= sl->st;
+  m->n= sl->n;
+  m->next= 0;
+  for (m->mask= 15; m->mask < 2 * sl->n; m->mask= 2 * m->mask + 1) ;
+  m->hash= (uint64_t*)Alloc((m->mask + 1) * sizeof(uint64_t));
+  m->head= (int*)Alloc((m->mask + 1) * sizeof(int));
+  m->same= (int*)Alloc((sl->n + 1) * sizeof(int));
+  if (!m->hash || !m->head || !m->same)
+    return -1;
+  memset(m->head, -1, (m->mask + 1) * sizeof(int));
+  for (i= sl->n - 1; i >= 0; i--) {
+    for (j= sl->st[i].hash & m->mask;
+	 m->head[j] >= 0 && m->hash[j] != sl->st[i].hash;
+	 j= (j + 1) & m->mask) ;
+    m->hash[j]= sl->st[i].hash;
+    m->same[i]= m->head[j];
+    m->head[j]= i;
   }
+  return 0;
+}
 
-  // Fill in all the voice arrays, and sort out details of
-  // transitional periods
-  {
-    Period *pp= per;
-    do {
-      if (pp->fi < 0) {
-	int fo, fi;
-	int a;
-	int midpt= 0;
+static void
+smFree(StmtMap *m) {
+  free(m->hash);
+  free(m->head);
+  free(m->same);
+}
 
-	Period *qq= (Period*)Alloc(sizeof(*qq));
-	if(qq == NULL)
-	    return -1;
-	qq->prv= pp; qq->nxt= pp->nxt;
-	qq->prv->nxt= qq->nxt->prv= qq;
+//
+//	Take over a statement with hash h, or return 0.  The statement
+//	following the last one taken over is tried first, so that runs
+//	of identical lines are matched in order.
+//
 
-	qq->tim= t_mid(pp->tim, qq->nxt->tim);
+static Stmt *
+smClaim(StmtMap *m, uint64_t h) {
+  int i, j;
 
-	memcpy(pp->v0, pp->prv->v1, sizeof(pp->v0));
-	memcpy(qq->v1, qq->nxt->v0, sizeof(qq->v1));
+  if (!m->st)
+    return 0;
+  i= m->next;
+  if (i >= m->n || m->st[i].used || m->st[i].hash != h) {
+    for (j= h & m->mask; m->head[j] >= 0 && m->hash[j] != h; j= (j + 1) & m->mask) ;
+    while ((i= m->head[j]) >= 0 && m->st[i].used)
+      m->head[j]= m->same[i];
+    if (i < 0)
+      return 0;
+  }
+  m->st[i].used= 1;
+  m->next= i + 1;
+  return &m->st[i];
+}
 
-	// Special handling for bells
-	for (a= 0; a<N_CH; a++) {
-	  if (pp->v0[a].typ == 3 && pp->fi != -3)
-	    pp->v0[a].typ= 0;
+//
+//	Set of names, by hash; a collision only makes a name look
+//	changed when it is not
+//
 
-	  if (qq->v1[a].typ == 3 && pp->fi == -3)
-	    qq->v1[a].typ= 0;
-	}
-	      
-	fo= pp->prv->fo;
-	fi= qq->nxt->fi;
+typedef struct NameSet NameSet;
+struct NameSet {
+  uint64_t *h;			// Hashes, 0 for a free slot
+  int mask;
+};
 
-	// Special handling for -> slides:
-	//   always slide, and stretch slide if possible
-	if (pp->fi == -3) {
-	  fo= fi= 2;		// Force slides for ->
-	  for (a= 0; a<N_CH; a++) {
-	    Voice *vp= &pp->v0[a];
-	    Voice *vq= &qq->v1[a];
-	    if (vp->typ == 0 && vq->typ != 0 && vq->typ != 3) {
-	      memcpy(vp, vq, sizeof(*vp)); vp->amp= 0;
-	    }
-	    else if (vp->typ != 0 && vq->typ == 0) {
-	      memcpy(vq, vp, sizeof(*vq)); vq->amp= 0;
-	    }
-	  }
-	}
+static uint64_t
+nameHash(const char *name) {
+  uint64_t h= fnv1a(name, strlen(name), FNV_INIT);
+  return h ? h : 1;
+}
 
-	memcpy(pp->v1, pp->v0, sizeof(pp->v1));
-	memcpy(qq->v0, qq->v1, sizeof(qq->v0));
+static int
+nsInit(NameSet *s, int n) {
+  for (s->mask= 15; s->mask < 2 * n; s->mask= 2 * s->mask + 1) ;
+  s->h= (uint64_t*)Alloc((s->mask + 1) * sizeof(uint64_t));
+  return s->h ? 0 : -1;
+}
 
-	for (a= 0; a<N_CH; a++) {
-	  Voice *vp= &pp->v1[a];
-	  Voice *vq= &qq->v0[a];
-	  if ((fo == 0 || fi == 0) ||		// Fade in/out to silence
-	      (vp->typ != vq->typ) ||		// Different types
-	      ((fo == 1 || fi == 1) &&		// Fade thru, but different pitches
-	       (vp->typ == 1 || vp->typ < 0) && 
-	       (vp->carr != vq->carr || vp->res != vq->res))
-	      ) {
-	    vp->amp= vq->amp= 0;		// To silence
-	    midpt= 1;				// Definitely need the mid-point
+static int
+nsHas(NameSet *s, const char *name) {
+  uint64_t h= nameHash(name);
+  int j;
 
-	    if (vq->typ == 3) {	 		// Special handling for bells
-	      vq->amp= qq->v1[a].amp; 
-	      qq->nxt->v0[a].typ= qq->nxt->v1[a].typ= 0;
-	    }
-	  }
-	  else if (vp->typ == 3) {		// Else smooth transition - for bells not so smooth
-	    qq->v0[a].typ= qq->v1[a].typ= 0;
-	  }
-	  else {				// Else smooth transition
-	    vp->amp= vq->amp= (vp->amp + vq->amp) / 2;
-	    if (vp->typ == 1 || vp->typ == 4 || vp->typ < 0) {
-	      vp->carr= vq->carr= (vp->carr + vq->carr) / 2;
-	      vp->res= vq->res= (vp->res + vq->res) / 2;
-	    }
-	  }
-	}
+  for (j= h & s->mask; s->h[j]; j= (j + 1) & s->mask)
+    if (s->h[j] == h)
+      return 1;
+  return 0;
+}
 
-	// If we don't really need the mid-point, then get rid of it
-	if (!midpt) {
-	  memcpy(pp->v1, qq->v1, sizeof(pp->v1));
-	  qq->prv->nxt= qq->nxt;
-	  qq->nxt->prv= qq->prv;
-	  free(qq);
-	}
-	else pp= qq;
-      }
+static void
+nsAdd(NameSet *s, const char *name) {
+  uint64_t h= nameHash(name);
+  int j;
 
-      pp= pp->nxt;
-    } while (pp != per);
-  }
+  for (j= h & s->mask; s->h[j] && s->h[j] != h; j= (j + 1) & s->mask) ;
+  s->h[j]= h;
+}
 
-  // Clear out zero length sections, and duplicate sections
-  {
-    Period *pp;
-    while (per != per->nxt) {
-      pp= per;
-      do {
-	if (voicesEq(pp->v0, pp->v1) &&
-	    voicesEq(pp->v0, pp->nxt->v0) &&
-	    voicesEq(pp->v0, pp->nxt->v1))
-	  pp->nxt->tim= pp->tim;
-
-	if (pp->tim == pp->nxt->tim) {
-	  if (per == pp) per= per->prv;
-	  pp->prv->nxt= pp->nxt;
-	  pp->nxt->prv= pp->prv;
-	  free(pp);
-	  pp= 0;
-	  break;
-	}
-	pp= pp->nxt;
-      } while (pp != per);
-      if (pp) break;
-    }
+//
+//	End of the block definition whose body starts at p: past the
+//	line starting with '}', or 0 if there is none.  *nlp gets the
+//	number of lines.
+//
+
+static const char *
+blockEnd(const char *p, int *nlp) {
+  const char *q;
+
+  for (*nlp= 0; *p; p= q) {
+    q= strchr(p, '\n');
+    q= q ? q + 1 : strchr(p, 0);
+    ++*nlp;
+    while (p < q && isspace(*p)) p++;
+    if (*p == '}')
+      return q;
   }
+  return 0;
+}
 
-  // Make sure that the total is 24 hours only (not more !)
-  if (per->nxt != per) {
-    int tot= 0;
-    Period *pp= per;
-    
-    do {
-      tot += t_per0(pp->tim, pp->nxt->tim);
-      pp= pp->nxt;
-    } while (pp != per);
+//
+//	Take over the definition of old statement st->old for st, if it
+//	still holds where st stands; *kept records the waveforms taken
+//	over from old_waves[]
+//
 
-    if (tot > H24) {
-      error("Total time is greater than 24 hours.");
-      return -1;
-    }
+static int
+keepName(Stmt *st, int **old_waves, char *kept) {
+  NameDef *nd= st->old->nd;
+  int a;
+
+  if (st->kind == STMT_WAVE) {
+    if (waves[st->wave] || !old_waves[st->wave])
+      return 0;
+    waves[st->wave]= old_waves[st->wave];
+    old_waves[st->wave]= 0;
+    kept[st->wave]= 1;
+    return 1;
   }
-  return 0;
+  for (a= 0; a<nd->nvv; a++)
+    if (nd->vv[a].typ < 0 && !waves[-1-nd->vv[a].typ])
+      return 0;
+  for (a= 0; a<nd->nvv; a++)
+    if (nd->vv[a].typ == 5) mix_flag= 1;
+  free_blockdefs(nd->flat);
+  nd->flat= 0;
+  nd->flat_list= 0;
+  nd->nxt= nlist;
+  nlist= nd;
+  st->nd= nd;
+  return 1;
 }
 
-static int 
-voicesEq(Voice *v0, Voice *v1) {
-  int a= N_CH;
+//
+//	Whether time line st of the loaded sequence still means the same
+//	at this point of the new text
+//
 
-  while (a-- > 0) {
-    if (v0->typ != v1->typ) return 0;
-    switch (v0->typ) {
-     case 1:
-     case 4:
-     default:
-       if (v0->amp != v1->amp ||
-	   v0->carr != v1->carr ||
-	   v0->res != v1->res)
-	 return 0;
-       break;
-     case 2:
-     case 5:
-       if (v0->amp != v1->amp)
-	 return 0;
-       break;
-     case 3:
-       if (v0->amp != v1->amp ||
-	   v0->carr != v1->carr)
-	 return 0;
-       break;
-    }
-    v0++; v1++;
-  }
+static int
+keepTimed(Stmt *st, NameSet *dirty) {
+  BlockDef *bd;
+
+  if (st->rel && st->abs0 != last_abs_time)
+    return 0;
+  if (st->nd->seen != reload_serial || nsHas(dirty, st->nd->name))
+    return 0;
+  for (bd= st->tl; bd; bd= bd->nxt)
+    if (bd->nd->seen != reload_serial)
+      return 0;
   return 1;
 }
 
-static NameDef *
-free_namedef(NameDef *n)
-{
-    NameDef *nn;
-    BlockDef *b, *bn;
+//
+//	Grow chan[] and play.v[] to n_ch channels while running
+//
 
-    if(n == NULL)
-	return NULL;
-    free(n->name);
-    for(b = n->blk; b != NULL; b = bn) {
-	bn = b->nxt;
-	free(b->lin);
-	free(b);
-    }
-    nn = n->nxt;
-    free(n);
-    return nn;
+static int
+growChannels(void) {
+  Channel *ch;
+  Voice *vv;
+
+  if (n_ch <= chan_max)
+    return 0;
+  if (!(ch= (Channel*)realloc(chan, n_ch * sizeof(Channel))))
+    goto fail;
+  chan= ch;
+  memset(chan + chan_max, 0, (n_ch - chan_max) * sizeof(Channel));
+  if (!(vv= (Voice*)realloc(play.v, n_ch * sizeof(Voice))))
+    goto fail;
+  play.v= vv;
+  play.n_ch= chan_max= n_ch;
+  return 0;
+
+ fail:
+  error("Out of memory");
+  return -1;
 }
 
 //
-//	Read a name definition
+//	Point each voice-set of the time lines of sl to its first period
+//	in the ring just built, for spliceSeq()
 //
 
+static void
+markFirst(StmtList *sl) {
+  Stmt *st;
+  BlockDef *bd;
+  Period *pp= per;
+
+  for (st= sl->st; st < sl->st + sl->n; st++)
+    if (st->kind == STMT_TIME)
+      for (bd= st->tl; bd; bd= bd->nxt)
+	bd->first= 0;
+  do {
+    if (!pp->src->first)
+      pp->src->first= pp;
+    pp= pp->nxt;
+  } while (pp != per);
+}
+
 static int
-readNameDef() {
-  char *p, *q;
-  NameDef *nd;
-  int ch;
+voiceSame(Voice *v0, Voice *v1) {
+  int a;
 
-  if (!(p= getWord())) {
-      badSeq();
-      return -1;
-  }
+  for (a= 0; a<n_ch; a++, v0++, v1++)
+    if (v0->typ != v1->typ || v0->amp != v1->amp ||
+	v0->carr != v1->carr || v0->res != v1->res)
+      return 0;
+  return 1;
+}
 
-  q= strchr(p, 0) - 1;
-  if (*q != ':') {
-      badSeq();
-      return -1;
-  }
-  *q= 0;
-  for (q= p; *q; q++) {
-    if (!isalnum(*q) && *q != '-' && *q != '_') {
-      error("Bad name \"%s\" in definition, line %d:\n  %s", p, in_lin, lin_copy);
-      return -1;
-    }
+//
+//	Compare the run of periods from p0 with the one from p1, as long
+//	as they come from voice-set b0 or b1.  Rets: the last period of
+//	the run from p1, or 0 if they differ or are empty.
+//
+
+static Period *
+sameRun(Period *p0, Period *p1, BlockDef *b0, BlockDef *b1) {
+  Period *last= 0;
+
+  while (p0->src == b0 || p0->src == b1) {
+    if (p1->src != p0->src || p1->tim != p0->tim ||
+	!voiceSame(p0->v0, p1->v0) || !voiceSame(p0->v1, p1->v1))
+      return 0;
+    last= p1;
+    p0= p0->nxt;
+    p1= p1->nxt;
   }
+  return p1->src == b0 || p1->src == b1 ? 0 : last;
+}
 
-  // Waveform definition ?
-  if (0 == memcmp(p, "wave", 4) && 
-      isdigit(p[4]) &&
-      isdigit(p[5]) &&
-      !p[6]) {
-     int ii= (p[4] - '0') * 10 + (p[5] - '0');
-     int siz= ST_SIZ * sizeof(int);
-     int *arr= (int*)Alloc(siz);
-     if(arr == NULL)
-	 return -1;
-     double *dp0= (double*)arr;
-     double *dp1= (double*)(siz + (char*)arr);
-     double *dp= dp0;
-     double dmax= 0, dmin= 1;
-     int np;
+//
+//	Find the first period from voice-set b0 or b1 in the ring from
+//	pp to end, or 0
+//
 
-     if (waves[ii]) {
-	free(arr);
-	error("Waveform %02d already defined, line %d:\n  %s",
-	      ii, in_lin, lin_copy);
-	return -1;
-     }
-     waves[ii]= arr;
-     
-     while ((p= getWord())) {
-	double dd;
-	char dmy;
-	if (1 != sscanf(p, "%lf %c", &dd, &dmy)) {
-	   free(arr);
-	   error("Expecting floating-point numbers on this waveform "
-		 "definition line, line %d:\n  %s",
-		 in_lin, lin_copy);
-	   return -1;
-	}
-	if (dp >= dp1) {
-	   free(arr);
-	   error("Too many samples on line (maximum %d), line %d:\n  %s",
-		 dp1-dp0, in_lin, lin_copy);
-	   return -1;
-	}
-	*dp++= dd;
-	if (dmax < dmin) dmin= dmax= dd;
-	else {
-	   if (dd > dmax) dmax= dd;
-	   if (dd < dmin) dmin= dd;
-	}
-     }
-     dp1= dp;
-     np= dp1 - dp0;
-     if (np < 2) {
-	free(arr);
-	error("Expecting at least two samples in the waveform, line %d:\n  %s",
-	      in_lin, lin_copy);
-	return -1;
-     }
+static Period *
+findRun(Period *pp, Period *end, BlockDef *b0, BlockDef *b1) {
+  do {
+    if (pp->src == b0 || pp->src == b1)
+      return pp;
+    pp= pp->nxt;
+  } while (pp != end);
+  return 0;
+}
 
-     // Adjust to range 0-1
-     for (dp= dp0; dp < dp1; dp++)
-	*dp= (*dp - dmin) / (dmax - dmin);
+//
+//	Whether st is a time line taken over unchanged by a reload
+//
 
-     if(sinc_interpolate(dp0, np, arr) < 0)
-	 return -1;
-     
-     return 0;
-  } 
+static int
+stmtKept(Stmt *st) {
+  return st->old && st->tl == st->old->tl;
+}
 
-  // Must be block or tone-set, then, so put into a NameDef
-  nd= (NameDef*)Alloc(sizeof(NameDef));
-  if(nd == NULL)
-      return -1;
-  nd->name= StrDup(p);
-  if(nd->name == NULL)
-      return -1;
+//
+//	Splice the time lines of sl that differ from those loaded into
+//	the period ring.  They are put into a ring of their own between
+//	SPLICE_MARGIN voice-sets on each side, which is corrected like
+//	the whole sequence.  Those next to the edit may change with it,
+//	those at the far ends only stand in for the rest of the ring,
+//	and those in between must come out the same as in the loaded
+//	ring, which shows that the effect of the edit does not reach
+//	beyond them.  The periods from the edit to them then replace
+//	those in the loaded ring.  After an edit at the end, as when a
+//	sequence comes in with sbagen_stream(), the margin goes round to
+//	the start of the sequence.  Rets: 0 if done, 1 if the ring must
+//	be built anew.
+//
 
-  // Block definition ?
-  if (*lin == '{') {
-    BlockDef *bd, **prvp;
-    if (!(p= getWord()) || 
-	0 != strcmp(p, "{") || 
-	0 != (p= getWord())) {
-      free_namedef(nd);
-      badSeq();
-      return -1;
-    }
+static int
+spliceSeq(StmtList *sl) {
+  BlockDef *lm[SPLICE_MARGIN], *rm[SPLICE_MARGIN], *bd;
+  Period *o_per= per, *lp, *tp, *op, *tl_end, *ol_end, *tr, *or, *pp;
+  int o_n_periods= n_periods;
+  int i, j, pn, po, sn, so, k, il, skip, nch= 0, moved= 0;
+  int tim0= -1, tim1= -1;
+  Stmt *st;
+
+  // Time lines kept in the same order at the start and at the end
+  for (i= j= 0; ; i++, j++) {
+    while (i < sl->n && sl->st[i].kind != STMT_TIME) i++;
+    while (j < stmts.n && stmts.st[j].kind != STMT_TIME) j++;
+    if (i == sl->n || j == stmts.n || !stmtKept(&sl->st[i]) ||
+	sl->st[i].old != &stmts.st[j])
+      break;
+  }
+  pn= i; po= j;
+  for (i= sl->n, j= stmts.n; ; i--, j--) {
+    while (i > pn && sl->st[i-1].kind != STMT_TIME) i--;
+    while (j > po && stmts.st[j-1].kind != STMT_TIME) j--;
+    if (i == pn || j == po || !stmtKept(&sl->st[i-1]) ||
+	sl->st[i-1].old != &stmts.st[j-1])
+      break;
+  }
+  sn= i; so= j;
 
-    prvp= &nd->blk;
-    
-    while (readLine()) {
-      if (*lin == '}') {
-	if (!(p= getWord()) || 
-	    0 != strcmp(p, "}") || 
-	    0 != (p= getWord())) {
-	  free_namedef(nd);
-	  badSeq();
-	  return -1;
-	}
-	if (!nd->blk) {
-	    free_namedef(nd);
-	    error("Empty blocks not permitted, line %d:\n  %s", in_lin, lin_copy);
-	    return -1;
-	}
-	nd->nxt= nlist; nlist= nd;
-	return 0;
-      }
-      
-      if (*lin != '+') {
-	free_namedef(nd);
-	error("All lines in the block must have relative time, line %d:\n  %s",
-	      in_lin, lin_copy);
-	return -1;
-      }
-      
-      bd= (BlockDef*) Alloc(sizeof(*bd));
-      if(bd == NULL)
-	  return -1;
-      *prvp= bd; prvp= &bd->nxt;
-      bd->lin= StrDup(lin);
-      if(bd->lin == NULL)
-	  return -1;
+  for (st= sl->st; st < sl->st + sl->n; st++)
+    if (st->kind == STMT_TIME) {
+      if (nch < st->nch) nch= st->nch;
+      if (tim0 < 0) tim0= st->tim0;
+      tim1= st->tim1;
     }
-    
-    // Hit EOF before }
-    free_namedef(nd);
-    error("End-of-file within block definition (missing '}')");
-    return -1;
+  if (nch != n_ch)
+    return 1;
+  fast_tim0= tim0;
+  fast_tim1= seq_more ? streamEnd(sl) : tim1;
+  if (pn == sn && po == so)
+    return 0;			// Same time lines
+
+  // The margins
+  for (i= pn, k= 0; k < SPLICE_MARGIN && i > 0; )
+    if (sl->st[--i].kind == STMT_TIME)
+      k += sl->st[i].nt;
+  if (k < SPLICE_MARGIN)
+    return 1;
+  for (il= i, skip= k - SPLICE_MARGIN, k= 0; i < pn; i++) {
+    if (sl->st[i].kind != STMT_TIME)
+      continue;
+    for (bd= sl->st[i].tl; bd; bd= bd->nxt)
+      if (skip) skip--;
+      else lm[k++]= bd;
+  }
+  for (i= sn, k= 0; k < SPLICE_MARGIN && i < sl->n; i++)
+    if (sl->st[i].kind == STMT_TIME)
+      for (bd= sl->st[i].tl; bd && k < SPLICE_MARGIN; bd= bd->nxt)
+	rm[k++]= bd;
+  for (i= 0; k < SPLICE_MARGIN && i < il; i++)	// Round to the start
+    if (sl->st[i].kind == STMT_TIME)
+      for (bd= sl->st[i].tl; bd && k < SPLICE_MARGIN; bd= bd->nxt)
+	rm[k++]= bd;
+  if (k < SPLICE_MARGIN)
+    return 1;
+
+  // Ring of the margins and the time lines in between
+  per= 0;
+  n_periods= 0;
+  for (k= 0; k<SPLICE_MARGIN; k++)
+    if (addPeriod(lm[k]) < 0)
+      goto fail;
+  for (i= pn; i < sn; i++)
+    if (sl->st[i].kind == STMT_TIME)
+      for (bd= sl->st[i].tl; bd; bd= bd->nxt)
+	if (addPeriod(bd) < 0)
+	  goto fail;
+  for (k= 0; k<SPLICE_MARGIN; k++)
+    if (addPeriod(rm[k]) < 0)
+      goto fail;
+  if (widenPeriods() < 0 || correctPeriods() < 0)
+    goto fail;
+  lp= findRun(per, per, lm[0], lm[0]);
+  per= o_per;
+  n_periods= o_n_periods;
+
+  // Compare the margins with the loaded ring
+  if (!lp || !(tp= findRun(lp, lp, lm[1], lm[2])) ||
+      !(op= lm[1]->first ? lm[1]->first : lm[2]->first) ||
+      !(ol_end= sameRun(tp, op, lm[1], lm[2])))
+    return 1;
+  for (tl_end= tp; tl_end->nxt->src == lm[1] || tl_end->nxt->src == lm[2]; )
+    tl_end= tl_end->nxt;
+  if (!(tr= findRun(tl_end->nxt, lp, rm[1], rm[2])) ||
+      !(or= rm[1]->first ? rm[1]->first : rm[2]->first) ||
+      !sameRun(tr, or, rm[1], rm[2]))
+    return 1;
+  for (k= 0, pp= ol_end->nxt; pp != or; pp= pp->nxt) {
+    if (pp == op)
+      return 1;
+    if (pp == per)
+      moved= 1;
+    k--;
   }
 
-  // Normal line-definition
-  for (ch= 0; ch < N_CH && (p= getWord()); ch++) {
-    char dmy;
-    double amp, carr, res;
-    int wave;
+  // Replace the periods in between; their neighbours are the same
+  // in both rings, so they can be compiled first
+  for (pp= tl_end; pp != tr; pp= pp->nxt, k++)
+    if (compilePeriod(pp) < 0)
+      return 1;
+  n_periods += k - 1;
+  ol_end->dv= tl_end->dv;
+  if (tl_end->nxt == tr) {
+    ol_end->nxt= or;
+    or->prv= ol_end;
+  } else {
+    ol_end->nxt= tl_end->nxt;
+    ol_end->nxt->prv= ol_end;
+    tr->prv->nxt= or;
+    or->prv= tr->prv;
+  }
+  lm[SPLICE_MARGIN-1]->first= rm[0]->first= 0;
+  for (i= pn; i < sn; i++)
+    if (sl->st[i].kind == STMT_TIME)
+      for (bd= sl->st[i].tl; bd; bd= bd->nxt)
+	bd->first= 0;
+  for (pp= ol_end->nxt; pp != or; pp= pp->nxt)
+    if (!pp->src->first)
+      pp->src->first= pp;
+  if (moved)
+    per= ol_end;
+  return 0;
 
-    // Interpret word into Voice nd->vv[ch]
-    if (0 == strcmp(p, "-")) continue;
-    if (1 == sscanf(p, "pink/%lf %c", &amp, &dmy)) {
-       nd->vv[ch].typ= 2;
-       nd->vv[ch].amp= AMP_DA(amp);
-       continue;
+ fail:
+  per= o_per;
+  n_periods= o_n_periods;
+  return 1;
+}
+
+//
+//	Replace the loaded sequence with the one in text, reading again
+//	only the statements that changed.  Name definitions are read in
+//	a first pass; a time line is then kept if its text and base
+//	time are the same and none of the names it uses, directly or
+//	through blocks, changed.  The periods of the time lines that
+//	changed are spliced into the ring if spliceSeq() can, else it is
+//	built anew in a second arena; either way the loaded sequence is
+//	left as it was on error.
+//	New names and time lines go to the same parse_arena until as
+//	many statements have been read again as there are in the
+//	sequence; the next reload then reads all of the text into a new
+//	one.
+//
+
+static int
+reloadSeq(const char *text) {
+  StmtList nsl= { 0, 0, 0 };
+  StmtMap map;
+  NameSet dirty;
+  Arena old_parse= parse_arena, old_seq;
+  Period *o_per= per;
+  int o_n_ch= n_ch, o_tim0= fast_tim0, o_tim1= fast_tim1;
+  int o_mix= mix_flag, o_now= now, o_abs= last_abs_time;
+  int *old_waves[100];
+  char kept[100];
+  int o_n_periods= n_periods;
+  int reuse= stmts_whole && stmts_stale <= stmts.n;
+  int start= 1, stale= 0, all_dirty= 0, fresh= 0;
+  Timeline *shared;
+  int r, i, nl, pass, changed;
+  const char *end;
+  Stmt *st, *os;
+  BlockDef *bd;
+  char *p;
+
+  memset(&map, 0, sizeof(map));
+  memset(&dirty, 0, sizeof(dirty));
+  if (!reuse)
+    memset(&parse_arena, 0, sizeof(parse_arena));
+  shared= tlUnshare();
+  memcpy(old_waves, waves, sizeof(waves));
+  if (shared)			// They stay with the timeline
+    memset(old_waves, 0, sizeof(old_waves));
+  memset(waves, 0, sizeof(waves));
+  memset(kept, 0, sizeof(kept));
+  reload_serial++;
+  now= 0;
+  last_abs_time= -1;
+  mix_flag= 0;
+  nlist= 0;
+  n_timed= 0;
+  parse_work= 0;
+  if (reuse && smInit(&map, &stmts) < 0)
+    goto fail;
+
+  // Options and name definitions; time lines are only hashed
+  in_text= text;
+  in_lin= 0;
+  while ((r= readLine()) > 0) {
+    const char *s0= line_start;
+
+    if (*lin == '-') {
+      if (readOption(lin, start) < 0)
+	goto fail;
+      continue;
     }
-    if (2 == sscanf(p, "bell%lf/%lf %c", &carr, &amp, &dmy)) {
-       nd->vv[ch].typ= 3;
-       nd->vv[ch].carr= carr;
-       nd->vv[ch].amp= AMP_DA(amp);
-       continue;
+    start= 0;
+    if (!(st= addStmt(&nsl)))
+      goto fail;
+    if (!(p= nameDefRest(lin))) {
+      st->kind= STMT_TIME;
+      st->text= s0;
+      st->line= in_lin;
+      st->hash= stmtHash(s0, in_text, STMT_TIME);
+      st->old= smClaim(&map, st->hash);
+      continue;
     }
-    if (1 == sscanf(p, "mix/%lf %c", &amp, &dmy)) {
-       nd->vv[ch].typ= 5;
-       nd->vv[ch].amp= AMP_DA(amp);
-       mix_flag= 1;
-       continue;
+    st->wave= stmtWave(lin);
+    st->kind= st->wave < 0 ? STMT_NAME : STMT_WAVE;
+    while (isspace(*p)) p++;
+    nl= 0;
+    end= *p == '{' ? blockEnd(in_text, &nl) : in_text;
+    if (end && (st->old= smClaim(&map, stmtHash(s0, end, st->kind)))) {
+      if (keepName(st, old_waves, kept)) {
+	st->hash= st->old->hash;
+	in_text= end;
+	in_lin += nl;
+	continue;
+      }
+      st->old->used= 0;
+      st->old= 0;
     }
-    if (4 == sscanf(p, "wave%d:%lf%lf/%lf %c", &wave, &carr, &res, &amp, &dmy)) {
-       if (wave < 0 || wave >= 100) {
-	  free_namedef(nd);
-	  error("Only wave00 to wave99 is permitted at line: %d\n  %s", in_lin, lin_copy);
-	  return -1;
-       }
-       if (!waves[wave]) {
-	  free_namedef(nd);
-	  error("Waveform %02d has not been defined, line: %d\n  %s", wave, in_lin, lin_copy);
-	  return -1;
-       }
-       nd->vv[ch].typ= -1-wave;
-       nd->vv[ch].carr= carr;
-       nd->vv[ch].res= res;
-       nd->vv[ch].amp= AMP_DA(amp);	
-       continue;
+    in_text= s0;
+    in_lin--;
+    if (readLine() <= 0 || readNameDef() < 0)
+      goto fail;
+    if (st->kind == STMT_NAME)
+      st->nd= nlist;
+    st->hash= stmtHash(s0, in_text, st->kind);
+    stale++;
+  }
+  if (r < 0)
+    goto fail;
+
+  // Names that may not mean the same any more: those defined anew,
+  // or no longer, and the blocks using them
+  if (nsInit(&dirty, stmts.n + nsl.n) < 0)
+    goto fail;
+  for (os= stmts.st; os < stmts.st + stmts.n; os++)
+    if (os->kind == STMT_NAME && os->nd && !os->used)
+      nsAdd(&dirty, os->nd->name);
+  for (st= nsl.st; st < nsl.st + nsl.n; st++)
+    if (st->kind == STMT_NAME && !st->old)
+      nsAdd(&dirty, st->nd->name);
+  for (pass= 0, changed= 1; changed; pass++) {
+    if (pass > MAX_BLOCK_DEPTH) {
+      all_dirty= 1;
+      break;
     }
-    if (3 == sscanf(p, "%lf%lf/%lf %c", &carr, &res, &amp, &dmy)) {
-      nd->vv[ch].typ= 1;
-      nd->vv[ch].carr= carr;
-      nd->vv[ch].res= res;
-      nd->vv[ch].amp= AMP_DA(amp);	
-      continue;
+    changed= 0;
+    for (st= nsl.st; st < nsl.st + nsl.n; st++) {
+      if (st->kind != STMT_NAME || !st->old || !st->nd->blk ||
+	  nsHas(&dirty, st->nd->name))
+	continue;
+      for (bd= st->nd->blk; bd; bd= bd->nxt)
+	if (nsHas(&dirty, bd->name)) {
+	  nsAdd(&dirty, st->nd->name);
+	  changed= 1;
+	  break;
+	}
     }
-    if (2 == sscanf(p, "%lf/%lf %c", &carr, &amp, &dmy)) {
-      nd->vv[ch].typ= 1;
-      nd->vv[ch].carr= carr;
-      nd->vv[ch].res= 0;
-      nd->vv[ch].amp= AMP_DA(amp);	
+  }
+
+  // Time lines, with the names defined before each
+  nlist= 0;
+  for (st= nsl.st; st < nsl.st + nsl.n; st++) {
+    if (st->kind == STMT_NAME) {
+      nlist= st->nd;
+      nlist->seen= reload_serial;
       continue;
     }
-    if (3 == sscanf(p, "spin:%lf%lf/%lf %c", &carr, &res, &amp, &dmy)) {
-      nd->vv[ch].typ= 4;
-      nd->vv[ch].carr= carr;
-      nd->vv[ch].res= res;
-      nd->vv[ch].amp= AMP_DA(amp);	
+    if (st->kind != STMT_TIME)
+      continue;
+    if ((os= st->old) && !all_dirty && keepTimed(os, &dirty)) {
+      for (bd= os->tl; bd; bd= bd->nxt)
+	if (2 * ++n_timed > MAX_PERIODS) {
+	  error("Too many periods (maximum %d), line %d", MAX_PERIODS, st->line);
+	  goto fail;
+	}
+      st->nd= os->nd;
+      st->tl= os->tl;
+      st->tim0= os->tim0;
+      st->tim1= os->tim1;
+      st->abs0= os->abs0;
+      st->abs1= os->abs1;
+      st->rel= os->rel;
+      st->nt= os->nt;
+      st->nch= os->nch;
+      last_abs_time= os->abs1;
       continue;
     }
-    free_namedef(nd);
-    badSeq();
-    return -1;
+    in_text= st->text;
+    in_lin= st->line - 1;
+    if (readLine() <= 0 || readTimeLine(st) < 0)
+      goto fail;
+    stale++;
   }
-  nd->nxt= nlist; nlist= nd;
-  return 0;
-}  
 
-//
-//	Bad time
-//
+  // Splice in the time lines that changed if that can be done and
+  // nobody else walks the ring, else build the ring anew
+  if (!reuse || all_dirty || shared || spliceSeq(&nsl)) {
+    fresh= 1;
+    old_seq= seq_arena;
+    memset(&seq_arena, 0, sizeof(seq_arena));
+    per= 0;
+    n_ch= 0;
+    n_periods= 0;
+    fast_tim0= fast_tim1= -1;
+    ns_used= 0;
+    if (buildPeriods(&nsl, 0) < 0 || (running == 1 && growChannels() < 0))
+      goto fail;
+    markFirst(&nsl);
+  } else
+    stale += 2 * SPLICE_MARGIN;
+
+  // Done: free what was not taken over
+  for (os= stmts.st; os < stmts.st + stmts.n; os++)
+    if (os->kind == STMT_NAME && os->nd && !os->used)
+      free_namedef(os->nd);
+  for (i= 0; i<100; i++)
+    free(old_waves[i]);
+  if (fresh)
+    aFree(&old_seq);
+  if (shared) {
+    seq_tl= 0;
+    sbagen_timeline_put(shared);
+  }
+  if (!reuse)
+    aFree(&old_parse);
+  free(stmts.st);
+  stmts= nsl;
+  stmts_whole= 1;
+  stmts_stale= reuse ? stmts_stale + stale : 0;
+  smFree(&map);
+  free(dirty.h);
+  now= o_now;
+  seq_hash= fnv1a(text, strlen(text), FNV_INIT);
+  if (running == 1) {
+    play.per= seekPeriod(per, now);
+    play.n_ch= n_ch;
+    play.cur_per= chan_per= 0;
+    corrVal(1);
+    seq_reloaded= fast_tim0 != o_tim0 || fast_tim1 != o_tim1;
+    if (cache_fd >= 0)
+      cache_end(0, 0);
+  } else {
+    play.per= per;		// The old periods may be gone
+    play.cur_per= chan_per= 0;
+  }
+  return 0;
 
-static void 
-badTime(char *tim) {
-  error("Badly constructed time \"%s\", line %d:\n  %s", tim, in_lin, lin_copy);
+ fail:
+  for (st= nsl.st; st < nsl.st + nsl.n; st++)
+    if (st->kind == STMT_NAME && !st->old && st->nd)
+      free_namedef(st->nd);
+  for (i= 0; i<100; i++) {
+    if (kept[i])
+      old_waves[i]= waves[i];
+    else
+      free(waves[i]);
+  }
+  memcpy(waves, shared ? shared->waves : old_waves, sizeof(waves));
+  nlist= 0;
+  for (os= stmts.st; os < stmts.st + stmts.n; os++) {
+    os->used= 0;
+    if (os->kind == STMT_NAME && os->nd) {
+      os->nd->nxt= nlist;
+      nlist= os->nd;
+    }
+  }
+  if (fresh) {
+    aFree(&seq_arena);
+    seq_arena= old_seq;
+  }
+  if (reuse)
+    stmts_stale += stale;
+  else {
+    aFree(&parse_arena);
+    parse_arena= old_parse;
+  }
+  free(nsl.st);
+  smFree(&map);
+  free(dirty.h);
+  per= o_per;
+  n_ch= o_n_ch;
+  n_periods= o_n_periods;
+  fast_tim0= o_tim0;
+  fast_tim1= o_tim1;
+  mix_flag= o_mix;
+  now= o_now;
+  last_abs_time= o_abs;
+  return -1;
 }
 
+
 //
-//	Read a time-line of either type
+//	Fill in all the correct information for the Periods, assuming
+//	they have just been loaded using readTimeLine()
 //
 
+
 static int
-readTimeLine() {
-  char *p, *tim_p;
-  int nn;
-  int fo, fi;
-  Period *pp;
-  NameDef *nd;
-  static int last_abs_time= -1;
-  int tim, rtim = 0;
+correctPeriods() {
+  // Get times all correct
+  {
+    Period *pp= per;
+    do {
+      if (pp->fi == -2) {
+	pp->tim= pp->nxt->tim;
+	pp->fi= -1;
+      }
 
-  if (!(p= getWord())) {
-      badSeq();
-      return -1;
-  }
-  tim_p= p;
-  
-  // Read the time represented
-  tim= -1;
-  if (0 == memcmp(p, "NOW", 3)) {
-    last_abs_time= tim= now;
-    p += 3;
+      pp= pp->nxt;
+    } while (pp != per);
   }
 
-  while (*p) {
-    if (*p == '+') {
-      if (tim < 0) {
-	if (last_abs_time < 0) {
-	  error("Relative time without previous absolute time, line %d:\n  %s", in_lin, lin_copy);
-	  return -1;
+  // Make sure that the transitional periods each have enough time
+  {
+    Period *pp= per;
+    do {
+      if (pp->fi == -1) {
+	int per= t_per0(pp->tim, pp->nxt->tim);
+	if (per < fade_int) {
+	  int adj= (fade_int - per) / 2, adj0, adj1;
+	  adj0= t_per0(pp->prv->tim, pp->tim);
+	  adj0= (adj < adj0) ? adj : adj0;
+	  adj1= t_per0(pp->nxt->tim, pp->nxt->nxt->tim);
+	  adj1= (adj < adj1) ? adj : adj1;
+	  pp->tim= (pp->tim - adj0 + H24) % H24;
+	  pp->nxt->tim= (pp->nxt->tim + adj1) % H24;
 	}
-	tim= last_abs_time;
       }
-      p++;
-    }
-    else if (tim != -1) {
-	badTime(tim_p);
-	return -1;
-    }
-
-    if (0 == (nn= readTime(p, &rtim))) {
-	badTime(tim_p);
-	return -1;
-    }
-    p += nn;
 
-    if (tim == -1) 
-      last_abs_time= tim= rtim;
-    else 
-      tim= (tim + rtim) % H24;
+      pp= pp->nxt;
+    } while (pp != per);
   }
 
-  if (fast_tim0 < 0) fast_tim0= tim;		// First time
-  fast_tim1= tim;				// Last time
-      
-  if (!(p= getWord())) {
-      badSeq();
-      return -1;
+  // Fill in all the voice arrays, and sort out details of
+  // transitional periods
+  {
+    Period *pp= per;
+    Period *spare= 0;		// Mid-point not needed, for reuse
+    do {
+      if (pp->fi < 0) {
+	int fo, fi;
+	int a;
+	int midpt= 0;
+
+	Period *qq= spare ? spare : newPeriod(n_ch);
+	if(qq == NULL)
+	    return -1;
+	spare= 0;
+	qq->src= pp->src;
+	qq->prv= pp; qq->nxt= pp->nxt;
+	qq->prv->nxt= qq->nxt->prv= qq;
+
+	qq->tim= t_mid(pp->tim, qq->nxt->tim);
+
+	memcpy(pp->v0, pp->prv->v1, n_ch * sizeof(Voice));
+	memcpy(qq->v1, qq->nxt->v0, n_ch * sizeof(Voice));
+
+	// Special handling for bells
+	for (a= 0; a<n_ch; a++) {
+	  if (pp->v0[a].typ == 3 && pp->fi != -3)
+	    pp->v0[a].typ= 0;
+
+	  if (qq->v1[a].typ == 3 && pp->fi == -3)
+	    qq->v1[a].typ= 0;
+	}
+	      
+	fo= pp->prv->fo;
+	fi= qq->nxt->fi;
+
+	// Special handling for -> slides:
+	//   always slide, and stretch slide if possible
+	if (pp->fi == -3) {
+	  fo= fi= 2;		// Force slides for ->
+	  for (a= 0; a<n_ch; a++) {
+	    Voice *vp= &pp->v0[a];
+	    Voice *vq= &qq->v1[a];
+	    if (vp->typ == 0 && vq->typ != 0 && vq->typ != 3) {
+	      memcpy(vp, vq, sizeof(*vp)); vp->amp= 0;
+	    }
+	    else if (vp->typ != 0 && vq->typ == 0) {
+	      memcpy(vq, vp, sizeof(*vq)); vq->amp= 0;
+	    }
+	  }
+	}
+
+	memcpy(pp->v1, pp->v0, n_ch * sizeof(Voice));
+	memcpy(qq->v0, qq->v1, n_ch * sizeof(Voice));
+
+	for (a= 0; a<n_ch; a++) {
+	  Voice *vp= &pp->v1[a];
+	  Voice *vq= &qq->v0[a];
+	  if ((fo == 0 || fi == 0) ||		// Fade in/out to silence
+	      (vp->typ != vq->typ) ||		// Different types
+	      ((fo == 1 || fi == 1) &&		// Fade thru, but different pitches
+	       (vp->typ == 1 || vp->typ < 0) && 
+	       (vp->carr != vq->carr || vp->res != vq->res))
+	      ) {
+	    vp->amp= vq->amp= 0;		// To silence
+	    midpt= 1;				// Definitely need the mid-point
+
+	    if (vq->typ == 3) {	 		// Special handling for bells
+	      vq->amp= qq->v1[a].amp; 
+	      qq->nxt->v0[a].typ= qq->nxt->v1[a].typ= 0;
+	    }
+	  }
+	  else if (vp->typ == 3) {		// Else smooth transition - for bells not so smooth
+	    qq->v0[a].typ= qq->v1[a].typ= 0;
+	  }
+	  else {				// Else smooth transition
+	    vp->amp= vq->amp= (vp->amp + vq->amp) / 2;
+	    if (vp->typ == 1 || vp->typ == 4 || vp->typ < 0) {
+	      vp->carr= vq->carr= (vp->carr + vq->carr) / 2;
+	      vp->res= vq->res= (vp->res + vq->res) / 2;
+	    }
+	  }
+	}
+
+	// If we don't really need the mid-point, then get rid of it
+	if (!midpt) {
+	  memcpy(pp->v1, qq->v1, n_ch * sizeof(Voice));
+	  qq->prv->nxt= qq->nxt;
+	  qq->nxt->prv= qq->prv;
+	  spare= qq;
+	}
+	else pp= qq;
+      }
+
+      pp= pp->nxt;
+    } while (pp != per);
   }
-      
-  fi= fo= 1;
-  if (!isalpha(*p)) {
-    switch (p[0]) {
-     case '<': fi= 0; break;
-     case '-': fi= 1; break;
-     case '=': fi= 2; break;
-     default: badSeq(); return -1;
-    }
-    switch (p[1]) {
-     case '>': fo= 0; break;
-     case '-': fo= 1; break;
-     case '=': fo= 2; break;
-     default: badSeq(); return -1;
-    }
-    if (p[2]) {
-	badSeq();
-	return -1;
-    }
 
-    if (!(p= getWord())) {
-	badSeq();
+  // Clear out zero length sections, and duplicate sections.  Removing
+  // a section only changes the outcome for the one before it, so the
+  // scan steps back one section instead of starting over, except when
+  // the section removed was the last one and the first section's time
+  // may have changed.
+  {
+    Period *pp= per;
+    while (per != per->nxt) {
+      if (parseWork(1) < 0)
 	return -1;
+      if (voicesEq(pp->v0, pp->v1) &&
+	  voicesEq(pp->v0, pp->nxt->v0) &&
+	  voicesEq(pp->v0, pp->nxt->v1))
+	pp->nxt->tim= pp->tim;
+
+      if (pp->tim == pp->nxt->tim) {
+	Period *prv= pp->prv;
+	int last= pp->nxt == per;
+	if (per == pp) per= per->prv;
+	pp->prv->nxt= pp->nxt;
+	pp->nxt->prv= pp->prv;
+	pp= last ? per : prv;
+	continue;
+      }
+      pp= pp->nxt;
+      if (pp == per) break;
     }
   }
-      
-  for (nd= nlist; nd && 0 != strcmp(p, nd->name); nd= nd->nxt) ;
-  if (!nd) {
-      error("Name \"%s\" not defined, line %d:\n  %s", p, in_lin, lin_copy);
+
+  // Make sure that the total is 24 hours only (not more !)
+  if (per->nxt != per) {
+    int tot= 0;
+    Period *pp= per;
+    
+    do {
+      tot += t_per0(pp->tim, pp->nxt->tim);
+      pp= pp->nxt;
+    } while (pp != per);
+
+    if (tot > H24) {
+      error("Total time is greater than 24 hours.");
       return -1;
+    }
   }
+  return 0;
+}
 
-  // Check for block name-def
-  if (nd->blk) {
-    BlockDef *bd= nd->blk;
-    char *prep= StrDup(tim_p);		// Put this at the start of each line
-    if(prep == NULL)
-	return -1;
+static int 
+voicesEq(Voice *v0, Voice *v1) {
+  int a= n_ch;
+
+  while (a-- > 0) {
+    if (v0->typ != v1->typ) return 0;
+    switch (v0->typ) {
+     case 1:
+     case 4:
+     default:
+       if (v0->amp != v1->amp ||
+	   v0->carr != v1->carr ||
+	   v0->res != v1->res)
+	 return 0;
+       break;
+     case 2:
+     case 5:
+       if (v0->amp != v1->amp)
+	 return 0;
+       break;
+     case 3:
+       if (v0->amp != v1->amp ||
+	   v0->carr != v1->carr)
+	 return 0;
+       break;
+    }
+    v0++; v1++;
+  }
+  return 1;
+}
+
+//
+//	Work out once for each period which channels vary over it, and
+//	their change per millisecond
+//
+
+static int
+compilePeriods(void) {
+  Period *pp= per;
+
+  do {
+    if (compilePeriod(pp) < 0)
+      return -1;
+    pp= pp->nxt;
+  } while (pp != per);
+  return 0;
+}
+
+static int
+compilePeriod(Period *pp) {
+  int a, len;
+
+  if (pp->dv)
+    memset(pp->dv, 0, n_ch * sizeof(Voice));
+  len= t_per24(pp->tim, pp->nxt->tim);
+  for (a= 0; a<n_ch; a++) {
+    Voice *v0= &pp->v0[a], *v1= &pp->v1[a];
+    int vary;
+      
+    if (v0->typ == 2 || v0->typ == 4 || v1->typ == 2 || v1->typ == 4)
+      ns_used= 1;
+    switch (v0->typ) {
+     case 0:
+     case 3:			// Bells don't slide
+       vary= 0;
+       break;
+     case 2:
+     case 5:
+       vary= v0->amp != v1->amp;
+       break;
+     default:
+       vary= (v0->amp != v1->amp ||
+	      v0->carr != v1->carr ||
+	      v0->res != v1->res);
+       break;
+    }
+    if (!vary) continue;
+    if (!pp->dv && !(pp->dv= (Voice*)aAlloc(&seq_arena, n_ch * sizeof(Voice))))
+      return -1;
+    pp->dv[a].typ= 1;
+    pp->dv[a].amp= (v1->amp - v0->amp) / len;
+    if (v0->typ != 2 && v0->typ != 5) {
+      pp->dv[a].carr= (v1->carr - v0->carr) / len;
+      pp->dv[a].res= (v1->res - v0->res) / len;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Free a flattened block list. These are rebuilt whenever a new name is
+ * defined, so they are not kept in the parse arena.
+ */
+static void
+free_blockdefs(BlockDef *b)
+{
+    BlockDef *bn;
+
+    for(; b != NULL; b = bn) {
+	bn = b->nxt;
+	free(b);
+    }
+}
+
+/*
+ * Free what a NameDef holds outside of the parse arena.
+ */
+static NameDef *
+free_namedef(NameDef *n)
+{
+    if(n == NULL)
+	return NULL;
+    free(n->vv);
+    free_blockdefs(n->flat);
+    return n->nxt;
+}
+
+//
+//	Read a name definition
+//
+
+static int
+readNameDef() {
+  char *p, *q;
+  NameDef *nd;
+  int ch, r;
+
+  if (!(p= getWord())) {
+      badSeq();
+      return -1;
+  }
+
+  q= strchr(p, 0) - 1;
+  if (*q != ':') {
+      badSeq();
+      return -1;
+  }
+  *q= 0;
+  for (q= p; *q; q++) {
+    if (!isalnum(*q) && *q != '-' && *q != '_') {
+      error("Bad name \"%s\" in definition, line %d:\n  %s", p, in_lin, lin_copy);
+      return -1;
+    }
+  }
+
+  // Waveform definition ?
+  if (0 == memcmp(p, "wave", 4) && 
+      isdigit(p[4]) &&
+      isdigit(p[5]) &&
+      !p[6]) {
+     int ii= (p[4] - '0') * 10 + (p[5] - '0');
+     int siz= ST_SIZ * sizeof(int);
+     int *arr= (int*)Alloc(siz);
+     if(arr == NULL)
+	 return -1;
+     double *dp0= (double*)arr;
+     double *dp1= (double*)(siz + (char*)arr);
+     double *dp= dp0;
+     double dmax= 0, dmin= 1;
+     int np;
+
+     if (waves[ii]) {
+	free(arr);
+	error("Waveform %02d already defined, line %d:\n  %s",
+	      ii, in_lin, lin_copy);
+	return -1;
+     }
+     
+     while ((p= getWord())) {
+	double dd;
+	char dmy;
+	if (1 != sscanf(p, "%lf %c", &dd, &dmy)) {
+	   free(arr);
+	   error("Expecting floating-point numbers on this waveform "
+		 "definition line, line %d:\n  %s",
+		 in_lin, lin_copy);
+	   return -1;
+	}
+	if (dp >= dp1) {
+	   free(arr);
+	   error("Too many samples on line (maximum %d), line %d:\n  %s",
+		 dp1-dp0, in_lin, lin_copy);
+	   return -1;
+	}
+	*dp++= dd;
+	if (dmax < dmin) dmin= dmax= dd;
+	else {
+	   if (dd > dmax) dmax= dd;
+	   if (dd < dmin) dmin= dd;
+	}
+     }
+     dp1= dp;
+     np= dp1 - dp0;
+     if (np < 2) {
+	free(arr);
+	error("Expecting at least two samples in the waveform, line %d:\n  %s",
+	      in_lin, lin_copy);
+	return -1;
+     }
+
+     // Adjust to range 0-1
+     for (dp= dp0; dp < dp1; dp++)
+	*dp= (*dp - dmin) / (dmax - dmin);
+
+     if(sinc_interpolate(dp0, np, arr) < 0) {
+	 free(arr);
+	 return -1;
+     }
+     waves[ii]= arr;
+     
+     return 0;
+  } 
+
+  // Must be block or tone-set, then, so put into a NameDef
+  nd= (NameDef*)aAlloc(&parse_arena, sizeof(NameDef));
+  if(nd == NULL)
+      return -1;
+  nd->name= aStrDup(&parse_arena, p);
+  if(nd->name == NULL)
+      return -1;
+
+  // Block definition ?
+  if (*lin == '{') {
+    BlockDef *bd, **prvp;
+    if (!(p= getWord()) || 
+	0 != strcmp(p, "{") || 
+	0 != (p= getWord())) {
+      free_namedef(nd);
+      badSeq();
+      return -1;
+    }
+
+    prvp= &nd->blk;
+    
+    while ((r= readLine()) > 0) {
+      if (*lin == '}') {
+	if (!(p= getWord()) || 
+	    0 != strcmp(p, "}") || 
+	    0 != (p= getWord())) {
+	  free_namedef(nd);
+	  badSeq();
+	  return -1;
+	}
+	if (!nd->blk) {
+	    free_namedef(nd);
+	    error("Empty blocks not permitted, line %d:\n  %s", in_lin, lin_copy);
+	    return -1;
+	}
+	nd->nxt= nlist; nlist= nd;
+	return 0;
+      }
+      
+      if (*lin != '+') {
+	free_namedef(nd);
+	error("All lines in the block must have relative time, line %d:\n  %s",
+	      in_lin, lin_copy);
+	return -1;
+      }
+      
+      bd= (BlockDef*) aAlloc(&parse_arena, sizeof(*bd));
+      if(bd == NULL) {
+	  free_namedef(nd);
+	  return -1;
+      }
+      *prvp= bd; prvp= &bd->nxt;
+      if (readBlockLine(bd) < 0) {
+	  free_namedef(nd);
+	  return -1;
+      }
+    }
+    
+    // Hit EOF before }
+    free_namedef(nd);
+    if (r == 0)
+      error("End-of-file within block definition (missing '}')");
+    return -1;
+  }
+
+  // Normal line-definition
+  for (ch= 0; (p= getWord()); ch++) {
+    char dmy;
+    double amp, carr, res;
+    int wave;
+
+    if (ch >= MAX_CH) {
+      free_namedef(nd);
+      error("Too many voices (maximum %d), line %d:\n  %s", MAX_CH, in_lin, lin_copy);
+      return -1;
+    }
+    if (ch >= nd->nvv) {
+      Voice *vv= (Voice*)realloc(nd->vv, 2 * (ch + 1) * sizeof(Voice));
+      if (!vv) {
+	free_namedef(nd);
+	error("Out of memory");
+	return -1;
+      }
+      memset(vv + ch, 0, (ch + 2) * sizeof(Voice));
+      nd->vv= vv;
+      nd->nvv= 2 * (ch + 1);
+    }
+
+    // Interpret word into Voice nd->vv[ch]
+    if (0 == strcmp(p, "-")) continue;
+    if (1 == sscanf(p, "pink/%lf %c", &amp, &dmy)) {
+       nd->vv[ch].typ= 2;
+       nd->vv[ch].amp= AMP_DA(amp);
+       continue;
+    }
+    if (2 == sscanf(p, "bell%lf/%lf %c", &carr, &amp, &dmy)) {
+       nd->vv[ch].typ= 3;
+       nd->vv[ch].carr= carr;
+       nd->vv[ch].amp= AMP_DA(amp);
+       continue;
+    }
+    if (1 == sscanf(p, "mix/%lf %c", &amp, &dmy)) {
+       nd->vv[ch].typ= 5;
+       nd->vv[ch].amp= AMP_DA(amp);
+       mix_flag= 1;
+       continue;
+    }
+    if (4 == sscanf(p, "wave%d:%lf%lf/%lf %c", &wave, &carr, &res, &amp, &dmy)) {
+       if (wave < 0 || wave >= 100) {
+	  free_namedef(nd);
+	  error("Only wave00 to wave99 is permitted at line: %d\n  %s", in_lin, lin_copy);
+	  return -1;
+       }
+       if (!waves[wave]) {
+	  free_namedef(nd);
+	  error("Waveform %02d has not been defined, line: %d\n  %s", wave, in_lin, lin_copy);
+	  return -1;
+       }
+       nd->vv[ch].typ= -1-wave;
+       nd->vv[ch].carr= carr;
+       nd->vv[ch].res= res;
+       nd->vv[ch].amp= AMP_DA(amp);	
+       continue;
+    }
+    if (3 == sscanf(p, "%lf%lf/%lf %c", &carr, &res, &amp, &dmy)) {
+      nd->vv[ch].typ= 1;
+      nd->vv[ch].carr= carr;
+      nd->vv[ch].res= res;
+      nd->vv[ch].amp= AMP_DA(amp);	
+      continue;
+    }
+    if (2 == sscanf(p, "%lf/%lf %c", &carr, &amp, &dmy)) {
+      nd->vv[ch].typ= 1;
+      nd->vv[ch].carr= carr;
+      nd->vv[ch].res= 0;
+      nd->vv[ch].amp= AMP_DA(amp);	
+      continue;
+    }
+    if (3 == sscanf(p, "spin:%lf%lf/%lf %c", &carr, &res, &amp, &dmy)) {
+      nd->vv[ch].typ= 4;
+      nd->vv[ch].carr= carr;
+      nd->vv[ch].res= res;
+      nd->vv[ch].amp= AMP_DA(amp);	
+      continue;
+    }
+    free_namedef(nd);
+    badSeq();
+    return -1;
+  }
+  nd->nvv= ch;
+  nd->nxt= nlist; nlist= nd;
+  return 0;
+}  
+
+//
+//	Bad time
+//
+
+static void 
+badTime(char *tim) {
+  error("Badly constructed time \"%s\", line %d:\n  %s", tim, in_lin, lin_copy);
+}
+
+//
+//	Read the time at the start of a time-line, in *timp
+//
+
+static int
+readLineTime(char *p, int *timp) {
+  char *tim_p= p;
+  int nn;
+  int tim, rtim = 0;
+
+  // Read the time represented
+  tim= -1;
+  if (0 == memcmp(p, "NOW", 3)) {
+    last_abs_time= tim= now;
+    p += 3;
+  }
+
+  while (*p) {
+    if (*p == '+') {
+      if (tim < 0) {
+	if (last_abs_time < 0) {
+	  error("Relative time without previous absolute time, line %d:\n  %s", in_lin, lin_copy);
+	  return -1;
+	}
+	tim= last_abs_time;
+      }
+      p++;
+    }
+    else if (tim != -1) {
+	badTime(tim_p);
+	return -1;
+    }
+
+    if (0 == (nn= readTime(p, &rtim))) {
+	badTime(tim_p);
+	return -1;
+    }
+    p += nn;
+
+    if (tim == -1) 
+      last_abs_time= tim= rtim;
+    else 
+      tim= (tim + rtim) % H24;
+  }
+  *timp= tim;
+  return 0;
+}
+
+//
+//	Read the optional fade specification and the name of a
+//	time-line; returns the name, or 0 on error
+//
+
+static char *
+readFadeName(int *fip, int *fop) {
+  char *p;
+  int fo, fi;
+
+  if (!(p= getWord())) {
+      badSeq();
+      return 0;
+  }
+      
+  fi= fo= 1;
+  if (!isalpha(*p)) {
+    switch (p[0]) {
+     case '<': fi= 0; break;
+     case '-': fi= 1; break;
+     case '=': fi= 2; break;
+     default: badSeq(); return 0;
+    }
+    switch (p[1]) {
+     case '>': fo= 0; break;
+     case '-': fo= 1; break;
+     case '=': fo= 2; break;
+     default: badSeq(); return 0;
+    }
+    if (p[2]) {
+	badSeq();
+	return 0;
+    }
+
+    if (!(p= getWord())) {
+	badSeq();
+	return 0;
+    }
+  }
+  *fip= fi;
+  *fop= fo;
+  return p;
+}
+
+static NameDef *
+findName(char *name) {
+  NameDef *nd;
+
+  for (nd= nlist; nd && 0 != strcmp(name, nd->name); nd= nd->nxt) ;
+  if (!nd)
+      error("Name \"%s\" not defined, line %d:\n  %s", name, in_lin, lin_copy);
+  return nd;
+}
+
+//
+//	Read a line of a block definition into *bd.  Only the time is
+//	parsed here; names are looked up when the block is used, as
+//	they may be defined later in the file.
+//
+
+static int
+readBlockLine(BlockDef *bd) {
+  char *p, *tim_p;
+  int nn, rtim = 0;
+
+  tim_p= p= getWord();
+  while (*p) {
+    if (*p++ != '+' || 0 == (nn= readTime(p, &rtim))) {
+	badTime(tim_p);
+	return -1;
+    }
+    p += nn;
+    bd->tim= (bd->tim + rtim) % H24;
+  }
+  if (!(p= readFadeName(&bd->fi, &bd->fo)))
+      return -1;
+  if (!(bd->name= aStrDup(&parse_arena, p)))
+      return -1;
+  if (0 != (p= getWord()))
+      bd->slide= strcmp(p, "->") ? -1 : 1;
+  return 0;
+}
+
+//
+//	Add the Period structures for the voice-set started by a time
+//	line, as recorded by addTimed()
+//
+
+static int
+addPeriod(BlockDef *bd) {
+  Period *pp;
+  NameDef *nd= bd->nd;
+
+  pp= newPeriod(nd->nvv);
+  if(pp == NULL)
+      return -1;
+  pp->tim= bd->tim;
+  pp->fi= bd->fi;
+  pp->fo= bd->fo;
+  pp->src= bd;
+      
+  memcpy(pp->v0, nd->vv, nd->nvv * sizeof(Voice));
+  memcpy(pp->v1, nd->vv, nd->nvv * sizeof(Voice));
+  if (n_ch < nd->nvv) n_ch= nd->nvv;
+
+  if (!per)
+    per= pp->nxt= pp->prv= pp;
+  else {
+    pp->nxt= per; pp->prv= per->prv;
+    pp->prv->nxt= pp->nxt->prv= pp;
+  }
+
+  // Automatically add a transitional period
+  pp= newPeriod(0);
+  if(pp == NULL)
+      return -1;
+  pp->fi= -2;		// Unspecified transition
+  pp->src= bd;
+  pp->nxt= per; pp->prv= per->prv;
+  pp->prv->nxt= pp->nxt->prv= pp;
+
+  if (bd->slide) {
+    pp->fi= -3;		// Special '->' transition
+    pp->tim= bd->tim;
+  }
+  return 0;
+}
+
+//
+//	Expand block nd down to voice-sets, with times relative to the
+//	start of the block.  The result is kept in nd->flat and reused
+//	until a new name is defined, as that may change what the names
+//	used in the block refer to.  Each entry is charged to parse_mem,
+//	and a block that would give more periods than a sequence may have
+//	fails as it is built, before nesting multiplies it any further.
+//
+
+static BlockDef *
+flattenBlock(NameDef *nd, int depth) {
+  BlockDef *bd, *sub, *fb, **prvp;
+  NameDef *ref;
+  int n= 0;
+
+  if (nd->flat && nd->flat_list == nlist)
+    return nd->flat;
+  free_blockdefs(nd->flat);
+  nd->flat= 0;
+  nd->flat_list= 0;		// Not a valid memo while being built
+  if (depth >= MAX_BLOCK_DEPTH) {
+    error("Blocks nested too deeply (maximum %d), line %d:\n  %s",
+	  MAX_BLOCK_DEPTH, in_lin, lin_copy);
+    return 0;
+  }
+
+  prvp= &nd->flat;
+  for (bd= nd->blk; bd; bd= bd->nxt) {
+    if (!(ref= findName(bd->name)))
+      goto fail;
+    if (ref->blk) {
+      if (!(sub= flattenBlock(ref, depth + 1)))
+	goto fail;
+    } else
+      sub= bd;
+    for (; sub; sub= ref->blk ? sub->nxt : 0) {
+      if (2 * ++n > MAX_PERIODS) {
+	error("Too many periods (maximum %d), line %d", MAX_PERIODS, in_lin);
+	goto fail;
+      }
+      if (parseWork(1) < 0 ||
+	  !(fb= (BlockDef*)Alloc(sizeof(*fb))))
+	goto fail;
+      parse_mem += sizeof(*fb);
+      *prvp= fb; prvp= &fb->nxt;
+      fb->fi= sub->fi;
+      fb->fo= sub->fo;
+      fb->slide= sub->slide;
+      if (ref->blk) {
+	fb->tim= (bd->tim + sub->tim) % H24;
+	fb->nd= sub->nd;
+      } else {
+	fb->tim= bd->tim;
+	fb->nd= ref;
+      }
+    }
+  }
+  nd->flat_list= nlist;
+  return nd->flat;
+
+ fail:
+  free_blockdefs(nd->flat);
+  nd->flat= 0;
+  return 0;
+}
+
+//
+//	Record in *prvpp a voice-set started by time line st, for
+//	addPeriod()
+//
+
+static int
+addTimed(Stmt *st, BlockDef ***prvpp, int tim, int fi, int fo, NameDef *nd,
+	 int slide) {
+  BlockDef *bd;
+
+  if (slide < 0) {
+    badSeq();
+    return -1;
+  }
+  if (2 * ++n_timed > MAX_PERIODS) {
+    error("Too many periods (maximum %d), line %d", MAX_PERIODS, in_lin);
+    return -1;
+  }
+  if (!(bd= (BlockDef*)aAlloc(&parse_arena, sizeof(*bd))))
+    return -1;
+  bd->tim= tim;
+  bd->fi= fi;
+  bd->fo= fo;
+  bd->nd= nd;
+  bd->slide= slide;
+  bd->first= 0;
+  **prvpp= bd;
+  *prvpp= &bd->nxt;
+  st->nt++;
+  if (st->nch < nd->nvv) st->nch= nd->nvv;
+  return 0;
+}
+
+//
+//	Read a time-line of either type into *st
+//
+
+static int
+readTimeLine(Stmt *st) {
+  char *p;
+  int fo, fi;
+  NameDef *nd;
+  int tim;
+  BlockDef **prvp= &st->tl;
+
+  if (!(p= getWord())) {
+      badSeq();
+      return -1;
+  }
+  st->rel= *p == '+';
+  st->abs0= last_abs_time;
+  if (readLineTime(p, &tim) < 0)
+      return -1;
+  st->abs1= last_abs_time;
+  st->tim0= st->tim1= tim;
+      
+  if (!(p= readFadeName(&fi, &fo)))
+      return -1;
+  if (!(nd= findName(p)))
+      return -1;
+  st->nd= nd;
+
+  // Check for block name-def
+  if (nd->blk) {
+    BlockDef *bd= flattenBlock(nd, 0);
+
+    if (!bd)
+      return -1;
+    for (; bd; bd= bd->nxt) {
+      int t= (tim + bd->tim) % H24;
+      st->tim1= t;
+      if (parseWork(1) < 0 ||
+	  addTimed(st, &prvp, t, bd->fi, bd->fo, bd->nd, bd->slide) < 0)
+	return -1;
+    }
+    return 0;
+  }
+      
+  // Normal name-def
+  p= getWord();
+  return addTimed(st, &prvp, tim, fi, fo, nd, p ? strcmp(p, "->") ? -1 : 1 : 0);
+}
+
+static int
+readTime(char *p, int *timp) {		// Rets chars consumed, or 0 error
+  int nn, hh, mm, ss;
+
+  if (3 > sscanf(p, "%2d:%2d:%2d%n", &hh, &mm, &ss, &nn)) {
+    ss= 0;
+    if (2 > sscanf(p, "%2d:%2d%n", &hh, &mm, &nn)) return 0;
+  }
+
+  if (hh < 0 || hh >= 24 ||
+      mm < 0 || mm >= 60 ||
+      ss < 0 || ss >= 60) return 0;
+
+  *timp= ((hh * 60 + mm) * 60 + ss) * 1000;
+  return nn;
+}
+
+//
+//	Takes a set of points and repeats them twice, inverting the
+//	second set, and then interpolates them using a periodic sinc
+//	function (see http://www-ccrma.stanford.edu/~jos/resample/)
+//	and writes them to arr[] in the same format as the sin_table[].
+//
+
+static int sinc_interpolate(double *dp, int np, int *arr) {
+   double *sinc;	// Temporary sinc-table
+   double *out;		// Temporary output table
+   int a, b;
+   double dmax, dmin;
+   double adj, off;
+
+   // Generate a modified periodic sin(x)/x function to be used for
+   // each of the points.  Really this should be sin(x)/x modified
+   // by the sum of an endless series.  However, this doesn't
+   // converge very quickly, so to save time I'm approximating this
+   // series by 1-4*t*t where t ranges from 0 to 0.5 over the first
+   // half of the periodic cycle.  If you do the maths, this is at
+   // most 5% out.  This will have to do - it's smooth, and I don't
+   // know enough maths to make this series converge quicker.
+   sinc= (double *)Alloc(ST_SIZ * sizeof(double));
+   if(sinc == NULL)
+       return -1;
+   sinc[0]= 1.0;
+   for (a= ST_SIZ/2; a>0; a--) {
+      double tt= a * 1.0 / ST_SIZ;
+      double t2= tt*tt;
+      double adj= 1 - 4 * t2;
+      double xx= 2 * np * 3.14159265358979323846 * tt;
+      double vv= adj * sin(xx) / xx;
+      sinc[a]= vv;
+      sinc[ST_SIZ-a]= vv;
+   }
+   
+   // Build waveform into buffer
+   out= (double *)Alloc(ST_SIZ * sizeof(double));
+   if(out == NULL) {
+       free(sinc);
+       return -1;
+   }
+   for (b= 0; b<np; b++) {
+      int off= b * ST_SIZ / np / 2;
+      double val= dp[b];
+      for (a= 0; a<ST_SIZ; a++) {
+	 out[(a + off)&(ST_SIZ-1)] += sinc[a] * val;
+	 out[(a + off + ST_SIZ/2)&(ST_SIZ-1)] -= sinc[a] * val;
+      }
+   }
+
+   // Look for maximum for normalization
+   dmax= dmin= 0;
+   for (a= 0; a<ST_SIZ; a++) {
+      if (out[a] > dmax) dmax= out[a];
+      if (out[a] < dmin) dmin= out[a];
+   }
+
+   // Write out to output buffer
+   off= -0.5 * (dmax + dmin);
+   adj= ST_AMP / ((dmax - dmin) / 2);
+   for (a= 0; a<ST_SIZ; a++)
+      arr[a]= (int)((out[a] + off) * adj);
+
+   free(sinc);
+   free(out);
+   return 0;
+}
+
+// END //
+
+/*
+ * Output backends.
+ *
+ * The samples go to writeOut(), as provided by the build mode, unless
+ * the host selects one of the backends below at run time. Each backend
+ * states the block size it prefers, in frames (0 to follow the -R rate),
+ * and the sample format it takes.
+ */
+
+enum { OUT_DEFAULT, OUT_NULL, OUT_MEMORY, OUT_FD, OUT_WAV, OUT_CALLBACK };
+
+static struct Output {
+    int kind;			// OUT_*
+    int block;			// Preferred block size in frames, or 0
+    int format;			// SBAGEN_FMT_*
+    int fd;			// OUT_FD, OUT_WAV
+    uint64_t data_size;		// OUT_WAV: octets of samples written
+    char *mem;			// OUT_MEMORY: buffer
+    size_t mem_size, mem_alloc;
+    int (*write)(void *opaque, char *buf, int size); // OUT_CALLBACK
+    void *opaque;
+} output;
+
+static void
+put_le(uchar *p, uint64_t v, int n)
+{
+    while(n-- > 0) {
+	*(p++) = v;
+	v >>= 8;
+    }
+}
+
+#define WAV_HEADER 80		// Octets before the samples
+
+/*
+ * Write the RIFF header for data_size octets of samples at the start of
+ * the WAV file. A JUNK chunk keeps room for the ds64 chunk of RF64 (EBU
+ * Tech 3306), which the header turns into once the sizes no longer fit
+ * in 32 bits, after about 6.8 hours of 16-bit output at 44.1 kHz.
+ */
+static int
+wav_header(int fd, uint64_t data_size)
+{
+    uchar h[WAV_HEADER];
+    int bps = fmtBytes(output.format);
+    uint64_t riff = WAV_HEADER - 8 + data_size;
+    int rf64 = riff > 0xFFFFFFFF;
+
+    memset(h, 0, sizeof(h));
+    memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+    put_le(h + 4, rf64 ? 0xFFFFFFFF : riff, 4);
+    memcpy(h + 8, rf64 ? "WAVEds64" : "WAVEJUNK", 8);
+    put_le(h + 16, 28, 4);
+    if(rf64) {
+	put_le(h + 20, riff, 8);
+	put_le(h + 28, data_size, 8);
+	put_le(h + 36, data_size / bps, 8);	// Frames
+    }
+    memcpy(h + 48, "fmt ", 4);
+    put_le(h + 52, 16, 4);
+    put_le(h + 56, output.format == SBAGEN_FMT_F32 ? 3 : 1, 2); // Float or PCM
+    put_le(h + 58, 2, 2);		// Stereo
+    put_le(h + 60, out_rate, 4);
+    put_le(h + 64, out_rate * bps, 4);
+    put_le(h + 68, bps, 2);
+    put_le(h + 70, bps * 4, 2);
+    memcpy(h + 72, "data", 4);
+    put_le(h + 76, rf64 ? 0xFFFFFFFF : data_size, 4);
+    if(pwrite(fd, h, sizeof(h), 0) != sizeof(h)) {
+	error("WAV header: %s", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+static int
+fd_write(int fd, char *buf, int siz)
+{
+    int rv;
+
+    while((rv = write(fd, buf, siz)) != -1) {
+	if((siz -= rv) == 0)
+	    return 0;
+	buf += rv;
+    }
+    error("Output error: %s", strerror(errno));
+    return -1;
+}
+
+/*
+ * Send a block of samples to the selected output.
+ */
+static int
+outWrite(char *buf, int siz)
+{
+    char *nm;
+
+    switch(output.kind) {
+	case OUT_NULL:
+	    return 0;
+	case OUT_MEMORY:
+	    if(output.mem_size + siz > output.mem_alloc) {
+		size_t na = output.mem_alloc ? output.mem_alloc : 1 << 16;
+
+		while(na < output.mem_size + siz)
+		    na *= 2;
+		if((nm = realloc(output.mem, na)) == NULL) {
+		    error("Out of memory");
+		    return -1;
+		}
+		output.mem = nm;
+		output.mem_alloc = na;
+	    }
+	    memcpy(output.mem + output.mem_size, buf, siz);
+	    output.mem_size += siz;
+	    return 0;
+	case OUT_FD:
+	    return fd_write(output.fd, buf, siz);
+	case OUT_WAV:
+	    if(fd_write(output.fd, buf, siz) < 0)
+		return -1;
+	    output.data_size += siz;
+	    return 0;
+	case OUT_CALLBACK:
+	    return output.write(output.opaque, buf, siz);
+	default:
+	    return writeOut(buf, siz);
+    }
+}
+
+static int
+outFormat(void)
+{
+    return output.format;
+}
+
+/*
+ * Octets per frame of format, 0 if it is not one.
+ */
+static int
+fmtBytes(int format)
+{
+    switch(format & ~SBAGEN_FMT_PLANAR) {
+	case SBAGEN_FMT_S16:
+	    return 4;
+	case SBAGEN_FMT_S24:
+	    return 6;
+	case SBAGEN_FMT_F32:
+	    return 8;
+    }
+    return 0;
+}
+
+/*
+ * Called at the end of each sbagen_run.
+ */
+static int
+outEnd(void)
+{
+    if(output.kind == OUT_WAV)
+	return wav_header(output.fd, output.data_size);
+    return 0;
+}
+
+static void
+outClose(void)
+{
+    if(output.kind == OUT_WAV)
+	close(output.fd);
+    free(output.mem);
+    memset(&output, 0, sizeof(output));
+}
+
+/*
+ * Number of samples (twice the frames) between parameter updates.
+ */
+static int
+ctlBlockLen(void)
+{
+    int blen;
+
+    blen = out_rate * 2 / out_prate;		// 10 updates a second by default
+    while (blen & (blen-1)) blen &= blen-1;	// Make power of two
+    return blen;
+}
+
+/*
+ * Write block sizes. Without sbagen_set_blocks() every block holds
+ * exactly one parameter update period. Otherwise the size is chosen
+ * before each block, in the render thread, from the mode and from what
+ * the consumer reports: blk_min, doubled for each recent underrun,
+ * while interactive, and blk_max when not, but never more than half the
+ * latency of the consumer so that it always holds a block in advance.
+ * The reports are plain volatile stores, any thread can make them.
+ */
+
+static int blk_min, blk_max;		// Range of write blocks (frames)
+static volatile int blk_mode;		// SBAGEN_MODE_*
+static volatile int blk_latency;	// Consumer latency (frames), 0 if unknown
+static volatile int blk_underruns;	// Consumer underrun count
+static int blk_level;			// Doublings of blk_min after underruns
+static int blk_seen;			// Underruns already accounted for
+static int blk_calm;			// Frames written since the last underrun
+
+#define BLK_CALM_SECS 10		// Halve back after this long without underrun
+
+/*
+ * Length of the largest write block in samples.
+ */
+static int
+outBlockLen(void)
+{
+    if(output.block > 0)
+	return output.block * 2;
+    if(blk_max > 0)
+	return blk_max * 2;
+    return ctlBlockLen();
+}
+
+static void
+blockReset(void)
+{
+    blk_level = 0;
+    blk_seen = blk_underruns;
+    blk_calm = 0;
+}
+
+/*
+ * Length of the next write block in samples.
+ */
+static int
+nextBlockLen(void)
+{
+    int blk, lat, u = blk_underruns;
+
+    if(output.block > 0)
+	return output.block * 2;
+    if(blk_max == 0)
+	return out_blen;
+    if(u != blk_seen) {
+	blk_seen = u;
+	blk_calm = 0;
+	if((blk_min << blk_level) < blk_max)
+	    blk_level++;
+    } else if(blk_level > 0 && blk_calm > out_rate * BLK_CALM_SECS) {
+	blk_calm = 0;
+	blk_level--;
+    }
+    blk = blk_mode == SBAGEN_MODE_BACKGROUND ? blk_max :
+	blk_min << blk_level;
+    lat = blk_latency / 2;
+    if(lat > 0 && blk > lat)
+	blk = lat;
+    if(blk > blk_max)
+	blk = blk_max;
+    if(blk < blk_min)
+	blk = blk_min;
+    blk_calm += blk;
+    return blk * 2;
+}
+
+/*
+ * Playback clock. The render thread publishes how far it got and when
+ * the last periods started, the consumer how far it played, each in
+ * its own structure behind a sequence number that is odd while it is
+ * being written: sbagen_get_clock() copies them until it gets the same
+ * even number before and after, so that it never waits for the render
+ * thread nor holds it up.
+ */
+
+#define CLK_PERS 16			// Period starts kept, a power of two
+
+struct Clock {
+    S64 rendered;			// Frames handed to the output
+    S64 frame0;				// Frames of the sequence before them
+    int tim0;				// Sequence time of frame 0 (ms)
+    int running;			// sbagen_run has not returned
+    int run;				// Number of the sbagen_run
+    int pers;				// Periods started since frame 0
+    S64 per_frame[CLK_PERS];		// Frame where each of the last began
+    int per_start[CLK_PERS];		//  :: its bounds, ms from tim0
+    int per_end[CLK_PERS];
+};
+
+struct Played {
+    S64 frames;				// As reported
+    S64 at;				// CLOCK_MONOTONIC when reported (ns)
+    int playing;
+    int run;				// Clock.run it is about
+};
+
+static struct Clock clk;
+static volatile unsigned clk_seq;
+static struct Played clk_played;
+static volatile unsigned clk_played_seq;
+static Period *clk_per;			// Period of the last clockPeriod()
+
+static void
+seqBegin(volatile unsigned *seq)
+{
+    (*seq)++;
+    __sync_synchronize();
+}
+
+static void
+seqEnd(volatile unsigned *seq)
+{
+    __sync_synchronize();
+    (*seq)++;
+}
+
+static void
+seqRead(volatile unsigned *seq, const void *src, void *dst, size_t size)
+{
+    unsigned s;
+
+    do {
+	while((s = *seq) & 1);
+	__sync_synchronize();
+	memcpy(dst, src, size);
+	__sync_synchronize();
+    } while(*seq != s);
+}
+
+static S64
+clockNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (S64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Start the clock of a new sbagen_run, at the current period, frame0
+ * frames into the sequence; the frames given to clockPeriod() and
+ * clockRendered() count from the start of the sequence too.
+ */
+static void
+clockStart(S64 frame0)
+{
+    seqBegin(&clk_seq);
+    clk.rendered = 0;
+    clk.frame0 = frame0;
+    clk.tim0 = fast_tim0;
+    clk.running = 1;
+    clk.run++;
+    clk.pers = 0;
+    seqEnd(&clk_seq);
+    clk_per = 0;
+    clockPeriod(frame0);
+}
+
+/*
+ * Record that the period play.per starts being rendered at frame.
+ */
+static void
+clockPeriod(S64 frame)
+{
+    Period *pp = play.per;
+    int i = clk.pers & (CLK_PERS - 1);
+    int t = frame * 1000 / out_rate;
+    int t0 = t - t_per0(pp->tim, (clk.tim0 + t) % H24);
+
+    if(pp == clk_per)
+	return;
+    clk_per = pp;
+    seqBegin(&clk_seq);
+    clk.per_frame[i] = frame - clk.frame0;
+    clk.per_start[i] = t0 > 0 ? t0 : 0;
+    clk.per_end[i] = t0 + t_per24(pp->tim, pp->nxt->tim);
+    clk.pers++;
+    seqEnd(&clk_seq);
+}
+
+/*
+ * Record that frames were handed to the output in all.
+ */
+static void
+clockRendered(S64 frames)
+{
+    seqBegin(&clk_seq);
+    clk.rendered = frames - clk.frame0;
+    seqEnd(&clk_seq);
+}
+
+static void
+clockStop(void)
+{
+    seqBegin(&clk_seq);
+    clk.running = 0;
+    seqEnd(&clk_seq);
+}
+
+/*
+ * Mix input.
+ *
+ * The file is mapped whole and mixChunk() reads its samples from there;
+ * mixFetch() asks the kernel to read it ahead of the render position.
+ */
+
+static uint32_t
+get_le(const uchar *p, int n)
+{
+    uint32_t v = 0;
+
+    while(n-- > 0)
+	v = v << 8 | p[n];
+    return v;
+}
+
+/*
+ * Finds the samples of the WAV file of size octets at p: sets the
+ * format of the mix input and returns their offset, or -1.
+ */
+static long
+wav_parse(const uchar *p, size_t size, size_t *len)
+{
+    size_t off = 12, cl;
+    int fmt = 0, tag;
+
+    if(size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4))
+	return -1;
+    while(off + 8 <= size) {
+	cl = get_le(p + off + 4, 4);
+	if(memcmp(p + off, "fmt ", 4) == 0 && cl >= 16 && off + 24 <= size) {
+	    tag = get_le(p + off + 8, 2);
+	    if(tag == 0xFFFE && cl >= 26 && off + 34 <= size)
+		tag = get_le(p + off + 32, 2);	// Extensible: subformat
+	    mix_chans = get_le(p + off + 10, 2);
+	    mix_rate = get_le(p + off + 12, 4);
+	    fmt = tag == 1 && get_le(p + off + 22, 2) == 16 &&
+		(mix_chans == 1 || mix_chans == 2) && mix_rate > 0;
+	} else if(memcmp(p + off, "data", 4) == 0) {
+	    if(!fmt || (off & 1))
+		return -1;
+	    *len = cl < size - off - 8 ? cl : size - off - 8;
+	    return off + 8;
+	}
+	if(cl > size - off - 8)		// Past the end; off would wrap around
+	    break;
+	off += 8 + cl + (cl & 1);
+    }
+    return -1;
+}
+
+int
+sbagen_set_mix(const char *path)
+{
+    struct stat st;
+    size_t len;
+    long off;
+    void *p;
+    int fd;
+
+    if(running) {
+	error("Cannot change the mix input while rendering");
+	return -1;
+    }
+    if(mix_map != NULL)
+	munmap(mix_map, mix_map_len);
+    mix_map = NULL;
+    mix_data = NULL;
+    mix_frames = 0;
+    if(path == NULL)
+	return 0;
+    if((fd = open(path, O_RDONLY)) < 0) {
+	error("Cannot open %s: %s", path, strerror(errno));
+	return -1;
+    }
+    p = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+	error("Cannot map %s", path);
+	return -1;
+    }
+    if(st.st_size >= 4 && memcmp(p, "RIFF", 4) == 0) {
+	if((off = wav_parse(p, st.st_size, &len)) < 0) {
+	    munmap(p, st.st_size);
+	    error("%s: not a 16-bit PCM WAV file", path);
+	    return -1;
+	}
+    } else {
+	off = 0;
+	len = st.st_size;
+	mix_chans = 2;
+	mix_rate = 0;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    mix_map = p;
+    mix_map_len = st.st_size;
+    mix_data = (const short *)((char *)p + off);
+    mix_frames = len / (2 * mix_chans);
+    return 0;
+}
+
+/*
+ * Rendered output cache.
+ *
+ * Each cache file holds the output of sbagen_run() for one sequence text
+ * and set of parameters, identified by a 64-bit FNV-1a hash of both. It
+ * starts with a header giving that key and the length of the samples,
+ * and ends with the hash of each CACHE_BLOCK of them, the header holding
+ * the hash of that table. The file is mapped CACHE_WINDOW at a time, so
+ * that sessions of several GB replay on 32-bit targets too, and each
+ * block is checked as it is about to be played rather than the whole
+ * file up front. Files are written under a temporary name while
+ * rendering and renamed once complete, for outputs of known length that
+ * fit in the size limit; the least recently used ones are removed to
+ * stay within it.
+ */
+
+#define CACHE_MAGIC "SBGPCM02"
+#define CACHE_BLOCK (1 << 20)		// Octets of samples per hash
+#define CACHE_WINDOW (8 << 20)		// Octets mapped at once, in blocks
+
+struct Cache_header {
+    char magic[8];
+    uint64_t key;
+    uint64_t size;		// Length of the samples in octets
+    uint64_t sum;		// Hash of the table of block hashes
+};
+
+static char *cache_tmp;		// Name of the cache file being written
+static uint64_t cache_sum;	// Running hash of the current block
+static uint64_t cache_size;	// Octets written so far
+static uint64_t cache_expect;	// Octets the output will have
+static uint64_t *cache_sums;	// Hash of each block written
+
+static uint64_t
+fnv1a(const void *data, size_t size, uint64_t h)
+{
+    const uchar *p = data, *e = p + size;
+
+    while(p < e)
+	h = (h ^ *(p++)) * 0x100000001B3ULL;
+    return h;
+}
+
+static uint64_t
+cache_key(void)
+{
+    uint64_t h = fnv1a(CACHE_MAGIC VERSION, sizeof(CACHE_MAGIC VERSION),
+	seq_hash);
+
+    h = fnv1a(&out_rate, sizeof(out_rate), h);
+    h = fnv1a(&out_prate, sizeof(out_prate), h);
+    h = fnv1a(&fade_int, sizeof(fade_int), h);
+    h = fnv1a(&opt_c, sizeof(opt_c), h);
+    h = fnv1a(&output.format, sizeof(output.format), h);
+    h = fnv1a(&osc_kernel, sizeof(osc_kernel), h);
+    return fnv1a(ampadj, opt_c * sizeof(*ampadj), h);
+}
+
+static char *
+cache_path(uint64_t key, const char *suffix)
+{
+    char *p = Alloc(strlen(cache_dir) + strlen(suffix) + 20);
+
+    if(p != NULL)
+	sprintf(p, "%s/%016llx%s", cache_dir, (unsigned long long)key,
+	    suffix);
+    return p;
+}
+
+/*
+ * Plays the cached output for key if there is a valid one.
+ * Returns 1 if played, 0 if not cached, -1 if writeOut failed, 2 if
+ * loop() is to render from cache_stop frames on without caching: after
+ * a reload from writeOut changed the sequence, or when the rest of the
+ * file cannot be read. Only a file that is not what it should be is
+ * removed, not one that fails to open or map. A reload leaves play.per
+ * in the new ring.
+ */
+static int
+cache_play(uint64_t key)
+{
+    struct Cache_header h;
+    struct stat st;
+    uint64_t hash = seq_hash;
+    uint64_t *sums = NULL, off, blk, nblk, checked = 0, b0, wbeg = 0, wend = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t wlen = 0, delta = 0;
+    char *path, *win = MAP_FAILED;
+    off_t foff;
+    int fd, r = 0, bps;
+
+    if((path = cache_path(key, ".pcm")) == NULL)
+	return 0;
+    if((fd = open(path, O_RDONLY)) < 0) {
+	free(path);
+	return 0;
+    }
+    if(fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) < 0)
+	goto unreadable;
+    if(st.st_size < (off_t)sizeof(h) ||
+	memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0 || h.key != key)
+	goto invalid;
+    nblk = (h.size + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    if(h.size > (uint64_t)st.st_size ||
+	(uint64_t)st.st_size != sizeof(h) + h.size + nblk * sizeof(*sums))
+	goto invalid;
+    if((sums = Alloc(nblk * sizeof(*sums) + 1)) == NULL)
+	goto unreadable;
+    if(pread(fd, sums, nblk * sizeof(*sums), sizeof(h) + h.size) !=
+	(ssize_t)(nblk * sizeof(*sums)))
+	goto unreadable;
+    if(fnv1a(sums, nblk * sizeof(*sums), FNV_INIT) != h.sum)
+	goto invalid;
+    utimes(path, NULL);		// Mark as recently used
+    out_blen = ctlBlockLen();	// For nextBlockLen(), set up by loop() otherwise
+    bps = fmtBytes(output.format);
+    blockReset();
+    run_tim0 = fast_tim0;
+    play.per = seekPeriod(per, run_tim0);
+    clockStart(0);
+    running = 3;
+    for(off = 0; off < h.size && r == 0; off += blk) {
+	blk = nextBlockLen() / 2 * bps;
+	if(blk > CACHE_BLOCK)
+	    blk = CACHE_BLOCK / bps * bps;
+	if(blk > h.size - off)
+	    blk = h.size - off;
+
+	// Map the window of whole blocks the write block starts in, and
+	// check the blocks it reaches into
+	if(off + blk > wend) {
+	    if(win != MAP_FAILED)
+		munmap(win, wlen + delta);
+	    wbeg = off / CACHE_BLOCK * CACHE_BLOCK;
+	    wlen = h.size - wbeg < CACHE_WINDOW ? h.size - wbeg : CACHE_WINDOW;
+	    foff = sizeof(h) + wbeg;
+	    delta = foff % page;
+	    win = mmap(NULL, wlen + delta, PROT_READ, MAP_SHARED, fd,
+		foff - delta);
+	    if(win == MAP_FAILED) {
+		cache_stop = off / bps;
+		r = 2;
+		break;
+	    }
+	    madvise(win, wlen + delta, MADV_SEQUENTIAL);
+	    wend = wbeg + wlen;
+	}
+	for(; checked * CACHE_BLOCK < off + blk; checked++) {
+	    b0 = checked * CACHE_BLOCK;
+	    if(fnv1a(win + delta + (b0 - wbeg), h.size - b0 < CACHE_BLOCK ?
+		h.size - b0 : CACHE_BLOCK, FNV_INIT) != sums[checked])
+		break;
+	}
+	if(checked * CACHE_BLOCK < off + blk) {
+	    unlink(path);	// Damaged: render the rest instead
+	    cache_stop = off / bps;
+	    r = 2;
+	    break;
+	}
+
+	// Only sought while the sequence is the one replayed; a reload
+	// leaves play.per at the start of its ring
+	play.per = seekPeriod(play.per, (run_tim0 + (int)(off / bps * 1000 /
+	    out_rate)) % H24);
+	clockPeriod(off / bps);
+	clockRendered((off + blk) / bps);
+	TRACE_BEGIN("writeOut");
+	r = outWrite(win + delta + (off - wbeg), blk);
+	TRACE_END("writeOut");
+	if(seq_hash != hash && r == 0) {
+	    if(per == NULL) {
+		error("The sequence was freed while playing");
+		r = -1;
+	    } else {
+		cache_stop = (off + blk) / bps;
+		r = 2;
+	    }
+	}
+    }
+    running = 0;
+    if(win != MAP_FAILED)
+	munmap(win, wlen + delta);
+    close(fd);
+    free(sums);
+    free(path);
+    if(r == 2)
+	return 2;
+    clockStop();
+    return r < 0 ? -1 : 1;
+
+unreadable:
+    close(fd);
+    free(sums);
+    free(path);
+    cache_stop = 0;
+    return 2;
+
+invalid:
+    close(fd);
+    unlink(path);
+    free(sums);
+    free(path);
+    return 0;
+}
+
+/* Drops the cache file being written. */
+static void
+cache_drop(void)
+{
+    close(cache_fd);
+    cache_fd = -1;
+    unlink(cache_tmp);
+}
+
+static void
+cacheWrite(char *data, int size)
+{
+    uint64_t n;
+
+    if(cache_size + size > cache_expect) {
+	cache_drop();
+	return;
+    }
+    if(write(cache_fd, data, size) != size) {
+	cache_drop();
+	return;
+    }
+    for(; size > 0; size -= n, data += n) {
+	n = CACHE_BLOCK - cache_size % CACHE_BLOCK;
+	if(n > (uint64_t)size)
+	    n = size;
+	cache_sum = fnv1a(data, n, cache_sum);
+	cache_size += n;
+	if(cache_size % CACHE_BLOCK == 0) {
+	    cache_sums[cache_size / CACHE_BLOCK - 1] = cache_sum;
+	    cache_sum = FNV_INIT;
+	}
+    }
+}
+
+/*
+ * Starts writing the output of the run about to start to the cache, if
+ * it has a length known in advance and the file would fit the limit.
+ */
+static void
+cache_begin(uint64_t key)
+{
+    struct Cache_header h;
+    char suffix[24];
+    int len = t_per0(fast_tim0, fast_tim1);
+    uint64_t nblk;
+
+    if(len == 0)		// Endless
+	return;
+    cache_expect = fmtBytes(output.format) * (S64)(len * 0.001 * out_rate);
+    nblk = (cache_expect + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    if(sizeof(h) + cache_expect + nblk * sizeof(*cache_sums) >
+	(uint64_t)cache_max)
+	return;
+    sprintf(suffix, ".tmp%d", (int)getpid());
+    if((cache_sums = Alloc(nblk * sizeof(*cache_sums) + 1)) == NULL ||
+	(cache_tmp = cache_path(key, suffix)) == NULL)
+	goto fail;
+    memset(&h, 0, sizeof(h));
+    if((cache_fd = open(cache_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+	goto fail;
+    if(write(cache_fd, &h, sizeof(h)) != sizeof(h)) {
+	cache_drop();
+	goto fail;
+    }
+    cache_sum = FNV_INIT;
+    cache_size = 0;
+    return;
+
+fail:
+    free(cache_sums);
+    cache_sums = NULL;
+    free(cache_tmp);
+    cache_tmp = NULL;
+}
+
+struct Cache_entry {
+    char *name;
+    off_t size;
+    time_t mtime;
+};
+
+static int
+cache_cmp_entries(const void *a, const void *b)
+{
+    time_t ta = ((const struct Cache_entry *)a)->mtime;
+    time_t tb = ((const struct Cache_entry *)b)->mtime;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Removes the least recently used cache files beyond cache_max. */
+static void
+cache_trim(void)
+{
+    struct Cache_entry *e = NULL, *ne;
+    struct dirent *de;
+    struct stat st;
+    char *path;
+    int n = 0, a = 0, i;
+    off_t total = 0;
+    DIR *d;
+
+    if((d = opendir(cache_dir)) == NULL)
+	return;
+    while((de = readdir(d)) != NULL) {
+	size_t l = strlen(de->d_name);
+	if(l != 20 || strcmp(de->d_name + 16, ".pcm") != 0)
+	    continue;
+	if((path = Alloc(strlen(cache_dir) + l + 2)) == NULL)
+	    break;
+	sprintf(path, "%s/%s", cache_dir, de->d_name);
+	if(stat(path, &st) < 0) {
+	    free(path);
+	    continue;
+	}
+	if(n == a) {
+	    a = a ? a * 2 : 16;
+	    if((ne = realloc(e, a * sizeof(*e))) == NULL) {
+		free(path);
+		break;
+	    }
+	    e = ne;
+	}
+	e[n].name = path;
+	e[n].size = st.st_size;
+	e[n].mtime = st.st_mtime;
+	total += st.st_size;
+	n++;
+    }
+    closedir(d);
+    qsort(e, n, sizeof(*e), cache_cmp_entries);
+    for(i = 0; i < n; i++) {
+	if(total > cache_max) {
+	    unlink(e[i].name);
+	    total -= e[i].size;
+	}
+	free(e[i].name);
+    }
+    free(e);
+}
+
+static void
+cache_end(uint64_t key, int ok)
+{
+    struct Cache_header h;
+    uint64_t nblk;
+    char *path;
+
+    if(cache_fd < 0)
+	goto done;
+    nblk = (cache_size + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    if(cache_size % CACHE_BLOCK)
+	cache_sums[nblk - 1] = cache_sum;
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.key = key;
+    h.size = cache_size;
+    h.sum = fnv1a(cache_sums, nblk * sizeof(*cache_sums), FNV_INIT);
+    if(ok && cache_size == cache_expect &&
+	write(cache_fd, cache_sums, nblk * sizeof(*cache_sums)) ==
+	(ssize_t)(nblk * sizeof(*cache_sums)) &&
+	pwrite(cache_fd, &h, sizeof(h), 0) == sizeof(h) &&
+	close(cache_fd) == 0 &&
+	(path = cache_path(key, ".pcm")) != NULL) {
+	if(rename(cache_tmp, path) < 0)
+	    unlink(cache_tmp);
+	free(path);
+	cache_trim();
+    } else {
+	close(cache_fd);
+	unlink(cache_tmp);
+    }
+    cache_fd = -1;
+done:
+    free(cache_tmp);
+    cache_tmp = NULL;
+    free(cache_sums);
+    cache_sums = NULL;
+}
+
+
+/*
+ * Checkpoints.
+ *
+ * A checkpoint is everything loop() changes as it renders, taken
+ * between two blocks: applied over the state a new loop() starts from,
+ * it gives the very samples the first one would have gone on with.
+ * The period is saved as the number of periods from the one the run
+ * started in, the rest as is.
+ */
+
+#define CKPT_MAGIC "SBGCKP01"
+
+struct Checkpoint {
+    char magic[8];
+    uint64_t key;		// ckptKey() of the sequence and parameters
+    uint64_t sum;		// fnv1a() of what follows
+    int size;			// Size of the whole checkpoint
+    int per_steps;		// Periods from seekPeriod(play.per, fast_tim0)
+    int now, now_lo, ctl_left, run_tim0;
+    S64 byte_count, byte_done;
+    int done;			// The run ended with the block
+    int rand0, rand1, seed, nt_off;
+    Noise ntbl[NS_BANDS];
+    int ns_hist[NS_HIST];	// Noise history, for spinning noise
+    uint64_t mix_pos;
+    int n_ch;
+    Channel chan[];
+};
+
+static uint64_t
+ckptKey(void)
+{
+    uint64_t h = fnv1a(CKPT_MAGIC, sizeof(CKPT_MAGIC), cache_key());
+
+    h = fnv1a(&fast_tim0, sizeof(fast_tim0), h);
+    h = fnv1a(&fast_tim1, sizeof(fast_tim1), h);
+    h = fnv1a(&n_ch, sizeof(n_ch), h);
+    h = fnv1a(&mix_frames, sizeof(mix_frames), h);
+    return fnv1a(&mix_rate, sizeof(mix_rate), h);
+}
+
+#define CKPT_SUM_OFF offsetof(struct Checkpoint, size)
+
+int
+sbagen_checkpoint(void *buf, int size)
+{
+    struct Checkpoint *c = buf;
+    int need = sizeof(*c) + n_ch * sizeof(Channel);
+    Period *pp;
+
+    if(running != 1 || out_pending == 0) {
+	error("Checkpoints are only taken from the output while rendering");
+	return -1;
+    }
+    if(seq_more || seq_reloaded) {
+	error("Cannot checkpoint a sequence still changing");
+	return -1;
+    }
+    if(size < need)
+	return need;
+    memset(c, 0, sizeof(*c));
+    memcpy(c->magic, CKPT_MAGIC, sizeof(c->magic));
+    c->key = ckptKey();
+    c->size = need;
+    for(pp = seekPeriod(play.per, fast_tim0); pp != play.per; pp = pp->nxt)
+	c->per_steps++;
+    c->now = now;
+    c->now_lo = now_lo;
+    c->ctl_left = ctl_left;
+    c->run_tim0 = run_tim0;
+    // Just after the block being written, as outChunk() counts it next
+    c->done = byte_count > 0 && byte_count <= out_pending;
+    c->byte_count = byte_count > 0 ? byte_count - out_pending : byte_count;
+    c->byte_done = byte_done + out_pending;
+    c->rand0 = rand0;
+    c->rand1 = rand1;
+    c->seed = seed;
+    c->nt_off = nt_off;
+    memcpy(c->ntbl, ntbl, sizeof(ntbl));
+    memcpy(c->ns_hist, ns_hist + ns_last, sizeof(c->ns_hist));
+    c->mix_pos = mix_pos;
+    c->n_ch = n_ch;
+    memcpy(c->chan, chan, n_ch * sizeof(Channel));
+    c->sum = fnv1a((char *)c + CKPT_SUM_OFF, need - CKPT_SUM_OFF, FNV_INIT);
+    return need;
+}
+
+int
+sbagen_restore(const void *data, int size)
+{
+    const struct Checkpoint *c = data;
+    Period *pp;
+    int n;
+
+    if(running) {
+	error("Cannot restore a checkpoint while rendering");
+	return -1;
+    }
+    if(per == NULL || seq_more) {
+	error("No complete sequence to restore the checkpoint to");
+	return -1;
+    }
+    if(size < (int)sizeof(*c) ||
+	memcmp(c->magic, CKPT_MAGIC, sizeof(c->magic)) != 0 ||
+	c->size != size || c->n_ch != n_ch ||
+	size != (int)(sizeof(*c) + n_ch * sizeof(Channel)) ||
+	fnv1a((char *)c + CKPT_SUM_OFF, size - CKPT_SUM_OFF, FNV_INIT) !=
+	c->sum) {
+	error("Invalid checkpoint");
+	return -1;
+    }
+    if(c->key != ckptKey()) {
+	error("The checkpoint is for another sequence or other parameters");
+	return -1;
+    }
+    for(n = 1, pp = per->nxt; pp != per; pp = pp->nxt)
+	n++;
+    if(c->per_steps < 0 || c->per_steps >= n || c->now < 0 ||
+	c->now > H24 || c->now_lo < 0 || c->now_lo >= 0x10000 ||
+	c->ctl_left < 0 || c->ctl_left & 1) {
+	error("Invalid checkpoint");
+	return -1;
+    }
+    free(ckpt);
+    if((ckpt = Alloc(size)) == NULL)
+	return -1;
+    memcpy(ckpt, c, size);
+    return 0;
+}
+
+/*
+ * Replaces the state loop() has just set up with the pending checkpoint.
+ * Returns 0 if the run had ended there, else 1.
+ */
+static int
+ckptApply(void)
+{
+    int done = ckpt->done;
+    struct Checkpoint *c = ckpt;
+    int i;
+
+    ckpt = NULL;
+    for(i = 0; i < c->per_steps; i++)
+	play.per = play.per->nxt;
+    now = c->now;
+    now_lo = c->now_lo;
+    ctl_left = c->ctl_left;
+    run_tim0 = c->run_tim0;
+    byte_count = c->byte_count;
+    byte_done = c->byte_done;
+    rand0 = c->rand0;
+    rand1 = c->rand1;
+    seed = c->seed;
+    nt_off = c->nt_off;
+    memcpy(ntbl, c->ntbl, sizeof(ntbl));
+    memcpy(ns_hist, c->ns_hist, sizeof(c->ns_hist));
+    ns_last = 0;
+    mix_pos = mix_cur = c->mix_pos;
+    mix_ahead = 0;
+    if(mix_data) {
+	mixSource(0);
+	mixFetch(outBlockLen() / 2);
+    }
+
+    // The channels as they were, and the voices of the period for the
+    // next update to slide from: now may already be in the next one
+    play.cur_per = play.per;
+    memcpy(play.v, play.per->v0, n_ch * sizeof(Voice));
+    for(i = 0; i < n_ch; i++)
+	if(play.v[i].typ == 4)
+	    spinClip(&play.v[i], play.clip);
+    memcpy(chan, c->chan, n_ch * sizeof(Channel));
+    chan_per = play.per;
+    free(c);
+    return !done;
+}
+
+
+/*
+ * Sequence library index.
+ *
+ * sbagen_index() keeps the entries of each directory it lists in an
+ * index file named after the hash of the directory path, with the
+ * modification time and size of each file when it was parsed. The
+ * directory is read again on each scan, but only the files that changed
+ * are read and parsed; reading is shared among several threads, as
+ * slow storage dominates, while parsing, which uses the global sequence,
+ * is done one file at a time under index_lock.
+ */
+
+#define INDEX_MAGIC "SBGIDX01"
+#define INDEX_MAX_FILE (4 << 20)	// Larger files are not sequences
+
+struct Index_header {
+    char magic[8];
+    uint32_t count;		// Number of entries
+    uint32_t dir_len;		// Length of the directory path that follows
+    uint64_t sum;		// Hash of everything after the header
+};
+
+struct Index_record {		// Followed by the name then the error
+    int64_t mtime, size;
+    int32_t duration, periods, channels, types;
+    float peak;
+    uint16_t name_len, error_len;
+};
+
+struct Index_scan {
+    const char *dir;
+    const char *pattern;
+    struct sbagen_entry *e;	// Entries being scanned; name 0 if dropped
+    int n;
+    int next;			// Next entry for a thread to take
+    struct sbagen_entry *old;	// Entries of the index file
+    int n_old;
+    int changed;		// Something differs from the index file
+};
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+index_cmp_entries(const void *a, const void *b)
+{
+    const char *na = ((const struct sbagen_entry *)a)->name;
+    const char *nb = ((const struct sbagen_entry *)b)->name;
+    int da = na[strlen(na) - 1] == '/', db = nb[strlen(nb) - 1] == '/';
+
+    return da != db ? db - da : strcmp(na, nb);
+}
+
+static char *
+index_path(const char *index, const char *dir)
+{
+    char *p = malloc(strlen(index) + 22);
+
+    if(p != NULL)
+	sprintf(p, "%s/%016llx.idx", index,
+	    (unsigned long long)fnv1a(dir, strlen(dir), FNV_INIT));
+    return p;
+}
+
+/*
+ * Reads the entries of the index file of dir. Returns their number, 0 if
+ * there is no valid index file.
+ */
+static int
+index_load(const char *index, const char *dir, struct sbagen_entry **entries)
+{
+    struct Index_header *h;
+    struct Index_record r;
+    struct sbagen_entry *e = NULL;
+    struct stat st;
+    char *path, *p, *end;
+    int fd, n = 0;
+
+    *entries = NULL;
+    if(index == NULL || (path = index_path(index, dir)) == NULL)
+	return 0;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+	return 0;
+    h = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*h))
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(h == MAP_FAILED)
+	return 0;
+    p = (char *)(h + 1);
+    end = (char *)h + st.st_size;
+    if(memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+	fnv1a(p, end - p, FNV_INIT) != h->sum ||
+	h->dir_len != strlen(dir) || h->dir_len > end - p ||
+	memcmp(p, dir, h->dir_len) != 0 ||
+	h->count > (end - p) / sizeof(r) ||
+	(e = calloc(h->count + 1, sizeof(*e))) == NULL)
+	goto done;
+    for(p += h->dir_len; n < (int)h->count; n++) {
+	if(end - p < (int)sizeof(r))
+	    break;
+	memcpy(&r, p, sizeof(r));
+	p += sizeof(r);
+	if(r.name_len == 0 || end - p < r.name_len + r.error_len ||
+	    (e[n].name = malloc(r.name_len + 1)) == NULL)
+	    break;
+	memcpy(e[n].name, p, r.name_len);
+	e[n].name[r.name_len] = 0;
+	p += r.name_len;
+	if(r.error_len > 0) {
+	    if((e[n].error = malloc(r.error_len + 1)) == NULL) {
+		n++;
+		break;
+	    }
+	    memcpy(e[n].error, p, r.error_len);
+	    e[n].error[r.error_len] = 0;
+	    p += r.error_len;
+	}
+	e[n].mtime = r.mtime;
+	e[n].size = r.size;
+	e[n].info.duration = r.duration;
+	e[n].info.periods = r.periods;
+	e[n].info.channels = r.channels;
+	e[n].info.types = r.types;
+	e[n].info.peak = r.peak;
+    }
+    if(n < (int)h->count) {	// Checked, but allocation failed
+	sbagen_free_index(e, n);
+	e = NULL;
+	n = 0;
+    }
+done:
+    munmap(h, st.st_size);
+    *entries = e;
+    return n;
+}
+
+/* Writes the index file of dir, under a temporary name then renamed. */
+static void
+index_save(const char *index, const char *dir, struct sbagen_entry *e, int n)
+{
+    struct Index_header h;
+    struct Index_record r;
+    static int serial;		// Scans of the same directory may overlap
+    char *path, *tmp, *buf, *p;
+    size_t size = strlen(dir);
+    int i, fd, ok;
+
+    for(i = 0; i < n; i++)
+	size += sizeof(r) + strlen(e[i].name) +
+	    (e[i].error ? strlen(e[i].error) : 0);
+    if((path = index_path(index, dir)) == NULL)
+	return;
+    tmp = malloc(strlen(path) + 32);
+    buf = malloc(size);
+    if(tmp == NULL || buf == NULL)
+	goto done;
+    p = buf + strlen(dir);
+    memcpy(buf, dir, p - buf);
+    for(i = 0; i < n; i++) {
+	memset(&r, 0, sizeof(r));
+	r.mtime = e[i].mtime;
+	r.size = e[i].size;
+	r.duration = e[i].info.duration;
+	r.periods = e[i].info.periods;
+	r.channels = e[i].info.channels;
+	r.types = e[i].info.types;
+	r.peak = e[i].info.peak;
+	r.name_len = strlen(e[i].name);
+	r.error_len = e[i].error ? strlen(e[i].error) : 0;
+	memcpy(p, &r, sizeof(r));
+	p += sizeof(r);
+	memcpy(p, e[i].name, r.name_len);
+	p += r.name_len;
+	memcpy(p, e[i].error, r.error_len);
+	p += r.error_len;
+    }
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.count = n;
+    h.dir_len = strlen(dir);
+    h.sum = fnv1a(buf, size, FNV_INIT);
+    sprintf(tmp, "%s.tmp%d.%d", path, (int)getpid(),
+	__sync_fetch_and_add(&serial, 1));
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+	goto done;
+    ok = write(fd, &h, sizeof(h)) == sizeof(h) &&
+	write(fd, buf, size) == (ssize_t)size;
+    if(close(fd) < 0 || !ok || rename(tmp, path) < 0)
+	unlink(tmp);
+done:
+    free(buf);
+    free(tmp);
+    free(path);
+}
+
+/* Returns the text of the file at path, of size octets, or NULL. */
+static char *
+index_read(const char *path, off_t size)
+{
+    char *buf;
+    ssize_t r;
+    off_t off = 0;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+	return NULL;
+    if((buf = malloc(size + 1)) != NULL) {
+	while(off < size && (r = read(fd, buf + off, size - off)) > 0)
+	    off += r;
+	buf[off] = 0;
+    }
+    close(fd);
+    return buf;
+}
+
+/* Fills e, whose name came from readdir; drops it if it is not listed. */
+static void
+index_entry(struct Index_scan *s, struct sbagen_entry *e)
+{
+    struct sbagen_entry *o = NULL;
+    struct sbagen_info info;
+    struct stat st;
+    char *path, *text, *n;
+    size_t l = strlen(e->name);
+
+    if((path = malloc(strlen(s->dir) + l + 2)) == NULL)
+	goto drop;
+    sprintf(path, "%s/%s", s->dir, e->name);
+    if(e->name[l - 1] != '/') {
+	if(stat(path, &st) < 0)
+	    goto drop;
+	if(S_ISDIR(st.st_mode)) {
+	    if((n = realloc(e->name, l + 2)) == NULL)
+		goto drop;
+	    strcpy(n + l, "/");
+	    e->name = n;
+	} else if(!S_ISREG(st.st_mode) || (s->pattern != NULL &&
+	    fnmatch(s->pattern, e->name, 0) != 0)) {
+	    goto drop;
+	}
+    }
+    if(s->n_old > 0)
+	o = bsearch(e, s->old, s->n_old, sizeof(*e), index_cmp_entries);
+    if(e->name[strlen(e->name) - 1] == '/') {
+	if(o == NULL) {
+	    pthread_mutex_lock(&index_lock);
+	    s->changed = 1;
+	    pthread_mutex_unlock(&index_lock);
+	}
+	free(path);
+	return;
+    }
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    if(o != NULL && o->mtime == e->mtime && o->size == e->size) {
+	e->info = o->info;
+	if(o->error != NULL && (e->error = strdup(o->error)) == NULL)
+	    goto drop;
+	free(path);
+	return;
+    }
+    memset(&info, 0, sizeof(info));
+    text = st.st_size > INDEX_MAX_FILE ? NULL : index_read(path, st.st_size);
+    pthread_mutex_lock(&index_lock);
+    s->changed = 1;
+    if(text == NULL)
+	e->error = strdup(st.st_size > INDEX_MAX_FILE ? "File too large" :
+	    "Cannot read file");
+    else if(sbagen_query(text, &info) < 0)
+	e->error = strdup(error_message);
+    sbagen_free_seq();
+    pthread_mutex_unlock(&index_lock);
+    e->info = info;
+    free(text);
+    free(path);
+    return;
+
+drop:
+    free(path);
+    free(e->name);
+    e->name = NULL;
+}
+
+static void *
+index_thread(void *arg)
+{
+    struct Index_scan *s = arg;
+    int i;
+
+    while(1) {
+	i = __sync_fetch_and_add(&s->next, 1);
+	if(i >= s->n)
+	    return NULL;
+	index_entry(s, s->e + i);
+    }
+}
+
+/*
+ * Reads the names in dir into s->e, directories with their trailing /
+ * when readdir tells, leaving out the files that do not match.
+ */
+static int
+index_readdir(struct Index_scan *s)
+{
+    struct sbagen_entry *ne;
+    struct dirent *de;
+    int a = 0;
+    DIR *d;
+
+    if((d = opendir(s->dir)) == NULL) {
+	error("Cannot open directory %s", s->dir);
+	return -1;
+    }
+    while((de = readdir(d)) != NULL) {
+	const char *dn = de->d_name;
+	int dir = 0;
+
+	if(strcmp(dn, ".") == 0 || strcmp(dn, "..") == 0)
+	    continue;
+#ifdef DT_DIR
+	if(de->d_type == DT_REG && s->pattern != NULL &&
+	    fnmatch(s->pattern, dn, 0) != 0)
+	    continue;
+	dir = de->d_type == DT_DIR;
+#endif
+	if(s->n == a) {
+	    a = a ? a * 2 : 64;
+	    if((ne = realloc(s->e, a * sizeof(*ne))) == NULL)
+		break;
+	    s->e = ne;
+	}
+	memset(s->e + s->n, 0, sizeof(*s->e));
+	if((s->e[s->n].name = malloc(strlen(dn) + 2)) == NULL)
+	    break;
+	sprintf(s->e[s->n++].name, dir ? "%s/" : "%s", dn);
+    }
+    closedir(d);
+    if(de != NULL) {
+	error("Out of memory");
+	return -1;
+    }
+    return 0;
+}
+
+/* NG: Conversion to a library: entry points */
+
+int
+sbagen_init(void)
+{
+    int r = 0;
+
+    TRACE_BEGIN("sbagen_init");
+    if(sin_table == NULL)
+	r = init_sin_table();
+    TRACE_END("sbagen_init");
+    return r;
+}
+
+/*
+ * rate: sample rate; default: 44100; option -r
+ * prate: frequency recalculation, default: 10, option -R
+ * fade: fade time (ms), default: 60000, option -F
+ * roll: headphone roll-off compensation, option -c
+ */
+int
+sbagen_set_parameters(int rate, int prate, int fade, const char *roll)
+{
+    if(rate != 0)
+	out_rate = rate;
+    if(prate != 0)
+	out_prate = prate;
+    if(fade != 0)
+	fade_int = fade;
+    if(roll != NULL)
+	if(setupOptC(roll, ampadj, &opt_c) < 0)
+	    return -1;
+    return 0;
+}
+
+void
+sbagen_exit(void)
+{
+#if !SBAGEN_TABLES
+    free((int *)sin_table);
+#endif
+    sin_table = NULL;
+    sbagen_set_cache(NULL, 0);
+    sbagen_set_mix(NULL);
+    sbagen_free_listeners();
+    outClose();
+}
+
+int
+sbagen_parse_seq(const char *seq)
+{
+    int r = 0;
+
+    if(per != NULL && tlUnshare() != NULL) {
+	error("Cannot add to a sequence whose timeline is shared");
+	return -1;
+    }
+    seq_hash = fnv1a(seq, strlen(seq), seq_hash ? seq_hash : FNV_INIT);
+    n_periods = 0;
+    n_timed = 0;
+    parse_work = 0;
+    parse_mem = 0;
+    dropStmts();
+    stmts_whole = per == NULL;
+    TRACE_BEGIN("readSeq");
+    r = readSeq(seq);
+    TRACE_END("readSeq");
+    if(r == 0 && seq_more && n_timed <= SPLICE_MARGIN)
+	return 1;		/* Too short for sbagen_stream() to play yet */
+    if(r == 0)
+	r = buildPeriods(&stmts, 0);
+    if(r < 0)
+	stmts_whole = 0;
+    else if(stmts_whole)
+	markFirst(&stmts);
+    return r;
+}
+
+int
+sbagen_reload(const char *seq)
+{
+    int r;
+
+    if(running == 2) {
+	error("Cannot reload while rendering listeners");
+	return -1;
+    }
+    if(per == NULL)
+	return sbagen_parse_seq(seq);
+    TRACE_BEGIN("reload");
+    r = reloadSeq(seq);
+    TRACE_END("reload");
+    return r;
+}
+
+int
+sbagen_stream(const char *seq, int more)
+{
+    const char *end = more ? streamCut(seq) : seq + strlen(seq);
+    int o_more = seq_more;
+    char *text;
+    int r;
+
+    if((text = malloc(end - seq + 1)) == NULL) {
+	error("Out of memory");
+	return -1;
+    }
+    memcpy(text, seq, end - seq);
+    text[end - seq] = 0;
+    seq_more = more;
+    if(per == NULL) {
+	if((r = sbagen_parse_seq(text)) > 0) {
+	    sbagen_free_seq();	/* Parsed again with more text */
+	    seq_more = more;
+	    r = 0;
+	}
+    } else {
+	if((r = sbagen_reload(text)) < 0)
+	    seq_more = o_more;
+	else if(running && o_more && !more)
+	    seq_reloaded = 1;	/* The length is final */
+    }
+    free(text);
+    if(r < 0)
+	return -1;
+    return per != NULL && (!seq_more || t_per0(fast_tim0, fast_tim1) > 0);
+}
+
+void
+sbagen_set_stream_wait(int (*wait)(void *opaque), void *opaque)
+{
+    stream_wait = wait;
+    stream_opaque = opaque;
+}
+
+int
+sbagen_get_info(struct sbagen_info *info)
+{
+    Timeline tl;
+
+    if(per == NULL) {
+	memset(info, 0, sizeof(*info));
+	error("No sequence");
+	return(-1);
+    }
+    tlView(&tl);
+    return(sbagen_timeline_info(&tl, info));
+}
+
+int
+sbagen_preview(int n, float *data)
+{
+    Timeline tl;
+
+    if(per == NULL) {
+	error("No sequence");
+	return(-1);
+    }
+    tlView(&tl);
+    return(sbagen_timeline_preview(&tl, n, data));
+}
+
+/*
+ * Fills tl with the loaded sequence as it is, without any reference, for
+ * the functions on timelines to work on it.
+ */
+static void
+tlView(Timeline *tl)
+{
+    memset(tl, 0, sizeof(*tl));
+    tl->per = per;
+    tl->n_ch = n_ch;
+    tl->tim0 = fast_tim0;
+    tl->tim1 = fast_tim1;
+    tl->n_periods = n_periods;
+    tl->ns_used = ns_used;
+    tl->mix_flag = mix_flag;
+    tl->hash = seq_hash;
+}
+
+/*
+ * Before changing the periods or waveforms of the loaded sequence: takes
+ * them back from its timeline if nobody else holds it. Returns the
+ * timeline if somebody does, the loaded sequence must then leave them as
+ * they are.
+ */
+static Timeline *
+tlUnshare(void)
+{
+    if(seq_tl == NULL || __sync_add_and_fetch(&seq_tl->refs, 0) > 1)
+	return seq_tl;
+    seq_arena = seq_tl->arena;
+    free(seq_tl);
+    seq_tl = NULL;
+    return NULL;
+}
+
+struct sbagen_timeline *
+sbagen_timeline_get(void)
+{
+    if(per == NULL || seq_more) {
+	error(per == NULL ? "No sequence" : "The sequence is still coming in");
+	return NULL;
+    }
+    if(seq_tl == NULL) {
+	if((seq_tl = malloc(sizeof(*seq_tl))) == NULL) {
+	    error("Out of memory");
+	    return NULL;
+	}
+	tlView(seq_tl);
+	seq_tl->refs = 1;		// The loaded sequence's
+	seq_tl->arena = seq_arena;
+	memset(&seq_arena, 0, sizeof(seq_arena));
+	memcpy(seq_tl->waves, waves, sizeof(waves));
+    }
+    __sync_fetch_and_add(&seq_tl->refs, 1);
+    return seq_tl;
+}
+
+void
+sbagen_timeline_put(struct sbagen_timeline *tl)
+{
+    unsigned i;
+
+    if(tl == NULL || __sync_sub_and_fetch(&tl->refs, 1) > 0)
+	return;
+    aFree(&tl->arena);
+    for(i = 0; i < sizeof(tl->waves) / sizeof(*tl->waves); i++)
+	free(tl->waves[i]);
+    free(tl);
+}
+
+int
+sbagen_timeline_use(struct sbagen_timeline *tl)
+{
+    if(running) {
+	error("Cannot change the sequence while rendering");
+	return -1;
+    }
+    __sync_fetch_and_add(&tl->refs, 1);
+    sbagen_free_seq();
+    seq_tl = tl;
+    per = tl->per;
+    memcpy(waves, tl->waves, sizeof(waves));
+    n_ch = tl->n_ch;
+    fast_tim0 = tl->tim0;
+    fast_tim1 = tl->tim1;
+    n_periods = tl->n_periods;
+    ns_used = tl->ns_used;
+    mix_flag = tl->mix_flag;
+    seq_hash = tl->hash;
+    return 0;
+}
+
+int
+sbagen_timeline_info(struct sbagen_timeline *tl, struct sbagen_info *info)
+{
+    Period *pp;
+    int a;
+
+    memset(info, 0, sizeof(*info));
+    info->duration = t_per0(tl->tim0, tl->tim1);
+    if(info->duration == 0)
+	info->duration = -1;
+    info->channels = tl->n_ch;
+    pp = tl->per;
+    do {
+	double tot0 = 0, tot1 = 0;
+
+	info->periods++;
+	for(a = 0; a < tl->n_ch; a++) {
+	    int typ = pp->v0[a].typ;
+
+	    if(typ == 0)
+		continue;
+	    info->types |= 1 << (typ < 0 ? SBAGEN_VOICE_WAVE : typ);
+	    tot0 += pp->v0[a].amp;
+	    tot1 += pp->v1[a].amp;	// Amplitudes only vary linearly
+	}
+	if(tot1 > tot0)
+	    tot0 = tot1;
+	if(tot0 / 40.96 > info->peak)
+	    info->peak = tot0 / 40.96;
+	pp = pp->nxt;
+    } while(pp != tl->per);
+    return(0);
+}
+
+int
+sbagen_timeline_preview(struct sbagen_timeline *tl, int n, float *data)
+{
+    Cursor cu;
+    Voice *vv;
+    int dur, i, a;
+
+    if(n < 2) {
+	error("At least two points are needed");
+	return(-1);
+    }
+    memset(&cu, 0, sizeof(cu));
+    if((cu.v = malloc(tl->n_ch * sizeof(Voice))) == NULL && tl->n_ch) {
+	error("Out of memory");
+	return(-1);
+    }
+    cu.per = tl->per;
+    cu.n_ch = tl->n_ch;
+    cu.clip = 127.0 / 1E-6 / out_rate;
+    if((dur = t_per0(tl->tim0, tl->tim1)) == 0)
+	dur = H24;
+    for(i = 0; i < n; i++) {
+	float *lev = data++;
+
+	cursorMove(&cu, (tl->tim0 + (S64)dur * i / (n - 1)) % H24);
+	*lev = 0;
+	for(a = 0, vv = cu.v; a < cu.n_ch; a++, vv++) {
+	    if(vv->typ == 0) {
+		*(data++) = 0;
+		*(data++) = 0;
+		*(data++) = 0;
+		continue;
+	    }
+	    *(data++) = vv->carr;
+	    *(data++) = vv->res;
+	    *(data++) = vv->amp / 40.96;
+	    *lev += vv->amp / 40.96;
+	}
+    }
+    free(cu.v);
+    return(0);
+}
+
+int
+sbagen_query(const char *seq, struct sbagen_info *info)
+{
+    sbagen_free_seq();
+    if(sbagen_parse_seq(seq) < 0) {
+	sbagen_free_seq();
+	return(-1);
+    }
+    return(sbagen_get_info(info));
+}
+
+int
+sbagen_index(const char *dir, const char *pattern, const char *index,
+    int jobs, int scan, struct sbagen_entry **entries)
+{
+    struct Index_scan s;
+    pthread_t th[16];
+    int i, n, nth = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.dir = dir;
+    s.pattern = pattern;
+    s.n_old = index_load(index, dir, &s.old);
+    if(!scan) {
+	*entries = s.old;
+	return(s.n_old);
+    }
+    if(running) {
+	error("Cannot parse sequences while rendering");
+	sbagen_free_index(s.old, s.n_old);
+	return(-1);
+    }
+    if(index_readdir(&s) < 0) {
+	sbagen_free_index(s.e, s.n);
+	sbagen_free_index(s.old, s.n_old);
+	return(-1);
+    }
+    if(jobs > (int)(sizeof(th) / sizeof(*th)))
+	jobs = sizeof(th) / sizeof(*th);
+    while(nth < jobs - 1 && nth < s.n - 1 &&
+	pthread_create(&th[nth], NULL, index_thread, &s) == 0)
+	nth++;
+    index_thread(&s);
+    for(i = 0; i < nth; i++)
+	pthread_join(th[i], NULL);
+    for(i = n = 0; i < s.n; i++)
+	if(s.e[i].name != NULL)
+	    s.e[n++] = s.e[i];
+    if(n > 0)
+	qsort(s.e, n, sizeof(*s.e), index_cmp_entries);
+    if(index != NULL && (s.changed || n != s.n_old))
+	index_save(index, dir, s.e, n);
+    sbagen_free_index(s.old, s.n_old);
+    if(s.e == NULL && (s.e = malloc(sizeof(*s.e))) == NULL) {
+	error("Out of memory");
+	return(-1);
+    }
+    *entries = s.e;
+    return(n);
+}
+
+void
+sbagen_free_index(struct sbagen_entry *entries, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i++) {
+	free(entries[i].name);
+	free(entries[i].error);
+    }
+    free(entries);
+}
+
+void
+sbagen_free_seq(void)
+{
+    unsigned i;
+
+    per = NULL;
+    ns_used = 0;
+    if(seq_tl != NULL) {	// It has the periods and waveforms
+	sbagen_timeline_put(seq_tl);
+	seq_tl = NULL;
+	memset(waves, 0, sizeof(waves));
+    }
+    aFree(&seq_arena);
+    dropStmts();
+    for(i = 0; i < sizeof(waves) / sizeof(*waves); i++) {
+	free(waves[i]);
+	waves[i] = NULL;
+    }
+    fast_tim0 = fast_tim1 = -1;
+    last_abs_time = -1;
+    mix_flag = 0;
+    n_ch = 0;
+    seq_hash = 0;
+    seq_more = 0;
+    free(ckpt);
+    ckpt = NULL;
+}
+
+int
+sbagen_set_cache(const char *dir, long max_size)
+{
+    free(cache_dir);
+    cache_dir = NULL;
+    if(dir == NULL)
+	return 0;
+    if((cache_dir = StrDup((char *)dir)) == NULL)
+	return -1;
+    cache_max = max_size;
+    return 0;
+}
+
+int
+sbagen_set_realtime(int priority, int lock)
+{
+    if(priority != 0 && (priority < sched_get_priority_min(SCHED_FIFO) ||
+	priority > sched_get_priority_max(SCHED_FIFO))) {
+	error("Invalid real-time priority: %d", priority);
+	return -1;
+    }
+    rt_priority = priority;
+    rt_lock = lock;
+    return 0;
+}
+
+int
+sbagen_set_kernel(int kernel)
+{
+    if(running) {
+	error("Cannot change the kernel while rendering");
+	return -1;
+    }
+    if(kernel != SBAGEN_KERNEL_TABLE && kernel != SBAGEN_KERNEL_ROTATE) {
+	error("Unknown kernel %d", kernel);
+	return -1;
+    }
+    osc_kernel = kernel;
+    return 0;
+}
+
+int
+sbagen_set_blocks(int min, int max)
+{
+    if(min < 0 || max < min || max > 1 << 20 || (min == 0 && max != 0)) {
+	error("Bad block size range %d-%d", min, max);
+	return -1;
+    }
+    blk_min = min;
+    blk_max = max;
+    return 0;
+}
+
+void
+sbagen_set_mode(int mode)
+{
+    blk_mode = mode;
+}
+
+void
+sbagen_report_output(int latency, int underruns)
+{
+    blk_latency = latency;
+    blk_underruns = underruns;
+}
+
+void
+sbagen_report_played(long long frames, int playing)
+{
+    S64 at = clockNow();
+
+    seqBegin(&clk_played_seq);
+    clk_played.frames = frames;
+    clk_played.at = at;
+    clk_played.playing = playing;
+    clk_played.run = clk.run;
+    seqEnd(&clk_played_seq);
+}
+
+int
+sbagen_get_clock(struct sbagen_clock *clock)
+{
+    struct Clock c;
+    struct Played p;
+    S64 a;
+    int i, n;
+
+    seqRead(&clk_seq, &clk, &c, sizeof(c));
+    seqRead(&clk_played_seq, &clk_played, &p, sizeof(p));
+    if(c.run == 0)
+	return -1;
+    if(p.run == c.run) {
+	a = p.frames;
+	if(p.playing)
+	    a += (clockNow() - p.at) * out_rate / 1000000000;
+	clock->playing = p.playing && a < c.rendered;
+    } else {
+	a = c.rendered - blk_latency;
+	clock->playing = c.running;
+    }
+    if(a > c.rendered)
+	a = c.rendered;
+    if(a < 0)
+	a = 0;
+    clock->rendered = c.rendered;
+    clock->audible = a;
+    clock->latency = c.rendered - a;
+    clock->time = (c.frame0 + a) * 1000 / out_rate;
+
+    // Latest period started by then, or the oldest one known
+    n = c.pers < CLK_PERS ? c.pers : CLK_PERS;
+    for(i = c.pers - 1; i > c.pers - n; i--)
+	if(c.per_frame[i & (CLK_PERS - 1)] <= a)
+	    break;
+    i &= CLK_PERS - 1;
+    clock->period_start = c.per_start[i];
+    clock->period_end = c.per_end[i];
+    return 0;
+}
+
+int
+sbagen_set_output(int kind, int fd, const char *path)
+{
+    outClose();
+    switch(kind) {
+	case SBAGEN_OUT_DEFAULT:
+	    break;
+	case SBAGEN_OUT_NULL:
+	    output.kind = OUT_NULL;
+	    break;
+	case SBAGEN_OUT_MEMORY:
+	    output.kind = OUT_MEMORY;
+	    break;
+	case SBAGEN_OUT_FD:
+	    output.kind = OUT_FD;
+	    output.fd = fd;
+	    break;
+	case SBAGEN_OUT_WAV:
+	    if((output.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		error("%s: %s", path, strerror(errno));
+		return -1;
+	    }
+	    if(wav_header(output.fd, 0) < 0 ||
+		lseek(output.fd, WAV_HEADER, SEEK_SET) < 0) {
+		close(output.fd);
+		return -1;
+	    }
+	    output.kind = OUT_WAV;
+	    break;
+	default:
+	    error("Unknown output %d", kind);
+	    return -1;
+    }
+    output.format = SBAGEN_FMT_S16;
+    return 0;
+}
+
+int
+sbagen_set_output_callback(int (*write)(void *opaque, char *buf, int size),
+    void *opaque, int block, int format)
+{
+    if(fmtBytes(format) == 0 || format & ~(SBAGEN_FMT_PLANAR | 0xFF)) {
+	error("Unsupported sample format %d", format);
+	return -1;
+    }
+    if(block < 0 || block > 1 << 20) {
+	error("Bad block size %d", block);
+	return -1;
+    }
+    outClose();
+    output.kind = OUT_CALLBACK;
+    output.write = write;
+    output.opaque = opaque;
+    output.block = block;
+    output.format = format;
+    return 0;
+}
+
+int
+sbagen_set_output_format(int format)
+{
+    if(fmtBytes(format) == 0 || format & ~(SBAGEN_FMT_PLANAR | 0xFF) ||
+	(output.kind == OUT_WAV && format & SBAGEN_FMT_PLANAR)) {
+	error("Unsupported sample format %d", format);
+	return -1;
+    }
+    output.format = format;
+    return 0;
+}
+
+char *
+sbagen_output_memory(size_t *size)
+{
+    *size = output.mem_size;
+    return output.mem;
+}
+
+int
+sbagen_run(void)
+{
+    uint64_t key;
+    int r;
+
+    if(cache_dir == NULL || seq_hash == 0 || seq_more || mix_data ||
+	output.format & SBAGEN_FMT_PLANAR || ckpt != NULL)
+	r = loop();
+    else {
+	key = cache_key();
+	if((r = cache_play(key)) == 2)
+	    r = loop();		// From where the replay stopped
+	else if(r != 0)
+	    r = r < 0 ? -1 : 0;
+	else {
+	    cache_begin(key);
+	    r = loop();
+	    cache_end(key, r == 0);
+	}
+    }
+    if(outEnd() < 0)
+	r = -1;
+    return(r);
+}
+
+int
+sbagen_add_listener(double gain, const char *roll, int start_ms,
+    int (*out)(void *opaque, char *buf, int size), void *opaque)
+{
+    Listener *l, **pl;
+
+    if((l = (Listener *)Alloc(sizeof(Listener))) == NULL)
+	return(-1);
+    l->gain = gain;
+    l->start = start_ms;
+    l->out = out;
+    l->opaque = opaque;
+    if(roll != NULL && setupOptC(roll, l->ampadj, &l->opt_c) < 0) {
+	free(l);
+	return(-1);
+    }
+    for(pl = &listeners; *pl != NULL; pl = &(*pl)->nxt);
+    *pl = l;
+    return(0);
+}
+
+int
+sbagen_run_listeners(void)
+{
+    if(listeners == NULL) {
+	error("No listeners");
+	return(-1);
+    }
+    if(seq_more) {
+	error("The sequence is not complete");
+	return(-1);
+    }
+    return(loopListeners());
+}
+
+void
+sbagen_free_listeners(void)
+{
+    Listener *l;
+
+    while((l = listeners) != NULL) {
+	listeners = l->nxt;
+	free(l);
+    }
+}
+
+char *
+sbagen_get_error(void)
+{
+    error_message[sizeof(error_message) - 1] = 0;
+    return error_message;
+}
+
+#if SBAGEN_TRACE
+
+void
+sbagen_trace_enable(int on)
+{
+    trace_enabled = on;
+}
+
+int
+sbagen_trace_dump(const char *path)
+{
+    FILE *f;
+    TraceBuf *tb;
+    unsigned i, n;
+    const char *sep = "";
+
+    if((f = fopen(path, "w")) == NULL) {
+	error("%s: %s", path, strerror(errno));
+	return -1;
+    }
+    fprintf(f, "{\"traceEvents\":[");
+    for(tb = trace_bufs; tb != NULL; tb = tb->nxt) {
+	n = tb->cnt;
+	__sync_synchronize();
+	for(i = n > TRACE_NEV ? n - TRACE_NEV : 0; i < n; i++) {
+	    struct TraceEv *ev = &tb->ev[i % TRACE_NEV];
+	    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,"
+		"\"pid\":1,\"tid\":%d}", sep, ev->name, ev->ph,
+		(long long)ev->ts, tb->tid);
+	    sep = ",";
+	}
+    }
+    fprintf(f, "\n]}\n");
+    if(fclose(f) != 0) {
+	error("%s: %s", path, strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+#endif
+
+#ifdef BUILD_JNI
+
+#include <assert.h>
+#include <jni.h>
+#include <android/log.h>
+#include "tmp/sbagen.h"
+
+static void
+die(JNIEnv *env, char c)
+{
+    jclass e;
+    char *cl;
+
+    if((*env)->ExceptionOccurred(env))
+	return;
+    cl =
+	c == 'M' ? "java/lang/OutOfMemoryError" :
+	c == 'A' ? "java/lang/IllegalArgumentException" :
+	NULL;
+    e = (*env)->FindClass(env, cl);
+    (*env)->ThrowNew(env, e, sbagen_get_error());
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1init(
+    JNIEnv *env, jobject self)
+{
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+    if(sbagen_init() < 0) {
+	die(env, 'M');
+	return;
+    }
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1set_1parameters(
+    JNIEnv *env, jobject self,
+    jint rate, jint prate, jint fade, jstring jroll)
+{
+    const char *roll;
+    int r;
+
+    if(jroll == NULL) {
+	roll = NULL;
+    } else {
+	if((roll = (*env)->GetStringUTFChars(env, jroll, NULL)) == NULL)
+	    return;
+    }
+    r = sbagen_set_parameters(rate, prate, fade, roll);
+    if(roll != NULL)
+	(*env)->ReleaseStringUTFChars(env, jroll, roll);
+    if(r < 0)
+	die(env, 'A');
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1set_1cache(
+    JNIEnv *env, jobject self, jstring jdir, jlong max_size)
+{
+    const char *dir;
+    int r;
+
+    if(jdir == NULL) {
+	dir = NULL;
+    } else {
+	if((dir = (*env)->GetStringUTFChars(env, jdir, NULL)) == NULL)
+	    return;
+    }
+    r = sbagen_set_cache(dir, max_size);
+    if(dir != NULL)
+	(*env)->ReleaseStringUTFChars(env, jdir, dir);
+    if(r < 0)
+	die(env, 'M');
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1set_1blocks(
+    JNIEnv *env, jobject self, jint min, jint max)
+{
+    if(sbagen_set_blocks(min, max) < 0)
+	die(env, 'A');
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1set_1mode(
+    JNIEnv *env, jobject self, jint mode)
+{
+    sbagen_set_mode(mode);
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1report_1output(
+    JNIEnv *env, jobject self, jint latency, jint underruns)
+{
+    sbagen_report_output(latency, underruns);
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1report_1played(
+    JNIEnv *env, jobject self, jlong frames, jboolean playing)
+{
+    sbagen_report_played(frames, playing);
+}
+
+jlongArray
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1get_1clock(
+    JNIEnv *env, jobject self)
+{
+    struct sbagen_clock clock;
+    jlong r[7];
+    jlongArray a;
+
+    if(sbagen_get_clock(&clock) < 0)
+	return NULL;
+    r[0] = clock.rendered;
+    r[1] = clock.audible;
+    r[2] = clock.latency;
+    r[3] = clock.time;
+    r[4] = clock.period_start;
+    r[5] = clock.period_end;
+    r[6] = clock.playing;
+    if((a = (*env)->NewLongArray(env, 7)) == NULL)
+	return NULL;
+    (*env)->SetLongArrayRegion(env, a, 0, 7, r);
+    return a;
+}
+
+jbyteArray
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1checkpoint(
+    JNIEnv *env, jobject self)
+{
+    char data[4096];
+    jbyteArray a;
+    int n;
+
+    if((n = sbagen_checkpoint(data, sizeof(data))) < 0 ||
+	n > (int)sizeof(data))
+	return NULL;
+    if((a = (*env)->NewByteArray(env, n)) == NULL)
+	return NULL;
+    (*env)->SetByteArrayRegion(env, a, 0, n, (jbyte *)data);
+    return a;
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1restore(
+    JNIEnv *env, jobject self, jbyteArray state)
+{
+    jbyte *data;
+    int r;
+
+    if((data = (*env)->GetByteArrayElements(env, state, NULL)) == NULL)
+	return;
+    r = sbagen_restore(data, (*env)->GetArrayLength(env, state));
+    (*env)->ReleaseByteArrayElements(env, state, data, JNI_ABORT);
+    if(r < 0)
+	die(env, 'A');
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1exit(
+    JNIEnv *env, jobject self)
+{
+    sbagen_exit();
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1parse_1seq(
+    JNIEnv *env, jobject self, jstring jseq)
+{
+    const char *seq;
+    int r;
+
+    if((seq = (*env)->GetStringUTFChars(env, jseq, NULL)) == NULL)
+	return;
+    r = sbagen_parse_seq(seq);
+    (*env)->ReleaseStringUTFChars(env, jseq, seq);
+    if(r < 0)
+	die(env, 'A');
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1reload(
+    JNIEnv *env, jobject self, jstring jseq)
+{
+    const char *seq;
+    int r;
+
+    if((seq = (*env)->GetStringUTFChars(env, jseq, NULL)) == NULL)
+	return;
+    r = sbagen_reload(seq);
+    (*env)->ReleaseStringUTFChars(env, jseq, seq);
+    if(r < 0)
+	die(env, 'A');
+}
+
+jboolean
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1stream(
+    JNIEnv *env, jobject self, jstring jseq, jboolean more)
+{
+    const char *seq;
+    int r;
+
+    if((seq = (*env)->GetStringUTFChars(env, jseq, NULL)) == NULL)
+	return JNI_FALSE;
+    r = sbagen_stream(seq, more);
+    (*env)->ReleaseStringUTFChars(env, jseq, seq);
+    if(r < 0)
+	die(env, 'A');
+    return r > 0;
+}
+
+jintArray
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1get_1info(
+    JNIEnv *env, jobject self)
+{
+    struct sbagen_info info;
+    jint r[5];
+    jintArray a;
+
+    if(sbagen_get_info(&info) < 0) {
+	die(env, 'A');
+	return NULL;
+    }
+    r[0] = info.duration;
+    r[1] = info.periods;
+    r[2] = info.channels;
+    r[3] = info.types;
+    r[4] = (jint)ceil(info.peak);
+    if((a = (*env)->NewIntArray(env, 5)) == NULL)
+	return NULL;
+    (*env)->SetIntArrayRegion(env, a, 0, 5, r);
+    return a;
+}
+
+jfloatArray
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1preview(
+    JNIEnv *env, jobject self, jint n)
+{
+    jfloatArray a;
+    float *data;
+
+    if(per == NULL || n < 2) {
+	sbagen_preview(n, NULL);	// Sets the error message
+	die(env, 'A');
+	return NULL;
+    }
+    if((data = Alloc(n * (1 + 3 * n_ch) * sizeof(float))) == NULL) {
+	die(env, 'M');
+	return NULL;
+    }
+    sbagen_preview(n, data);
+    if((a = (*env)->NewFloatArray(env, n * (1 + 3 * n_ch))) != NULL)
+	(*env)->SetFloatArrayRegion(env, a, 0, n * (1 + 3 * n_ch), data);
+    free(data);
+    return a;
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1free_1seq(
+    JNIEnv *env, jobject self)
+{
+    sbagen_free_seq();
+}
+
+/*
+ * Browser.sbagen_index(): returns the names, the errors (null if none)
+ * and for each entry duration, channels, types and peak in an int array.
+ */
+jobjectArray
+Java_org_cigaes_binaural_1player_Browser_sbagen_1index(
+    JNIEnv *env, jclass class, jstring jdir, jstring jglob, jstring jindex,
+    jint jobs, jboolean scan)
+{
+    const char *dir, *glob = NULL, *index = NULL;
+    struct sbagen_entry *e = NULL;
+    jobjectArray r = NULL, names, errors;
+    jintArray info;
+    jclass string;
+    jint v[4];
+    jstring js;
+    int i, n = -1;
+
+    if((dir = (*env)->GetStringUTFChars(env, jdir, NULL)) == NULL)
+	return NULL;
+    if(jglob != NULL)
+	glob = (*env)->GetStringUTFChars(env, jglob, NULL);
+    if(jindex != NULL)
+	index = (*env)->GetStringUTFChars(env, jindex, NULL);
+    if((jglob == NULL || glob != NULL) && (jindex == NULL || index != NULL))
+	n = sbagen_index(dir, glob, index, jobs, scan, &e);
+    (*env)->ReleaseStringUTFChars(env, jdir, dir);
+    if(glob != NULL)
+	(*env)->ReleaseStringUTFChars(env, jglob, glob);
+    if(index != NULL)
+	(*env)->ReleaseStringUTFChars(env, jindex, index);
+    if(n < 0) {
+	die(env, 'A');
+	return NULL;
+    }
+    string = (*env)->FindClass(env, "java/lang/String");
+    if(string == NULL ||
+	(names = (*env)->NewObjectArray(env, n, string, NULL)) == NULL ||
+	(errors = (*env)->NewObjectArray(env, n, string, NULL)) == NULL ||
+	(info = (*env)->NewIntArray(env, n * 4)) == NULL)
+	goto done;
+    for(i = 0; i < n; i++) {
+	if((js = (*env)->NewStringUTF(env, e[i].name)) == NULL)
+	    goto done;
+	(*env)->SetObjectArrayElement(env, names, i, js);
+	(*env)->DeleteLocalRef(env, js);
+	if(e[i].error != NULL) {
+	    if((js = (*env)->NewStringUTF(env, e[i].error)) == NULL)
+		goto done;
+	    (*env)->SetObjectArrayElement(env, errors, i, js);
+	    (*env)->DeleteLocalRef(env, js);
+	}
+	v[0] = e[i].info.duration;
+	v[1] = e[i].info.channels;
+	v[2] = e[i].info.types;
+	v[3] = (jint)ceil(e[i].info.peak);
+	(*env)->SetIntArrayRegion(env, info, i * 4, 4, v);
+    }
+    if((r = (*env)->NewObjectArray(env, 3,
+	(*env)->FindClass(env, "java/lang/Object"), NULL)) == NULL)
+	goto done;
+    (*env)->SetObjectArrayElement(env, r, 0, names);
+    (*env)->SetObjectArrayElement(env, r, 1, errors);
+    (*env)->SetObjectArrayElement(env, r, 2, info);
+done:
+    sbagen_free_index(e, n);
+    return r;
+}
+
+static JNIEnv *output_env;
+static jobject output_self;
+static jmethodID output_method;
+static jmethodID stream_method;
+static jshortArray output_array;	/* Reused for every block */
+static int output_array_len;
+
+static int
+writeOut(char *buf, int siz)
+{
+    siz /= 2;
+    if(siz > output_array_len) {
+	error("Output block too large");
+	return(-1);
+    }
+    (*output_env)->SetShortArrayRegion(output_env, output_array, 0, siz,
+	(jshort *)buf);
+    (*output_env)->CallVoidMethod(output_env, output_self, output_method,
+	output_array, siz);
+    if((*output_env)->ExceptionOccurred(output_env))
+	return(-1);
+    return(0);
+}
+
+static int
+streamWait(void *opaque)
+{
+    int r;
+
+    r = (*output_env)->CallIntMethod(output_env, output_self, stream_method);
+    if((*output_env)->ExceptionOccurred(output_env))
+	return(-1);
+    return(r);
+}
+
+void
+Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1run(
+    JNIEnv *env, jobject self)
+{
+    jclass class;
+    jshortArray a;
+    int r;
+
+    __android_log_print(ANDROID_LOG_INFO, "sbagen", "sbagen started");
+    output_env = env;
+    output_self = self;
+    class = (*env)->GetObjectClass(env, self);
+    output_method = (*env)->GetMethodID(env, class, "out", "([SI)V");
+    assert(output_method != NULL);
+    stream_method = (*env)->GetMethodID(env, class, "stream_wait", "()I");
+    assert(stream_method != NULL);
+    sbagen_set_stream_wait(streamWait, NULL);
+    /* Allocated once: writeOut runs in the render loop */
+    output_array_len = outBlockLen();
+    if((a = (*env)->NewShortArray(env, output_array_len)) == NULL)
+	return;
+    output_array = (*env)->NewGlobalRef(env, a);
+    (*env)->DeleteLocalRef(env, a);
+    if(output_array == NULL)
+	return;
+    r = sbagen_run();
+    (*env)->DeleteGlobalRef(env, output_array);
+    output_array = NULL;
+    if(r < 0)
+	die(env, 'A');
+    __android_log_print(ANDROID_LOG_INFO, "sbagen", "sbagen finished");
+}
+
+#elif BUILD_STANDALONE_TEST
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static int
+writeOut(char *buf, int siz) {
+    int rv;
+
+    while (-1 != (rv= write(out_fd, buf, siz))) {
+	if (0 == (siz -= rv)) return 0;
+	buf += rv;
+    }
+    error("Output error");
+    return(-1);
+}
+
+#if SBAGEN_RT_CHECK
+
+#include <dlfcn.h>
+
+/*
+ * Real-time check: allocating or locking between RT_ENTER() and
+ * RT_LEAVE() aborts the program, naming the culprit.
+ */
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static int (*next_mutex_lock)(pthread_mutex_t *);
+static int (*next_mutex_unlock)(pthread_mutex_t *);
+static int (*next_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+
+static void
+rt_violation(const char *what)
+{
+    static const char msg[] = " called in the render loop\n";
+
+    rt_check = 0;
+    write(2, what, strlen(what));
+    write(2, msg, sizeof(msg) - 1);
+    abort();
+}
+
+__attribute__((constructor)) static void
+rt_check_init(void)
+{
+    next_mutex_lock = (int (*)(pthread_mutex_t *))
+	dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    next_mutex_unlock = (int (*)(pthread_mutex_t *))
+	dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+    next_cond_wait = (int (*)(pthread_cond_t *, pthread_mutex_t *))
+	dlsym(RTLD_NEXT, "pthread_cond_wait");
+}
+
+void *
+malloc(size_t size)
+{
+    if(rt_check)
+	rt_violation("malloc");
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    if(rt_check)
+	rt_violation("calloc");
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+    if(rt_check)
+	rt_violation("realloc");
+    return __libc_realloc(p, size);
+}
+
+void
+free(void *p)
+{
+    if(rt_check)
+	rt_violation("free");
+    __libc_free(p);
+}
+
+int
+pthread_mutex_lock(pthread_mutex_t *m)
+{
+    if(rt_check)
+	rt_violation("pthread_mutex_lock");
+    return next_mutex_lock(m);
+}
+
+int
+pthread_mutex_unlock(pthread_mutex_t *m)
+{
+    if(rt_check)
+	rt_violation("pthread_mutex_unlock");
+    return next_mutex_unlock(m);
+}
+
+int
+pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+    if(rt_check)
+	rt_violation("pthread_cond_wait");
+    return next_cond_wait(c, m);
+}
+
+#endif
 
-    while (bd) {
-      lin= buf; lin_copy= buf_copy;
-      sprintf(lin, "%s%s", prep, bd->lin);
-      strcpy(lin_copy, lin);
-      if(readTimeLine() < 0) {		// This may recurse, and that's why we're StrDuping the string
-	  free(prep);
-	  return -1;
-      }
-      bd= bd->nxt;
-    }
-    free(prep);
-    return 0;
-  }
-      
-  // Normal name-def
-  pp= (Period*)Alloc(sizeof(*pp));
-  if(pp == NULL)
-      return -1;
-  pp->tim= tim;
-  pp->fi= fi;
-  pp->fo= fo;
-      
-  memcpy(pp->v0, nd->vv, N_CH * sizeof(Voice));
-  memcpy(pp->v1, nd->vv, N_CH * sizeof(Voice));
+/* Listeners given with -l: file[:gain[:start_ms[:roll]]] */
 
-  if (!per)
-    per= pp->nxt= pp->prv= pp;
-  else {
-    pp->nxt= per; pp->prv= per->prv;
-    pp->prv->nxt= pp->nxt->prv= pp;
-  }
+static int listener_fds[64];
+static int listener_nfds;
 
-  // Automatically add a transitional period
-  pp= (Period*)Alloc(sizeof(*pp));
-  if(pp == NULL)
-      return -1;
-  pp->fi= -2;		// Unspecified transition
-  pp->nxt= per; pp->prv= per->prv;
-  pp->prv->nxt= pp->nxt->prv= pp;
+static int
+listener_write(void *opaque, char *buf, int siz)
+{
+    int fd = *(int *)opaque;
+    int rv;
 
-  if (0 != (p= getWord())) {
-    if (0 != strcmp(p, "->")) {
-	badSeq();
-	return -1;
+    while((rv = write(fd, buf, siz)) != -1) {
+	if((siz -= rv) == 0)
+	    return 0;
+	buf += rv;
     }
-    pp->fi= -3;		// Special '->' transition
-    pp->tim= tim;
-  }
-  return 0;
+    error("Output error");
+    return(-1);
 }
 
 static int
-readTime(char *p, int *timp) {		// Rets chars consumed, or 0 error
-  int nn, hh, mm, ss;
+listener_add(char *spec)
+{
+    char *gain, *start = NULL, *roll = NULL;
+    int *fd;
 
-  if (3 > sscanf(p, "%2d:%2d:%2d%n", &hh, &mm, &ss, &nn)) {
-    ss= 0;
-    if (2 > sscanf(p, "%2d:%2d%n", &hh, &mm, &nn)) return 0;
-  }
+    if(listener_nfds >= (int)(sizeof(listener_fds) / sizeof(*listener_fds))) {
+	error("Too many listeners");
+	return(-1);
+    }
+    if((gain = strchr(spec, ':')) != NULL) {
+	*gain++ = 0;
+	if((start = strchr(gain, ':')) != NULL) {
+	    *start++ = 0;
+	    if((roll = strchr(start, ':')) != NULL)
+		*roll++ = 0;
+	}
+    }
+    fd = &listener_fds[listener_nfds];
+    if((*fd = open(spec, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+	error("%s: %s", spec, strerror(errno));
+	return(-1);
+    }
+    listener_nfds++;
+    return(sbagen_add_listener(gain != NULL && *gain ? atof(gain) : 1.0,
+	roll, start != NULL ? atoi(start) : 0, listener_write, fd));
+}
 
-  if (hh < 0 || hh >= 24 ||
-      mm < 0 || mm >= 60 ||
-      ss < 0 || ss >= 60) return 0;
+/*
+ * Reads the file at path whole, NUL-terminated, and sets *size to its
+ * size if size is not null.
+ */
+static char *
+read_data(const char *path, long *size)
+{
+    FILE *f;
+    char *buf;
+    long l;
 
-  *timp= ((hh * 60 + mm) * 60 + ss) * 1000;
-  return nn;
+    if((f = fopen(path, "r")) == NULL) {
+	error("%s: %s", path, strerror(errno));
+	return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    l = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if((buf = malloc(l + 1)) == NULL) {
+	fclose(f);
+	error("Out of memory");
+	return NULL;
+    }
+    l = fread(buf, 1, l, f);
+    buf[l] = 0;
+    fclose(f);
+    if(size != NULL)
+	*size = l;
+    return buf;
 }
 
-//
-//	Takes a set of points and repeats them twice, inverting the
-//	second set, and then interpolates them using a periodic sinc
-//	function (see http://www-ccrma.stanford.edu/~jos/resample/)
-//	and writes them to arr[] in the same format as the sin_table[].
-//
+static char *
+read_file(const char *path)
+{
+    return read_data(path, NULL);
+}
 
-static int sinc_interpolate(double *dp, int np, int *arr) {
-   double *sinc;	// Temporary sinc-table
-   double *out;		// Temporary output table
-   int a, b;
-   double dmax, dmin;
-   double adj, off;
+/* Reload given with -L: file[@ms] */
 
-   // Generate a modified periodic sin(x)/x function to be used for
-   // each of the points.  Really this should be sin(x)/x modified
-   // by the sum of an endless series.  However, this doesn't
-   // converge very quickly, so to save time I'm approximating this
-   // series by 1-4*t*t where t ranges from 0 to 0.5 over the first
-   // half of the periodic cycle.  If you do the maths, this is at
-   // most 5% out.  This will have to do - it's smooth, and I don't
-   // know enough maths to make this series converge quicker.
-   sinc= (double *)Alloc(ST_SIZ * sizeof(double));
-   if(sinc == NULL)
-       return -1;
-   sinc[0]= 1.0;
-   for (a= ST_SIZ/2; a>0; a--) {
-      double tt= a * 1.0 / ST_SIZ;
-      double t2= tt*tt;
-      double adj= 1 - 4 * t2;
-      double xx= 2 * np * 3.14159265358979323846 * tt;
-      double vv= adj * sin(xx) / xx;
-      sinc[a]= vv;
-      sinc[ST_SIZ-a]= vv;
-   }
-   
-   // Build waveform into buffer
-   out= (double *)Alloc(ST_SIZ * sizeof(double));
-   if(out == NULL) {
-       free(sinc);
-       return -1;
-   }
-   for (b= 0; b<np; b++) {
-      int off= b * ST_SIZ / np / 2;
-      double val= dp[b];
-      for (a= 0; a<ST_SIZ; a++) {
-	 out[(a + off)&(ST_SIZ-1)] += sinc[a] * val;
-	 out[(a + off + ST_SIZ/2)&(ST_SIZ-1)] -= sinc[a] * val;
-      }
-   }
+static char *reload_text;
+static S64 reload_left = -1;	/* Octets to write before reloading, or -1 */
+static int reload_fd = 1;	/* Output, or -1 to discard it */
 
-   // Look for maximum for normalization
-   dmax= dmin= 0;
-   for (a= 0; a<ST_SIZ; a++) {
-      if (out[a] > dmax) dmax= out[a];
-      if (out[a] < dmin) dmin= out[a];
-   }
+static double
+ms_between(struct timespec *t0, struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1E3 + (t1->tv_nsec - t0->tv_nsec) / 1E6;
+}
 
-   // Write out to output buffer
-   off= -0.5 * (dmax + dmin);
-   adj= ST_AMP / ((dmax - dmin) / 2);
-   for (a= 0; a<ST_SIZ; a++)
-      arr[a]= (int)((out[a] + off) * adj);
+/*
+ * Output callback that reloads reload_text once reload_left octets have
+ * been written; a failed reload keeps the sequence playing.
+ */
+static int
+reload_write(void *opaque, char *buf, int siz)
+{
+    struct timespec t0, t1;
+    int r;
 
-   free(sinc);
-   free(out);
-   return 0;
+    if(reload_fd >= 0 && listener_write(&reload_fd, buf, siz) < 0)
+	return -1;
+    if(reload_left < 0 || (reload_left -= siz) > 0)
+	return 0;
+    reload_left = -1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r = sbagen_reload(reload_text);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if(r < 0)
+	fprintf(stderr, "reload: %s\n", sbagen_get_error());
+    else
+	fprintf(stderr, "reloaded in %.3fms\n", ms_between(&t0, &t1));
+    return 0;
 }
 
-// END //
+/* Checkpoint given with -k: file@ms */
 
-/* NG: Conversion to a library: entry points */
+static char *ckpt_file;
+static S64 ckpt_left = -1;	/* Octets to write before the checkpoint, or -1 */
+static S64 ckpt_done;		/* Octets written so far */
+static int ckpt_fd = 1;
 
-int
-sbagen_init(void)
+/*
+ * Output callback that saves a checkpoint to ckpt_file once ckpt_left
+ * octets have been written, and goes on; one that cannot be taken, as
+ * when playing from the cache, keeps the output going.
+ */
+static int
+ckpt_write(void *opaque, char *buf, int siz)
 {
-    if(sin_table == NULL)
-	if(init_sin_table() < 0)
-	    return -1;
+    struct timespec t0, t1;
+    char *data;
+    FILE *f;
+    int n;
+
+    if(listener_write(&ckpt_fd, buf, siz) < 0)
+	return -1;
+    ckpt_done += siz;
+    if(ckpt_left < 0 || (ckpt_left -= siz) > 0)
+	return 0;
+    ckpt_left = -1;
+    if((n = sbagen_checkpoint(NULL, 0)) < 0) {
+	fprintf(stderr, "checkpoint: %s\n", sbagen_get_error());
+	return 0;
+    }
+    if((data = malloc(n)) == NULL) {
+	error("Out of memory");
+	return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sbagen_checkpoint(data, n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if((f = fopen(ckpt_file, "w")) == NULL || fwrite(data, n, 1, f) != 1 ||
+	fclose(f) != 0) {
+	error("%s: %s", ckpt_file, strerror(errno));
+	free(data);
+	return -1;
+    }
+    free(data);
+    fprintf(stderr, "checkpoint of %d octets after %lld octets, taken in "
+	"%.3fms\n", n, (long long)ckpt_done, ms_between(&t0, &t1));
     return 0;
 }
 
 /*
- * rate: sample rate; default: 44100; option -r
- * prate: frequency recalculation, default: 10, option -R
- * fade: fade time (ms), default: 60000, option -F
- * roll: headphone roll-off compensation, option -c
+ * Restores the checkpoint saved in path for the sequence just parsed.
  */
-int
-sbagen_set_parameters(int rate, int prate, int fade, const char *roll)
+static int
+ckpt_restore(const char *path)
 {
-    if(rate != 0)
-	out_rate = rate;
-    if(prate != 0)
-	out_prate = prate;
-    if(fade != 0)
-	fade_int = fade;
-    if(roll != NULL)
-	if(setupOptC(roll) < 0)
+    struct timespec t0, t1;
+    char *data;
+    long n;
+    int r;
+
+    if((data = read_data(path, &n)) == NULL)
+	return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r = sbagen_restore(data, n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(data);
+    if(r == 0)
+	fprintf(stderr, "restored in %.3fms\n", ms_between(&t0, &t1));
+    return r;
+}
+
+/* Sequence read from standard input with -s, as it comes */
+
+static char *stream_text;
+static size_t stream_len, stream_alloc;
+static int stream_eof;
+static int stream_fd = 1;	/* Output, or -1 to discard it */
+static struct timespec stream_t0, stream_t1, stream_t2;
+
+/*
+ * Reads what standard input has, waiting for some, and hands the text so
+ * far to sbagen_stream(). Returns its result.
+ */
+static int
+stream_read(void)
+{
+    char *p;
+    ssize_t r;
+
+    if(stream_alloc - stream_len < 4096 + 1) {
+	stream_alloc = stream_alloc * 2 + 4096 + 1;
+	if((p = realloc(stream_text, stream_alloc)) == NULL) {
+	    error("Out of memory");
 	    return -1;
-    return 0;
+	}
+	stream_text = p;
+    }
+    while((r = read(0, stream_text + stream_len, 4096)) < 0 && errno == EINTR)
+	;
+    if(r < 0) {
+	error("stdin: %s", strerror(errno));
+	return -1;
+    }
+    stream_len += r;
+    stream_text[stream_len] = 0;
+    if(r == 0) {
+	stream_eof = 1;
+	clock_gettime(CLOCK_MONOTONIC, &stream_t2);
+    }
+    return sbagen_stream(stream_text, !stream_eof);
 }
 
-void
-sbagen_exit(void)
+/* Called by the engine when playback catches up with the input. */
+static int
+stream_wait_input(void *opaque)
 {
-    free(sin_table);
-    sin_table = NULL;
+    return stream_read() < 0 ? -1 : 0;
 }
 
-int
-sbagen_parse_seq(const char *seq)
+/* Output callback with -s, noting when the first block comes out. */
+static int
+stream_write(void *opaque, char *buf, int siz)
 {
-    int r = 0;
+    if(stream_t1.tv_sec == 0 && stream_t1.tv_nsec == 0)
+	clock_gettime(CLOCK_MONOTONIC, &stream_t1);
+    return stream_fd < 0 ? 0 : listener_write(&stream_fd, buf, siz);
+}
 
-    if(readSeq(seq) < 0) {
-	r = -1;
-    } else {
-	if(correctPeriods() < 0)
-	    r = -1;
-    }
-    while(nlist != NULL)
-	nlist = free_namedef(nlist);
-    return r;
+/*
+ * Batch rendering.
+ *
+ * The engine keeps its state in globals, so jobs are isolated in worker
+ * processes rather than threads. The sine table is computed once in the
+ * parent before forking, so all workers share its pages read-only. The
+ * parent hands the next file to whichever worker finishes first, so a long
+ * sequence never holds back the short ones queued behind it.
+ */
+
+struct Batch_job {
+    char *in;			// Input sequence file
+    char *out;			// Output raw PCM file
+    pid_t pid;			// Worker process, or 0
+    struct timeval start;	// Time the worker was started
+};
+
+static struct Batch_job *batch_jobs;
+static int batch_njobs, batch_ajobs;
+
+static int
+batch_has_suffix(const char *name, const char *suffix)
+{
+    size_t l = strlen(name), ls = strlen(suffix);
+
+    return l > ls && strcmp(name + l - ls, suffix) == 0;
 }
 
-void
-sbagen_free_seq(void)
+static int
+batch_cmp_jobs(const void *a, const void *b)
 {
-    Period *pn;
-    unsigned i;
+    return strcmp(((const struct Batch_job *)a)->in,
+	((const struct Batch_job *)b)->in);
+}
 
-    if(per != NULL) {
-	if(per->prv != NULL)
-	    per->prv->nxt = NULL;
-	for(; per != NULL; per = pn) {
-	    pn = per->nxt;
-	    free(per);
+static int
+batch_add_file(const char *path, const char *outdir)
+{
+    struct Batch_job *j;
+    const char *base;
+    size_t l;
+
+    if(batch_njobs == batch_ajobs) {
+	batch_ajobs = batch_ajobs ? batch_ajobs * 2 : 64;
+	j = realloc(batch_jobs, batch_ajobs * sizeof(*j));
+	if(j == NULL) {
+	    error("Out of memory");
+	    return -1;
 	}
+	batch_jobs = j;
     }
-    for(i = 0; i < sizeof(waves) / sizeof(*waves); i++)
-	free(waves[i]);
+    j = &batch_jobs[batch_njobs];
+    memset(j, 0, sizeof(*j));
+    if(outdir == NULL) {
+	outdir = ".";
+	base = path;
+    } else {
+	base = strrchr(path, '/');
+	base = base == NULL ? path : base + 1;
+    }
+    l = strlen(base);
+    if(batch_has_suffix(base, ".sbg"))
+	l -= 4;
+    j->in = StrDup((char *)path);
+    j->out = Alloc(strlen(outdir) + l + 6);
+    if(j->in == NULL || j->out == NULL) {
+	free(j->in);
+	free(j->out);
+	return -1;
+    }
+    if(base == path)
+	sprintf(j->out, "%.*s.raw", (int)l, base);
+    else
+	sprintf(j->out, "%s/%.*s.raw", outdir, (int)l, base);
+    batch_njobs++;
+    return 0;
 }
 
-int
-sbagen_run(void)
+static int
+batch_add(const char *path, const char *outdir)
 {
-   return(loop());
+    struct stat st;
+    struct dirent *de;
+    DIR *d;
+    char *p;
+    int first = batch_njobs;
+
+    if(stat(path, &st) < 0) {
+	error("%s: %s", path, strerror(errno));
+	return -1;
+    }
+    if(!S_ISDIR(st.st_mode))
+	return batch_add_file(path, outdir);
+    if((d = opendir(path)) == NULL) {
+	error("%s: %s", path, strerror(errno));
+	return -1;
+    }
+    while((de = readdir(d)) != NULL) {
+	if(!batch_has_suffix(de->d_name, ".sbg"))
+	    continue;
+	if((p = Alloc(strlen(path) + strlen(de->d_name) + 2)) == NULL)
+	    break;
+	sprintf(p, "%s/%s", path, de->d_name);
+	if(batch_add_file(p, outdir == NULL ? path : outdir) < 0) {
+	    free(p);
+	    break;
+	}
+	free(p);
+    }
+    closedir(d);
+    if(de != NULL)
+	return -1;
+    qsort(batch_jobs + first, batch_njobs - first, sizeof(*batch_jobs),
+	batch_cmp_jobs);
+    return 0;
 }
 
-char *
-sbagen_get_error(void)
+/* Runs in the worker process. */
+static void
+batch_render(struct Batch_job *j, rlim_t mem_limit)
 {
-    error_message[sizeof(error_message) - 1] = 0;
-    return error_message;
-}
-
-#ifdef BUILD_JNI
+    struct rlimit rl;
+    char *seq;
+    int fd;
 
-#include <assert.h>
-#include <jni.h>
-#include <android/log.h>
-#include "tmp/sbagen.h"
+    if(mem_limit != 0) {
+	rl.rlim_cur = rl.rlim_max = mem_limit;
+	setrlimit(RLIMIT_AS, &rl);
+    }
+    if((seq = read_file(j->in)) == NULL)
+	goto fail;
+    if(sbagen_parse_seq(seq) < 0)
+	goto fail;
+    free(seq);
+    if((fd = open(j->out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+	error("%s: %s", j->out, strerror(errno));
+	goto fail;
+    }
+    if(dup2(fd, 1) < 0) {
+	error("%s: %s", j->out, strerror(errno));
+	goto fail;
+    }
+    close(fd);
+    if(sbagen_run() < 0) {
+	unlink(j->out);
+	goto fail;
+    }
+    _exit(0);
+fail:
+    fprintf(stderr, "%s: %s\n", j->in, sbagen_get_error());
+    _exit(1);
+}
 
 static void
-die(JNIEnv *env, char c)
+batch_report(struct Batch_job *j, int status, struct rusage *ru)
 {
-    jclass e;
-    char *cl;
-
-    if((*env)->ExceptionOccurred(env))
-	return;
-    cl =
-	c == 'M' ? "java/lang/OutOfMemoryError" :
-	c == 'A' ? "java/lang/IllegalArgumentException" :
-	NULL;
-    e = (*env)->FindClass(env, cl);
-    (*env)->ThrowNew(env, e, sbagen_get_error());
+    struct timeval end;
+    double wall, cpu;
+
+    gettimeofday(&end, NULL);
+    wall = (end.tv_sec - j->start.tv_sec) +
+	(end.tv_usec - j->start.tv_usec) / 1E6;
+    cpu = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1E6 +
+	ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1E6;
+    fprintf(stderr, "%s: %s wall %.3fs cpu %.3fs maxrss %ldk\n",
+	j->in,
+	WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "ok" :
+	WIFSIGNALED(status) ? "killed" : "failed",
+	wall, cpu, ru->ru_maxrss);
 }
 
-void
-Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1init(
-    JNIEnv *env, jobject self)
+static void
+print_info(const char *path, struct sbagen_info *info)
 {
-    setbuf(stdout, NULL);
-    setbuf(stderr, NULL);
-    if(sbagen_init() < 0) {
-	die(env, 'M');
-	return;
-    }
+    static const char *names[] = {
+	NULL, "binaural", "pink", "bell", "spin", "mix", "wave"
+    };
+    int t;
+
+    printf("%s: duration ", path);
+    if(info->duration < 0)
+	printf("endless");
+    else
+	printf("%d:%02d:%02d.%03d", info->duration / 3600000,
+	    info->duration / 60000 % 60, info->duration / 1000 % 60,
+	    info->duration % 1000);
+    printf(" periods %d channels %d peak %.1f%% types", info->periods,
+	info->channels, info->peak);
+    for(t = 1; t <= SBAGEN_VOICE_WAVE; t++)
+	if(info->types & (1 << t))
+	    printf(" %s", names[t]);
+    printf("\n");
 }
 
-void
-Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1set_1parameters(
-    JNIEnv *env, jobject self,
-    jint rate, jint prate, jint fade, jstring jroll)
+/*
+ * Prints the summary of the sequence in path.
+ */
+static int
+query(const char *path)
 {
-    const char *roll;
+    struct sbagen_info info;
+    char *buf;
     int r;
 
-    if(jroll == NULL) {
-	roll = NULL;
-    } else {
-	if((roll = (*env)->GetStringUTFChars(env, jroll, NULL)) == NULL)
-	    return;
-    }
-    r = sbagen_set_parameters(rate, prate, fade, roll);
-    if(roll != NULL)
-	(*env)->ReleaseStringUTFChars(env, jroll, roll);
+    if((buf = read_file(path)) == NULL)
+	return -1;
+    r = sbagen_query(buf, &info);
+    free(buf);
     if(r < 0)
-	die(env, 'A');
+	return -1;
+    print_info(path, &info);
+    sbagen_free_seq();
+    return 0;
 }
 
-void
-Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1exit(
-    JNIEnv *env, jobject self)
+/*
+ * Prints the summary of each sequence of dir like query(), as listed by
+ * sbagen_index() with its index file in index, then the time taken to
+ * read the index file and to scan the directory.
+ */
+static int
+index_list(const char *dir, const char *index, int jobs)
 {
-    sbagen_exit();
+    struct sbagen_entry *e;
+    struct timespec t0, t1, t2;
+    int i, n;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if((n = sbagen_index(dir, "*.sbg*", index, jobs, 0, &e)) < 0)
+	return -1;
+    sbagen_free_index(e, n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if((n = sbagen_index(dir, "*.sbg*", index, jobs, 1, &e)) < 0)
+	return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    for(i = 0; i < n; i++) {
+	if(e[i].name[strlen(e[i].name) - 1] == '/')
+	    printf("%s\n", e[i].name);
+	else if(e[i].error != NULL)
+	    printf("%s: error: %s\n", e[i].name, e[i].error);
+	else
+	    print_info(e[i].name, &e[i].info);
+    }
+    sbagen_free_index(e, n);
+    fprintf(stderr, "%s: %d entries, index read in %.3fms, scanned in "
+	"%.3fms\n", dir, n, ms_between(&t0, &t1), ms_between(&t1, &t2));
+    return 0;
 }
 
-void
-Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1parse_1seq(
-    JNIEnv *env, jobject self, jstring jseq)
-{
-    const char *seq;
+struct Preview_job {
+    struct sbagen_timeline *tl;
+    int n;
+    float *data;
     int r;
+};
 
-    if((seq = (*env)->GetStringUTFChars(env, jseq, NULL)) == NULL)
-	return;
-    r = sbagen_parse_seq(seq);
-    (*env)->ReleaseStringUTFChars(env, jseq, seq);
-    if(r < 0)
-	die(env, 'A');
+static void *
+preview_thread(void *opaque)
+{
+    struct Preview_job *j = opaque;
+
+    j->r = sbagen_timeline_preview(j->tl, j->n, j->data);
+    return NULL;
 }
 
-void
-Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1free_1seq(
-    JNIEnv *env, jobject self)
+/*
+ * Prints n points of the preview of the sequence in path, one per line:
+ * time, total amplitude, then carrier, beat and amplitude of each channel.
+ * It is computed from the timeline of the sequence once it is freed, by
+ * jobs threads at once, all of which must find the same.
+ */
+static int
+preview(const char *path, int n, int jobs)
 {
+    struct sbagen_info info;
+    struct sbagen_timeline *tl;
+    struct Preview_job j[16];
+    pthread_t th[16];
+    struct timespec t0, t1;
+    float *data;
+    char *buf;
+    int r, i, a, w, nth;
+
+    if((buf = read_file(path)) == NULL)
+	return -1;
+    r = sbagen_query(buf, &info);
+    free(buf);
+    tl = r < 0 ? NULL : sbagen_timeline_get();
     sbagen_free_seq();
+    if(tl == NULL)
+	return -1;
+    if(jobs < 1)
+	jobs = 1;
+    if(jobs > (int)(sizeof(th) / sizeof(*th)))
+	jobs = sizeof(th) / sizeof(*th);
+    w = 1 + 3 * info.channels;
+    if((data = Alloc(jobs * n * w * sizeof(float))) == NULL) {
+	sbagen_timeline_put(tl);
+	return -1;
+    }
+    for(i = 0; i < jobs; i++) {
+	j[i].tl = tl;
+	j[i].n = n;
+	j[i].data = data + i * n * w;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(nth = 1; nth < jobs; nth++)
+	if(pthread_create(&th[nth], NULL, preview_thread, &j[nth]) != 0)
+	    break;
+    preview_thread(&j[0]);
+    for(i = 1; i < nth; i++)
+	pthread_join(th[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for(i = 0, r = 0; i < nth && r == 0; i++)
+	if((r = j[i].r) == 0 && memcmp(j[i].data, data, n * w * sizeof(float))) {
+	    error("The previews of the threads differ");
+	    r = -1;
+	}
+    if(r == 0) {
+	printf("# %s: %d points in %.3fms", path, n,
+	    (t1.tv_sec - t0.tv_sec) * 1E3 + (t1.tv_nsec - t0.tv_nsec) / 1E6);
+	if(nth > 1)
+	    printf(", %d times at once", nth);
+	printf("\n");
+	for(i = 0; i < n; i++) {
+	    printf("%.3f", (info.duration < 0 ? H24 : info.duration) *
+		(double)i / (n - 1) / 1000);
+	    for(a = 0; a < w; a++)
+		printf(" %g", data[i * w + a]);
+	    printf("\n");
+	}
+    }
+    free(data);
+    sbagen_timeline_put(tl);
+    return r;
 }
 
-static JNIEnv *output_env;
-static jobject output_self;
-static jmethodID output_method;
-
+/*
+ * Parses and frees the sequence in path n times, and reports the average
+ * time of each and the peak memory use; with -L, also the time to reload
+ * the other sequence after each parse.
+ */
 static int
-writeOut(char *buf, int siz)
+parse_bench(const char *path, int n)
 {
-    jshortArray *a;
-    int r = 0;
+    struct timespec t0, t1, t2, t3;
+    struct rusage ru;
+    double parse = 0, reload = 0, free_t = 0;
+    char *buf;
+    int i;
 
-    siz /= 2;
-    if((a = (*output_env)->NewShortArray(output_env, siz)) == NULL)
-	return(-1);
-    (*output_env)->SetShortArrayRegion(output_env, a, 0, siz, (jshort *)buf);
-    (*output_env)->CallVoidMethod(output_env, output_self, output_method, a);
-    if((*output_env)->ExceptionOccurred(output_env))
-	r = -1;
-    (*output_env)->DeleteLocalRef(output_env, a);
-    return(r);
+    if((buf = read_file(path)) == NULL)
+	return -1;
+    for(i = 0; i < n; i++) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(sbagen_parse_seq(buf) < 0) {
+	    sbagen_free_seq();
+	    free(buf);
+	    return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if(reload_text != NULL && sbagen_reload(reload_text) < 0) {
+	    sbagen_free_seq();
+	    free(buf);
+	    return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	sbagen_free_seq();
+	clock_gettime(CLOCK_MONOTONIC, &t3);
+	parse += ms_between(&t0, &t1);
+	reload += ms_between(&t1, &t2);
+	free_t += ms_between(&t2, &t3);
+    }
+    free(buf);
+    getrusage(RUSAGE_SELF, &ru);
+    if(reload_text != NULL)
+	fprintf(stderr, "%s: parse %.3fms reload %.3fms free %.3fms "
+	    "maxrss %ldk\n", path, parse / n, reload / n, free_t / n,
+	    ru.ru_maxrss);
+    else
+	fprintf(stderr, "%s: parse %.3fms free %.3fms maxrss %ldk\n",
+	    path, parse / n, free_t / n, ru.ru_maxrss);
+    return 0;
 }
 
-void
-Java_org_cigaes_binaural_1player_Binaural_1decoder_sbagen_1run(
-    JNIEnv *env, jobject self)
+/*
+ * Renders every job with at most nworkers processes at a time, each
+ * limited to an equal share of mem_total bytes of address space (0 for no
+ * limit). Returns the number of failed jobs.
+ */
+static int
+batch_run(int nworkers, rlim_t mem_total)
 {
-    jclass class;
-
-    __android_log_print(ANDROID_LOG_INFO, "sbagen", "sbagen started");
-    output_env = env;
-    output_self = self;
-    class = (*env)->GetObjectClass(env, self);
-    output_method = (*env)->GetMethodID(env, class, "out", "([S)V");
-    assert(output_method != NULL);
-    if(sbagen_run() < 0)
-	die(env, 'A');
-    __android_log_print(ANDROID_LOG_INFO, "sbagen", "sbagen finished");
+    struct rusage ru;
+    int next = 0, running = 0, failed = 0;
+    int status, i;
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    while(next < batch_njobs || running > 0) {
+	if(next < batch_njobs && running < nworkers) {
+	    struct Batch_job *j = &batch_jobs[next++];
+	    gettimeofday(&j->start, NULL);
+	    if((pid = fork()) < 0) {
+		fprintf(stderr, "%s: fork: %s\n", j->in, strerror(errno));
+		failed++;
+		continue;
+	    }
+	    if(pid == 0)
+		batch_render(j, mem_total / nworkers);
+	    j->pid = pid;
+	    running++;
+	    continue;
+	}
+	if((pid = wait4(-1, &status, 0, &ru)) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    perror("wait");
+	    break;
+	}
+	for(i = 0; i < next; i++)
+	    if(batch_jobs[i].pid == pid)
+		break;
+	if(i == next)
+	    continue;
+	batch_jobs[i].pid = 0;
+	running--;
+	batch_report(&batch_jobs[i], status, &ru);
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    failed++;
+    }
+    return failed;
 }
 
-#elif BUILD_STANDALONE_TEST
+static void
+usage(void)
+{
+    fprintf(stderr,
+	"Usage: sbagen-test file.sbg... > out.raw\n"
+	"       sbagen-test -b [-j jobs] [-m megabytes] [-o outdir] "
+	"file.sbg|dir...\n"
+	"Options: -T trace.json  record trace events\n"
+	"         -l file[:gain[:start_ms[:roll]]]  render a listener to file\n"
+	"         -O null|file.wav  discard the output or write a WAV file\n"
+	"         -P count  only parse and free each file count times\n"
+	"         -L file[@ms]  reload file after ms of output, or after\n"
+	"                   each parse with -P\n"
+	"         -s  play the sequence on standard input as it comes\n"
+	"         -x file.wav|file.raw  mix file into the output\n"
+	"         -k file@ms  save a checkpoint to file after ms of output\n"
+	"         -K file  go on from the checkpoint in file\n"
+	"         -G table|rotate  kernel for the binaural tones\n"
+	"         -f s16|s24|f32[p]  output sample format, p for planar\n"
+	"         -q  print the duration and contents of each file\n"
+	"         -I index  print those of each file of the directories,\n"
+	"                   keeping their index in index\n"
+	"         -p points  print a preview of each file, computed\n"
+	"                   -j times at once\n"
+	"         -F priority  render with SCHED_FIFO at priority\n"
+	"         -M  lock the memory while rendering\n"
+	"         -B min[:max]  write blocks of min to max frames\n"
+	"         -W  background mode: write blocks of max frames\n"
+	"         -C dir  cache rendered output in dir\n"
+	"         -S megabytes  cache size limit (default 1024)\n");
+    exit(1);
+}
 
 static int
-writeOut(char *buf, int siz) {
-    int rv;
+parse_format(const char *s)
+{
+    static const char *names[] = { "s16", "s24", "f32" };
+    unsigned i;
 
-    while (-1 != (rv= write(out_fd, buf, siz))) {
-	if (0 == (siz -= rv)) return 0;
-	buf += rv;
+    for(i = 0; i < sizeof(names) / sizeof(*names); i++) {
+	if(strncmp(s, names[i], 3) != 0)
+	    continue;
+	if(s[3] == 0)
+	    return i;
+	if(strcmp(s + 3, "p") == 0)
+	    return i | SBAGEN_FMT_PLANAR;
     }
-    error("Output error");
-    return(-1);
+    usage();
+    return -1;
 }
 
 int 
 main(int argc, char **argv)
 {
-    int i, l;
-    FILE *f;
+    int i, opt;
     char *buf;
-
+    int batch = 0, nworkers = 0;
+    long mem_mb = 0;
+    const char *outdir = NULL;
+    const char *trace = NULL;
+    const char *cache = NULL;
+    long cache_mb = 1024;
+    char *listen[64];
+    int nlisten = 0;
+    const char *output_arg = NULL;
+    int parse_count = 0, query_only = 0, preview_points = 0;
+    int rt_prio = 0, rt_mlock = 0;
+    int blk_lo = 0, blk_hi = 0;
+    char *reload = NULL;
+    long reload_ms = 0;
+    int stream = 0;
+    const char *index = NULL;
+    const char *mix = NULL;
+    const char *restore = NULL;
+    long ckpt_ms = 0;
+    int format = SBAGEN_FMT_S16;
+    int kernel = SBAGEN_KERNEL_TABLE;
+    char *p;
+
+    while((opt = getopt(argc, argv,
+	"bj:m:o:T:C:S:l:O:P:qp:F:MB:WL:sI:x:f:k:K:G:")) != -1) {
+	switch(opt) {
+	    case 'b':
+		batch = 1;
+		break;
+	    case 'j':
+		nworkers = atoi(optarg);
+		break;
+	    case 'm':
+		mem_mb = atol(optarg);
+		break;
+	    case 'o':
+		outdir = optarg;
+		break;
+	    case 'T':
+		trace = optarg;
+		break;
+	    case 'C':
+		cache = optarg;
+		break;
+	    case 'S':
+		cache_mb = atol(optarg);
+		break;
+	    case 'O':
+		output_arg = optarg;
+		break;
+	    case 'P':
+		parse_count = atoi(optarg);
+		break;
+	    case 'q':
+		query_only = 1;
+		break;
+	    case 'p':
+		preview_points = atoi(optarg);
+		break;
+	    case 'F':
+		rt_prio = atoi(optarg);
+		break;
+	    case 'M':
+		rt_mlock = 1;
+		break;
+	    case 'B':
+		blk_lo = blk_hi = strtol(optarg, &p, 10);
+		if(*p == ':')
+		    blk_hi = atoi(p + 1);
+		break;
+	    case 'W':
+		sbagen_set_mode(SBAGEN_MODE_BACKGROUND);
+		break;
+	    case 'L':
+		reload = optarg;
+		if((p = strchr(reload, '@')) != NULL) {
+		    *p++ = 0;
+		    reload_ms = atol(p);
+		}
+		break;
+	    case 's':
+		stream = 1;
+		break;
+	    case 'I':
+		index = optarg;
+		break;
+	    case 'x':
+		mix = optarg;
+		break;
+	    case 'f':
+		format = parse_format(optarg);
+		break;
+	    case 'k':
+		ckpt_file = optarg;
+		if((p = strchr(ckpt_file, '@')) == NULL)
+		    usage();
+		*p++ = 0;
+		ckpt_ms = atol(p);
+		break;
+	    case 'K':
+		restore = optarg;
+		break;
+	    case 'G':
+		if(strcmp(optarg, "table") == 0)
+		    kernel = SBAGEN_KERNEL_TABLE;
+		else if(strcmp(optarg, "rotate") == 0)
+		    kernel = SBAGEN_KERNEL_ROTATE;
+		else
+		    usage();
+		break;
+	    case 'l':
+		if(nlisten == (int)(sizeof(listen) / sizeof(*listen)))
+		    usage();
+		listen[nlisten++] = optarg;
+		break;
+	    default:
+		usage();
+	}
+    }
+#if SBAGEN_TRACE
+    if(trace != NULL)
+	sbagen_trace_enable(1);
+#else
+    if(trace != NULL) {
+	fprintf(stderr, "Error: built without SBAGEN_TRACE\n");
+	exit(1);
+    }
+#endif
     if(sbagen_init() < 0) {
 	fprintf(stderr, "Error: %s\n", sbagen_get_error());
 	exit(1);
     }
-    if(sbagen_set_parameters(0, 0, 0, NULL) < 0) {
+    if(sbagen_set_parameters(0, 0, 0, NULL) < 0 ||
+	sbagen_set_cache(cache, cache_mb << 20) < 0 ||
+	sbagen_set_realtime(rt_prio, rt_mlock) < 0 ||
+	sbagen_set_kernel(kernel) < 0 ||
+	sbagen_set_blocks(blk_lo, blk_hi) < 0 ||
+	(mix != NULL && sbagen_set_mix(mix) < 0) ||
+	(output_arg != NULL && sbagen_set_output(strcmp(output_arg, "null") ?
+	    SBAGEN_OUT_WAV : SBAGEN_OUT_NULL, -1, output_arg) < 0) ||
+	sbagen_set_output_format(format) < 0) {
 	fprintf(stderr, "Error: %s\n", sbagen_get_error());
 	exit(1);
     }
-    for(i = 1; i < argc; i++) {
-	if((f = fopen(argv[i], "r")) == NULL) {
-	    perror(argv[i]);
+    if(reload != NULL) {
+	if((reload_text = read_file(reload)) == NULL) {
+	    fprintf(stderr, "Error: %s\n", sbagen_get_error());
+	    exit(1);
+	}
+	if(output_arg != NULL && strcmp(output_arg, "null"))
+	    usage();
+	if(output_arg != NULL)
+	    reload_fd = -1;
+	reload_left = (S64)reload_ms * out_rate / 1000 * 4;
+	if(parse_count == 0 && sbagen_set_output_callback(reload_write, NULL,
+	    0, SBAGEN_FMT_S16) < 0) {
+	    fprintf(stderr, "Error: %s\n", sbagen_get_error());
+	    exit(1);
+	}
+    }
+    if(ckpt_file != NULL) {
+	if(reload != NULL || nlisten || output_arg != NULL)
+	    usage();
+	ckpt_left = (S64)ckpt_ms * out_rate / 1000 * fmtBytes(format);
+	if(sbagen_set_output_callback(ckpt_write, NULL, 0, format) < 0) {
+	    fprintf(stderr, "Error: %s\n", sbagen_get_error());
+	    exit(1);
+	}
+    }
+    if(batch) {
+	int failed;
+
+	for(i = optind; i < argc; i++) {
+	    if(batch_add(argv[i], outdir) < 0) {
+		fprintf(stderr, "Error: %s\n", sbagen_get_error());
+		exit(1);
+	    }
+	}
+	if(nworkers <= 0)
+	    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers <= 0)
+	    nworkers = 1;
+	failed = batch_run(nworkers, (rlim_t)mem_mb << 20);
+	fprintf(stderr, "%d files, %d failed\n", batch_njobs, failed);
+	for(i = 0; i < batch_njobs; i++) {
+	    free(batch_jobs[i].in);
+	    free(batch_jobs[i].out);
+	}
+	free(batch_jobs);
+	sbagen_exit();
+	return failed ? 1 : 0;
+    }
+    if(stream) {
+	int r;
+
+	if(optind != argc || reload != NULL || nlisten || parse_count ||
+	    query_only || preview_points)
+	    usage();
+	if(output_arg != NULL && strcmp(output_arg, "null"))
+	    usage();
+	if(output_arg != NULL)
+	    stream_fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &stream_t0);
+	while((r = stream_read()) == 0 && !stream_eof)
+	    ;
+	if(r <= 0 || sbagen_set_output_callback(stream_write, NULL, 0,
+	    SBAGEN_FMT_S16) < 0) {
+	    fprintf(stderr, "Error: %s\n", r == 0 ? "No time lines in the "
+		"sequence" : sbagen_get_error());
+	    exit(1);
+	}
+	sbagen_set_stream_wait(stream_wait_input, NULL);
+	if(sbagen_run() < 0) {
+	    fprintf(stderr, "Error: %s\n", sbagen_get_error());
+	    exit(1);
+	}
+	fprintf(stderr, "first output after %.3fms, input complete after "
+	    "%.3fms\n", ms_between(&stream_t0, &stream_t1),
+	    ms_between(&stream_t0, &stream_t2));
+	sbagen_free_seq();
+	sbagen_exit();
+	free(stream_text);
+	return 0;
+    }
+    if(optind == argc)
+	usage();
+    if(index != NULL) {
+	int failed = 0;
+
+	if(nworkers <= 0)
+	    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	for(i = optind; i < argc; i++) {
+	    if(index_list(argv[i], index, nworkers) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[i], sbagen_get_error());
+		failed++;
+	    }
+	}
+	sbagen_exit();
+	return failed ? 1 : 0;
+    }
+    if(query_only || preview_points) {
+	int failed = 0;
+
+	for(i = optind; i < argc; i++) {
+	    if((preview_points ? preview(argv[i], preview_points, nworkers) :
+		query(argv[i])) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[i], sbagen_get_error());
+		failed++;
+	    }
+	}
+	sbagen_exit();
+	return failed ? 1 : 0;
+    }
+    if(parse_count > 0) {
+	for(i = optind; i < argc; i++) {
+	    if(parse_bench(argv[i], parse_count) < 0) {
+		fprintf(stderr, "Error: %s\n", sbagen_get_error());
+		exit(1);
+	    }
+	}
+	sbagen_exit();
+	return 0;
+    }
+    for(i = optind; i < argc; i++) {
+	if((buf = read_file(argv[i])) == NULL) {
+	    fprintf(stderr, "Error: %s\n", sbagen_get_error());
 	    exit(1);
 	}
-	fseek(f, 0, SEEK_END);
-	l = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	buf = malloc(l + 1);
-	l = fread(buf, 1, l, f);
-	buf[l] = 0;
-	fclose(f);
 	if(sbagen_parse_seq(buf) < 0) {
 	    sbagen_free_seq();
 	    sbagen_exit();
@@ -1892,7 +7978,19 @@ main(int argc, char **argv)
 	}
 	free(buf);
     }
-    if(sbagen_run() < 0) {
+    if(restore != NULL && ckpt_restore(restore) < 0) {
+	sbagen_free_seq();
+	sbagen_exit();
+	fprintf(stderr, "Error: %s\n", sbagen_get_error());
+	exit(1);
+    }
+    for(i = 0; i < nlisten; i++) {
+	if(listener_add(listen[i]) < 0) {
+	    fprintf(stderr, "Error: %s\n", sbagen_get_error());
+	    exit(1);
+	}
+    }
+    if((nlisten ? sbagen_run_listeners() : sbagen_run()) < 0) {
 	sbagen_free_seq();
 	sbagen_exit();
 	fprintf(stderr, "Error: %s\n", sbagen_get_error());
@@ -1900,12 +7998,109 @@ main(int argc, char **argv)
     }
     sbagen_free_seq();
     sbagen_exit();
+    free(reload_text);
+    for(i = 0; i < listener_nfds; i++)
+	close(listener_fds[i]);
+#if SBAGEN_TRACE
+    if(trace != NULL && sbagen_trace_dump(trace) < 0) {
+	fprintf(stderr, "Error: %s\n", sbagen_get_error());
+	exit(1);
+    }
+#endif
+
+    return 0;
+}
+
+#elif BUILD_FUZZ
+
+/*
+ * Fuzzing harness for the parser, for libFuzzer (LLVMFuzzerTestOneInput)
+ * or, with FUZZ_MAIN, for AFL and plain replay (one input on stdin).
+ * Any input that parses longer than FUZZ_TIME_MS or allocates more than
+ * FUZZ_MEM_MB aborts, so the fuzzer reports it as a crash.
+ */
+
+#ifndef FUZZ_TIME_MS
+# define FUZZ_TIME_MS 1000
+#endif
+#ifndef FUZZ_MEM_MB
+# define FUZZ_MEM_MB 128
+#endif
 
+static int
+writeOut(char *buf, int siz)
+{
+    return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct timespec t0, t1;
+    char *seq;
+    long ms;
+
+    if(sbagen_init() < 0)
+	return 0;
+    if((seq = malloc(size + 1)) == NULL)
+	return 0;
+    memcpy(seq, data, size);
+    seq[size] = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sbagen_parse_seq(seq);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sbagen_free_seq();
+    free(seq);
+    ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+    if(ms > FUZZ_TIME_MS) {
+	fprintf(stderr, "parse took %ld ms (budget %d ms)\n", ms, FUZZ_TIME_MS);
+	abort();
+    }
+    if(parse_mem > (size_t)FUZZ_MEM_MB << 20) {
+	fprintf(stderr, "parse allocated %lu bytes (budget %d MB)\n",
+	    (unsigned long)parse_mem, FUZZ_MEM_MB);
+	abort();
+    }
+    return 0;
+}
+
+#ifdef FUZZ_MAIN
+
+int
+main(int argc, char **argv)
+{
+    char *buf = NULL, *nb;
+    size_t size = 0, alloc = 0;
+    ssize_t r;
+
+    while(1) {
+	if(size == alloc) {
+	    alloc = alloc ? alloc * 2 : 65536;
+	    if((nb = realloc(buf, alloc)) == NULL)
+		abort();
+	    buf = nb;
+	}
+	if((r = read(0, buf + size, alloc - size)) <= 0)
+	    break;
+	size += r;
+    }
+    LLVMFuzzerTestOneInput((uint8_t *)buf, size);
+    free(buf);
+    sbagen_exit();
     return 0;
 }
 
+#endif
+
 #else
 
-# error Please define the build mode.
+/* Library build: the host selects an output with sbagen_set_output*() */
+
+static int
+writeOut(char *buf, int siz)
+{
+    error("No output selected");
+    return(-1);
+}
 
 #endif